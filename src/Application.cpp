@@ -9,6 +9,8 @@
 #include <limits>
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <exception>
 
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_beta.h>
@@ -27,10 +29,8 @@
 const std::vector<const char *> validationLayers = {
         "VK_LAYER_KHRONOS_validation"
 };
+// required unless headless
 const std::vector<const char *> deviceExtensions = {
-        // fixme: The Vulkan spec states: If the VK_KHR_portability_subset extension is included in
-        //  pProperties of vkEnumerateDeviceExtensionProperties, ppEnabledExtensionNames must include "VK_KHR_portability_subset"
-        VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME,
         VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
@@ -60,9 +60,29 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMessengerEXT
 }
 
 void Application::run() {
-    initWindow();
+    if (benchFrameCount > 0) {
+        fixedDeltaTime = BENCH_DELTA_TIME;
+        randomSeed = BENCH_SEED;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    if (!headless) {
+        initWindow();
+    }
     initVulkan();
-    initImGui();
+    if (!headless) {
+        initImGui();
+    }
+    startupMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime)
+            .count();
+    // A warm start skips driver shader compilation, the difference to a cold one is mostly pipeline creation.
+    // A benchmark report on stdout has it already and should stay valid JSON.
+    if (benchFrameCount == 0 || !benchReportPath.empty()) {
+        std::cout << "startup: " << startupMilliseconds << " ms, pipeline cache "
+                  << (pipelineCache.isWarm() ? "warm (" + std::to_string(pipelineCache.getLoadedSize()) + " bytes)"
+                                             : std::string("cold")) << "\n";
+    }
+
     mainLoop();
     cleanup();
 }
@@ -97,11 +117,21 @@ void Application::initVulkan() {
     createSurface();
     pickPhysicalDevice();
     createLogicalDevice();
+    pipelineCache.init(physicalDevice, device, pipelineCachePath);
+    threadPool.init();
+    for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+        if (rendererStates[i].hinted) {
+            hintRenderer(Renderers[i]);
+        }
+    }
     createSwapChain();
     createSwapChainImageViews();
     createCommandPool();
     createCommandBuffer();
+    createTimelineSemaphores();
     createSyncObjects();
+    gpuProfiler.init(physicalDevice, device, MAX_FRAMES_IN_FLIGHT);
+    stagingRing.init(this, STAGING_RING_SIZE);
     createDescriptorPool(
             {meshDrawer->getDescriptorPoolRequirement(), particleDrawer->getDescriptorPoolRequirement()}
     );
@@ -112,8 +142,9 @@ void Application::initVulkan() {
     createDepthResources();
     createFramebuffers();
 
-    meshDrawer->init(this);
-    particleDrawer->init(this);
+    // only the selected renderer, the others wait until they are picked from the Renderer combo
+    // depth transition and the renderer's uploads go out in one submission
+    initRenderer(rendererIndex);
 }
 
 void Application::initImGui() {
@@ -134,23 +165,46 @@ void Application::initImGui() {
     initInfo.Device = device;
     initInfo.QueueFamily = familyIndices.graphicsComputeFamily.value();
     initInfo.Queue = graphicsComputeQueue;
-    initInfo.PipelineCache = nullptr;
+    initInfo.PipelineCache = pipelineCache.get();
     initInfo.DescriptorPool = descriptorPool;
     initInfo.Subpass = 0;
     initInfo.MinImageCount = 2;
-    initInfo.ImageCount = 2;
+    // ImGui cycles its vertex/index buffers through ImageCount slots, one per frame that can be in flight
+    initInfo.ImageCount = MAX_FRAMES_IN_FLIGHT;
     initInfo.MSAASamples = msaaSamples;
     initInfo.Allocator = nullptr;
     initInfo.CheckVkResultFn = nullptr;
     ImGui_ImplVulkan_Init(&initInfo, renderPass);
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-    ImGui_ImplVulkan_CreateFontsTexture(commandBuffer);
-    endSingleTimeCommands(commandBuffer);
+    ImGui_ImplVulkan_CreateFontsTexture(beginUploadGraphics());
+    waitUpload(submitUpload());
     ImGui_ImplVulkan_DestroyFontUploadObjects();
 }
 
 void Application::mainLoop() {
+    if (benchFrameCount > 0) {
+        runBenchmark();
+        return;
+    }
+
+    if (headless) {
+        auto startTime = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < headlessFrameCount; ++i) {
+            drawFrame();
+        }
+        vkDeviceWaitIdle(device);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        std::cout << headlessFrameCount << " frames in " << seconds << " s, "
+                  << (seconds > 0 ? headlessFrameCount / seconds : 0.0) << " fps\n";
+
+        if (headlessFrameCount > 0 && !headlessOutputPath.empty()) {
+            uint32_t lastImage = (nextOffscreenImage + swapChainImages.size() - 1) % swapChainImages.size();
+            saveOffscreenImage(swapChainImages[lastImage], headlessOutputPath);
+        }
+        return;
+    }
+
     while (!glfwWindowShouldClose(window)) {
         // glfwPollEvents ->
         // _glfwPollEventsWin32 / _glfwPollEventsCocoa / _glfwPollEventsX11 ->
@@ -172,13 +226,63 @@ void Application::mainLoop() {
     vkDeviceWaitIdle(device);
 }
 
+void Application::runBenchmark() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    benchmark.rendererName = Renderers[rendererIndex];
+    benchmark.deviceName = properties.deviceName;
+    benchmark.warmupFrames = benchWarmupFrames;
+    benchmark.framesInFlight = framesInFlight;
+    benchmark.fixedDeltaTime = fixedDeltaTime;
+    benchmark.randomSeed = randomSeed;
+    benchmark.startupMilliseconds = startupMilliseconds;
+    benchmark.pipelineCacheWarm = pipelineCache.isWarm();
+
+    uint64_t lastFrame = frameNumber + benchWarmupFrames + benchFrameCount;
+    auto previousTime = std::chrono::steady_clock::now();
+    while (frameNumber < lastFrame && (headless || !glfwWindowShouldClose(window))) {
+        if (!headless) {
+            glfwPollEvents();
+        }
+
+        uint64_t number = frameNumber;
+        uint64_t submits = submitCount;
+        drawFrame();
+
+        // the time between the ends of consecutive frames, waits for the GPU and the swapchain included
+        auto currentTime = std::chrono::steady_clock::now();
+        // frames dropped for an out of date swapchain aren't counted
+        if (frameNumber != number) {
+            double milliseconds = std::chrono::duration<double, std::milli>(currentTime - previousTime).count();
+            benchmark.addFrame(number, milliseconds, static_cast<uint32_t>(submitCount - submits));
+        }
+        previousTime = currentTime;
+    }
+
+    vkDeviceWaitIdle(device);
+    for (uint32_t i = 0; i < framesInFlight; ++i) {
+        readFrameTimestamps(i);
+    }
+
+    if (benchReportPath.empty()) {
+        benchmark.writeReport(std::cout);
+        return;
+    }
+    std::ofstream file(benchReportPath);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file! " + benchReportPath);
+    }
+    benchmark.writeReport(file);
+}
+
 void Application::cleanupSwapChain() {
     vkDestroyImageView(device, colorImageView, nullptr);
     vkDestroyImage(device, colorImage, nullptr);
-    vkFreeMemory(device, colorImageMemory, nullptr);
+    allocator.free(colorImageMemory);
     vkDestroyImageView(device, depthImageView, nullptr);
     vkDestroyImage(device, depthImage, nullptr);
-    vkFreeMemory(device, depthImageMemory, nullptr);
+    allocator.free(depthImageMemory);
 
     for (auto &swapChainFramebuffer: swapChainFramebuffers) {
         vkDestroyFramebuffer(device, swapChainFramebuffer, nullptr);
@@ -188,54 +292,90 @@ void Application::cleanupSwapChain() {
         vkDestroyImageView(device, swapChainImageViews[i], nullptr);
     }
 
+    if (headless) {
+        for (int i = 0; i < swapChainImages.size(); ++i) {
+            vkDestroyImage(device, swapChainImages[i], nullptr);
+            allocator.free(offscreenImageMemories[i]);
+        }
+        offscreenImageMemories.clear();
+        return;
+    }
+
     vkDestroySwapchainKHR(device, swapChain, nullptr);
 }
 
 void Application::cleanup() {
-    meshDrawer->cleanup();
-    particleDrawer->cleanup();
+    // the device is idle, so everything deferred can go now
+    collectUploads();
+    for (auto &batch: uploadsToAcquire) {
+        vkFreeCommandBuffers(device, transientCommandPool, 1, &batch.graphicsCommandBuffer);
+    }
+    uploadsToAcquire.clear();
+    collectReleases();
 
-    ImGui_ImplVulkan_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+        if (rendererStates[i].loading.valid()) {
+            rendererStates[i].loading.wait();
+        }
+        if (rendererStates[i].initialized) {
+            getRenderer(i)->cleanup();
+        }
+    }
+
+    if (!headless) {
+        ImGui_ImplVulkan_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+    }
 
     cleanupSwapChain();
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
     vkDestroyRenderPass(device, renderPass, nullptr);
+    vkDestroyRenderPass(device, earlyRenderPass, nullptr);
+    vkDestroyRenderPass(device, lateRenderPass, nullptr);
 
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-        vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-        vkDestroyFence(device, inFlightFences[i], nullptr);
-
-        vkDestroySemaphore(device, computeFinishedSemaphores[i], nullptr);
-        vkDestroyFence(device, computeInFlightFences[i], nullptr);
-    }
+    cleanupSyncObjects();
+    gpuProfiler.cleanup();
+    vkDestroySemaphore(device, graphicsTimeline, nullptr);
+    vkDestroySemaphore(device, computeTimeline, nullptr);
+    vkDestroySemaphore(device, uploadTimeline, nullptr);
 
+    vkDestroyCommandPool(device, computeCommandPool, nullptr);
+    vkDestroyCommandPool(device, uploadCommandPool, nullptr);
     vkDestroyCommandPool(device, transientCommandPool, nullptr);
     vkDestroyCommandPool(device, commandPool, nullptr);
 
+    threadPool.cleanup();
+    pipelineCache.save();
+    pipelineCache.cleanup();
+    stagingRing.cleanup();
+    allocator.cleanup();
     vkDestroyDevice(device, nullptr);
 
     if (enableValidationLayers) {
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
     }
 
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (!headless) {
+        vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
     vkDestroyInstance(instance, nullptr);
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
 }
 
 void Application::recreateSwapChain() {
     int width = 0, height = 0;
-    glfwGetFramebufferSize(window, &width, &height);
-    while (width == 0 || height == 0) {
-        glfwWaitEvents();
+    while (!headless && (width == 0 || height == 0)) {
         glfwGetFramebufferSize(window, &width, &height);
+        if (width == 0 || height == 0) {
+            glfwWaitEvents();
+        }
     }
 //        std::cout << "recreateSwapChain. " << "width: " << width << ", height: " << height << "\n";
 
@@ -248,6 +388,7 @@ void Application::recreateSwapChain() {
     createSwapChainImageViews();
     createColorResources();
     createDepthResources();
+    ++swapChainGeneration;
 
     if (oldSwapChainImageFormat != swapChainImageFormat) {
         createRenderPass();
@@ -255,6 +396,9 @@ void Application::recreateSwapChain() {
     }
 
     createFramebuffers();
+
+    // the depth transition may be waiting on the transfer queue, the next frame can't render before it ran
+    waitUpload(submitUpload());
 }
 
 void Application::createInstance() {
@@ -268,13 +412,16 @@ void Application::createInstance() {
     applicationInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     applicationInfo.pEngineName = "No Engine";
     applicationInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    applicationInfo.apiVersion = VK_API_VERSION_1_0;
+    // timeline semaphores are core in 1.2
+    applicationInfo.apiVersion = VK_API_VERSION_1_2;
 
     VkInstanceCreateInfo instanceCreateInfo{};
     instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     instanceCreateInfo.pApplicationInfo = &applicationInfo;
-    // macOS
+#ifdef __APPLE__
+    // macOS, goes with VK_KHR_portability_enumeration in getRequiredExtensions
     instanceCreateInfo.flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
+#endif
 
     const std::vector<const char *> &extensions = getRequiredExtensions();
     instanceCreateInfo.enabledExtensionCount = extensions.size();
@@ -322,6 +469,8 @@ void Application::setupDebugMessenger() {
 }
 
 void Application::createSurface() {
+    if (headless) return;
+
 //        VkWin32SurfaceCreateInfoKHR createInfo{};
 //        createInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
 //        createInfo.hwnd = glfwGetWin32Window(window);
@@ -363,6 +512,12 @@ void Application::createLogicalDevice() {
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos{};
     std::set<uint32_t> uniqueQueueFamilyIndices = {familyIndices.graphicsComputeFamily.value(),
                                                    familyIndices.presentFamily.value()};
+    if (familyIndices.transferFamily.has_value()) {
+        uniqueQueueFamilyIndices.insert(familyIndices.transferFamily.value());
+    }
+    if (familyIndices.computeFamily.has_value()) {
+        uniqueQueueFamilyIndices.insert(familyIndices.computeFamily.value());
+    }
 
     float queuePriority = 1.0;
     for (const auto &queueFamilyIndex: uniqueQueueFamilyIndices) {
@@ -374,17 +529,52 @@ void Application::createLogicalDevice() {
         queueCreateInfos.push_back(queueCreateInfo);
     }
 
+    // optional features, drawIndexedIndirect falls back when they are missing (MoltenVK has no drawIndirectCount)
+    VkPhysicalDeviceVulkan12Features supportedVulkan12Features{};
+    supportedVulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 supportedFeatures{};
+    supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures.pNext = &supportedVulkan12Features;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+    multiDrawIndirectSupported = supportedFeatures.features.multiDrawIndirect;
+    drawIndirectFirstInstanceSupported = supportedFeatures.features.drawIndirectFirstInstance;
+    drawIndirectCountSupported = supportedVulkan12Features.drawIndirectCount;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    maxDrawIndirectCount = properties.limits.maxDrawIndirectCount;
+    maxComputeWorkGroupCountX = properties.limits.maxComputeWorkGroupCount[0];
+
     VkPhysicalDeviceFeatures physicalDeviceFeatures{};
     physicalDeviceFeatures.samplerAnisotropy = VK_TRUE;
     physicalDeviceFeatures.sampleRateShading = VK_TRUE;
+    physicalDeviceFeatures.multiDrawIndirect = multiDrawIndirectSupported;
+    physicalDeviceFeatures.drawIndirectFirstInstance = drawIndirectFirstInstanceSupported;
+
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12Features.timelineSemaphore = VK_TRUE;
+    // GpuProfiler resets its queries from the host
+    vulkan12Features.hostQueryReset = VK_TRUE;
+    vulkan12Features.drawIndirectCount = drawIndirectCountSupported;
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pNext = &vulkan12Features;
     createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
     createInfo.pEnabledFeatures = &physicalDeviceFeatures;
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+
+    std::vector<const char *> enabledExtensions;
+    if (!headless) {
+        enabledExtensions = deviceExtensions;
+    }
+    // The Vulkan spec states: If the VK_KHR_portability_subset extension is included in pProperties of
+    // vkEnumerateDeviceExtensionProperties, ppEnabledExtensionNames must include "VK_KHR_portability_subset"
+    if (isDeviceExtensionAvailable(physicalDevice, VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME)) {
+        enabledExtensions.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
+    }
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+    createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
     /* ---
      * we don‘t need this under the up-to-date implementation; it's only included for compatibility with older implementation */
@@ -402,9 +592,38 @@ void Application::createLogicalDevice() {
 
     vkGetDeviceQueue(device, familyIndices.graphicsComputeFamily.value(), 0, &graphicsComputeQueue);
     vkGetDeviceQueue(device, familyIndices.presentFamily.value(), 0, &presentQueue);
+
+    graphicsComputeFamilyIndex = familyIndices.graphicsComputeFamily.value();
+    dedicatedTransferQueue = familyIndices.transferFamily.has_value();
+    if (dedicatedTransferQueue) {
+        transferFamilyIndex = familyIndices.transferFamily.value();
+        vkGetDeviceQueue(device, transferFamilyIndex, 0, &transferQueue);
+    } else {
+        transferFamilyIndex = graphicsComputeFamilyIndex;
+        transferQueue = graphicsComputeQueue;
+    }
+
+    dedicatedComputeQueue = familyIndices.computeFamily.has_value();
+    if (dedicatedComputeQueue) {
+        computeFamilyIndex = familyIndices.computeFamily.value();
+        vkGetDeviceQueue(device, computeFamilyIndex, 0, &computeQueue);
+    } else {
+        computeFamilyIndex = graphicsComputeFamilyIndex;
+        computeQueue = graphicsComputeQueue;
+    }
+
+    std::set<uint32_t> usedQueueFamilyIndices = {graphicsComputeFamilyIndex, transferFamilyIndex, computeFamilyIndex};
+    queueFamilyIndices.assign(usedQueueFamilyIndices.begin(), usedQueueFamilyIndices.end());
+
+    allocator.init(physicalDevice, device);
 }
 
 void Application::createSwapChain(VkSwapchainKHR oldSwapChain) {
+    if (headless) {
+        createOffscreenImages();
+        return;
+    }
+
     SwapChainSupportDetails supportDetails = querySwapChainSupport(physicalDevice);
 
     VkSurfaceFormatKHR surfaceFormat = chooseSwapChainSurfaceFormat(supportDetails.formats);
@@ -412,6 +631,9 @@ void Application::createSwapChain(VkSwapchainKHR oldSwapChain) {
     VkExtent2D swapExtent = chooseSwapExtent(supportDetails.capabilities);
 
     uint32_t imageCount = supportDetails.capabilities.minImageCount + 1;
+    if (swapChainImageCount > 0) {
+        imageCount = std::max(swapChainImageCount, supportDetails.capabilities.minImageCount);
+    }
     if (supportDetails.capabilities.maxImageCount > 0 && imageCount > supportDetails.capabilities.maxImageCount) {
         imageCount = supportDetails.capabilities.maxImageCount;
     }
@@ -449,15 +671,93 @@ void Application::createSwapChain(VkSwapchainKHR oldSwapChain) {
         throw std::runtime_error("failed to create swap chain!");
     }
 
-    uint32_t swapChainImageCount = 0;
-    vkGetSwapchainImagesKHR(device, swapChain, &swapChainImageCount, nullptr);
-    swapChainImages.resize(swapChainImageCount);
-    vkGetSwapchainImagesKHR(device, swapChain, &swapChainImageCount, swapChainImages.data());
+    // the implementation may create more images than asked for
+    uint32_t createdImageCount = 0;
+    vkGetSwapchainImagesKHR(device, swapChain, &createdImageCount, nullptr);
+    swapChainImages.resize(createdImageCount);
+    vkGetSwapchainImagesKHR(device, swapChain, &createdImageCount, swapChainImages.data());
 
     swapChainImageFormat = surfaceFormat.format;
     swapChainExtent = swapExtent;
 }
 
+void Application::createOffscreenImages() {
+    // the format createSwapChain prefers, so pipelines see the same attachment either way
+    swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+    swapChainExtent = headlessExtent;
+
+    // nothing is waiting on a display, but a ring keeps a frame from rendering over the one before it
+    uint32_t imageCount = swapChainImageCount > 0 ? swapChainImageCount : 3;
+    swapChainImages.resize(imageCount);
+    offscreenImageMemories.resize(imageCount);
+    for (uint32_t i = 0; i < imageCount; ++i) {
+        createImage(swapChainExtent.width, swapChainExtent.height, 1, VK_SAMPLE_COUNT_1_BIT, swapChainImageFormat,
+                    VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapChainImages[i], offscreenImageMemories[i]);
+    }
+    nextOffscreenImage = 0;
+}
+
+void Application::saveOffscreenImage(VkImage image, const std::string &path) {
+    uint32_t width = swapChainExtent.width;
+    uint32_t height = swapChainExtent.height;
+    VkDeviceSize size = static_cast<VkDeviceSize>(width) * height * 4;
+
+    VkBuffer readbackBuffer;
+    MemoryAllocation readbackMemory;
+    createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 readbackBuffer, readbackMemory);
+
+    VkCommandBuffer commandBuffer = beginUploadGraphics();
+
+    VkMemoryBarrier renderBarrier{};
+    renderBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    renderBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    renderBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &renderBarrier, 0, nullptr, 0, nullptr);
+
+    VkBufferImageCopy region{};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {width, height, 1};
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer, 1, &region);
+
+    VkMemoryBarrier hostBarrier{};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+
+    waitUpload(submitUpload());
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file! " + path);
+    }
+    file << "P6\n" << width << " " << height << "\n255\n";
+
+    // B8G8R8A8 to RGB
+    const auto *pixels = static_cast<const uint8_t *>(readbackMemory.mapped);
+    std::vector<char> row(width * 3);
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            const uint8_t *pixel = pixels + (static_cast<size_t>(y) * width + x) * 4;
+            row[x * 3 + 0] = static_cast<char>(pixel[2]);
+            row[x * 3 + 1] = static_cast<char>(pixel[1]);
+            row[x * 3 + 2] = static_cast<char>(pixel[0]);
+        }
+        file.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+
+    vkDestroyBuffer(device, readbackBuffer, nullptr);
+    allocator.free(readbackMemory);
+}
+
 void Application::createSwapChainImageViews() {
     swapChainImageViews.resize(swapChainImages.size());
     for (int i = 0; i < swapChainImages.size(); ++i) {
@@ -509,7 +809,9 @@ void Application::createRenderPass() {
     resolveColorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     resolveColorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     resolveColorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    resolveColorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // offscreen images are only ever read back
+    resolveColorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                                  : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference resolveColorAttachmentRef{};
     resolveColorAttachmentRef.attachment = 2;
@@ -551,6 +853,65 @@ void Application::createRenderPass() {
     if (vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &renderPass) != VK_SUCCESS) {
         throw std::runtime_error("failed to create render pass!");
     }
+
+    // The two halves of renderPass for Renderer::splitRenderPass, compatible with it and its framebuffers. The early
+    // one keeps color and depth for the late one and leaves the depth readable by compute shaders in between.
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    resolveColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    resolveColorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDependency depthReadDependency{};
+    depthReadDependency.srcSubpass = 0;
+    depthReadDependency.srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    depthReadDependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depthReadDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    depthReadDependency.dstStageMask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    depthReadDependency.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    std::array<VkSubpassDependency, 2> earlyDependencies{dependency, depthReadDependency};
+    attachments = {colorAttachment, depthAttachment, resolveColorAttachment};
+    renderPassCreateInfo.dependencyCount = static_cast<uint32_t>(earlyDependencies.size());
+    renderPassCreateInfo.pDependencies = earlyDependencies.data();
+
+    if (vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &earlyRenderPass) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create early render pass!");
+    }
+
+    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    resolveColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolveColorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                                  : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // the early pass's writes, and the compute reads of the depth before it goes back to being an attachment
+    VkSubpassDependency loadDependency{};
+    loadDependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    loadDependency.srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    loadDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    loadDependency.dstSubpass = 0;
+    loadDependency.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                  VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                  VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    loadDependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                   VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    attachments = {colorAttachment, depthAttachment, resolveColorAttachment};
+    renderPassCreateInfo.dependencyCount = 1;
+    renderPassCreateInfo.pDependencies = &loadDependency;
+
+    if (vkCreateRenderPass(device, &renderPassCreateInfo, nullptr, &lateRenderPass) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create late render pass!");
+    }
 }
 
 void Application::createFramebuffers() {
@@ -597,7 +958,8 @@ void Application::createDescriptorPool(const std::vector<DescriptorPoolRequireme
 
     VkDescriptorPoolCreateInfo descriptorPoolCreateInfo{};
     descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-//    descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+    // renderers free and reallocate their per frame sets when framesInFlight changes
+    descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
     descriptorPoolCreateInfo.poolSizeCount = static_cast<uint32_t>(descriptorPoolSizes.size());
     descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes.data();
     descriptorPoolCreateInfo.maxSets = maxSets;
@@ -633,10 +995,28 @@ void Application::createCommandPool() {
         VK_SUCCESS) {
         throw std::runtime_error("failed to create copyBuffer command pool!");
     }
+
+    VkCommandPoolCreateInfo uploadCommandPoolCreateInfo{};
+    uploadCommandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    uploadCommandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    uploadCommandPoolCreateInfo.queueFamilyIndex = transferFamilyIndex;
+
+    if (vkCreateCommandPool(device, &uploadCommandPoolCreateInfo, nullptr, &uploadCommandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upload command pool!");
+    }
+
+    VkCommandPoolCreateInfo computeCommandPoolCreateInfo{};
+    computeCommandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    computeCommandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    computeCommandPoolCreateInfo.queueFamilyIndex = computeFamilyIndex;
+
+    if (vkCreateCommandPool(device, &computeCommandPoolCreateInfo, nullptr, &computeCommandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create compute command pool!");
+    }
 }
 
 void Application::createCommandBuffer() {
-    commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    commandBuffers.resize(framesInFlight);
     VkCommandBufferAllocateInfo commandBufferAllocateInfo{};
     commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     commandBufferAllocateInfo.commandPool = commandPool;
@@ -649,10 +1029,10 @@ void Application::createCommandBuffer() {
         throw std::runtime_error("failed to allocate command buffer!");
     }
 
-    computeCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    computeCommandBuffers.resize(framesInFlight);
     VkCommandBufferAllocateInfo computeCommandBufferAllocateInfo{};
     computeCommandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    computeCommandBufferAllocateInfo.commandPool = commandPool;
+    computeCommandBufferAllocateInfo.commandPool = computeCommandPool;
     computeCommandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     computeCommandBufferAllocateInfo.commandBufferCount = computeCommandBuffers.size();
 
@@ -662,33 +1042,60 @@ void Application::createCommandBuffer() {
 }
 
 void Application::createSyncObjects() {
-    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-
-    computeFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    computeInFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    imageAvailableSemaphores.resize(framesInFlight);
+    renderFinishedSemaphores.resize(framesInFlight);
+    // the timelines keep counting, 0 is always reached
+    frameGraphicsValues.assign(framesInFlight, 0);
+    frameComputeValues.assign(framesInFlight, 0);
 
     VkSemaphoreCreateInfo semaphoreCreateInfo{};
     semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    VkFenceCreateInfo fenceCreateInfo{};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (int i = 0; i < framesInFlight; ++i) {
         if (vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fenceCreateInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create semaphores and fence! " + std::to_string(i));
-        }
-        if (vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &computeFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fenceCreateInfo, nullptr, &computeInFlightFences[i]) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create compute semaphores and fence! " + std::to_string(i));
+            vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create semaphores! " + std::to_string(i));
         }
     }
 }
 
+void Application::cleanupSyncObjects() {
+    for (int i = 0; i < imageAvailableSemaphores.size(); ++i) {
+        vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+        vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+    }
+    imageAvailableSemaphores.clear();
+    renderFinishedSemaphores.clear();
+}
+
+void Application::readFrameTimestamps(uint32_t frame) {
+    uint64_t number;
+    double milliseconds;
+    if (!gpuProfiler.collectFrame(frame, number, milliseconds)) return;
+
+    lastGpuFrameTime = milliseconds;
+    if (benchFrameCount > 0) {
+        benchmark.addGpuTime(number, milliseconds);
+    }
+}
+
+void Application::createTimelineSemaphores() {
+    VkSemaphoreTypeCreateInfo semaphoreTypeCreateInfo{};
+    semaphoreTypeCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    semaphoreTypeCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    semaphoreTypeCreateInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo timelineCreateInfo{};
+    timelineCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    timelineCreateInfo.pNext = &semaphoreTypeCreateInfo;
+
+    if (vkCreateSemaphore(device, &timelineCreateInfo, nullptr, &graphicsTimeline) != VK_SUCCESS ||
+        vkCreateSemaphore(device, &timelineCreateInfo, nullptr, &computeTimeline) != VK_SUCCESS ||
+        vkCreateSemaphore(device, &timelineCreateInfo, nullptr, &uploadTimeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timeline semaphores!");
+    }
+}
+
 void Application::createColorResources() {
     createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, swapChainImageFormat,
                 VK_IMAGE_TILING_OPTIMAL,
@@ -701,13 +1108,108 @@ void Application::createDepthResources() {
     VkFormat depthFormat = findDepthFormat();
 
     createImage(swapChainExtent.width, swapChainExtent.height, 1, msaaSamples, depthFormat, VK_IMAGE_TILING_OPTIMAL,
-                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                depthImage, depthImageMemory);
+                // sampled between the halves of a split render pass for a depth pyramid, only then, it may cost
+                // the attachment its compression
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (occlusionCulling ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageMemory);
     createImageView(depthImage, depthFormat, depthImageView, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
-    transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
+    transitionImageLayout(beginUploadGraphics(), depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1);
 }
 
+int Application::findRenderer(const std::string &name) {
+    for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+        if (name == Renderers[i]) {
+            return i;
+        }
+    }
+    throw std::runtime_error("unknown renderer! " + name);
+}
+
+void Application::setRenderer(const std::string &name) {
+    rendererIndex = requestedRendererIndex = findRenderer(name);
+}
+
+void Application::hintRenderer(const std::string &name) {
+    int index = findRenderer(name);
+    RendererState &state = rendererStates[index];
+    state.hinted = true;
+    // initVulkan starts it once the pool is running
+    if (threadPool.getThreadCount() == 0 || state.initialized || state.loading.valid()) return;
+
+    Renderer *renderer = getRenderer(index);
+    state.loading = threadPool.submit([this, renderer] { renderer->load(this); });
+}
+
+void Application::initRenderer(int index) {
+    RendererState &state = rendererStates[index];
+    if (state.releasing) {
+        // still queued for release, let it go first rather than racing the deferred cleanup
+        vkDeviceWaitIdle(device);
+        collectReleases();
+    }
+    if (state.initialized) return;
+
+    if (state.loading.valid()) {
+        state.loading.get();
+    }
+    getRenderer(index)->init(this);
+    waitPipelines();
+    waitUpload(submitUpload());
+    state.initialized = true;
+}
+
+void Application::selectRenderer(int index) {
+    rendererStates[rendererIndex].deselectedTime = std::chrono::steady_clock::now();
+    initRenderer(index);
+    rendererIndex = index;
+}
+
+void Application::releaseIdleRenderers() {
+    if (rendererReleaseDelay < 0) return;
+
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+        RendererState &state = rendererStates[i];
+        if (i == rendererIndex || !state.initialized || state.releasing) continue;
+
+        float idleSeconds = std::chrono::duration<float, std::chrono::seconds::period>(
+                now - state.deselectedTime).count();
+        if (idleSeconds < rendererReleaseDelay) continue;
+
+        // frames recorded before the switch may still be reading its buffers
+        state.releasing = true;
+        releaseAfterFrame([this, i] {
+            getRenderer(i)->cleanup();
+            rendererStates[i].initialized = false;
+            rendererStates[i].releasing = false;
+        });
+    }
+}
+
+void Application::compilePipelines(const std::vector<std::function<void()>> &jobs) {
+    for (const auto &job: jobs) {
+        pipelineJobs.push_back(threadPool.submit(job));
+    }
+}
+
+void Application::waitPipelines() {
+    // wait for all of them before rethrowing, a job still running must not outlive the renderer it writes to
+    std::exception_ptr error;
+    for (auto &job: pipelineJobs) {
+        try {
+            job.get();
+        } catch (...) {
+            if (!error) error = std::current_exception();
+        }
+    }
+    pipelineJobs.clear();
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 VkShaderModule Application::createShaderModule(const std::vector<char> &code) {
     VkShaderModuleCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -725,14 +1227,18 @@ VkShaderModule Application::createShaderModule(const std::vector<char> &code) {
 
 void Application::createBuffer(VkDeviceSize size, VkBufferUsageFlags usageFlags,
                                VkMemoryPropertyFlags memoryPropertyFlags, VkBuffer &buffer,
-                               VkDeviceMemory &deviceMemory) {
+                               MemoryAllocation &allocation, bool concurrent) {
     VkBufferCreateInfo bufferCreateInfo{};
     bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferCreateInfo.size = size;
     bufferCreateInfo.usage = usageFlags;
-    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-//    bufferCreateInfo.queueFamilyIndexCount = 0;
-//    bufferCreateInfo.pQueueFamilyIndices = nullptr;
+    if (concurrent && queueFamilyIndices.size() > 1) {
+        bufferCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        bufferCreateInfo.queueFamilyIndexCount = static_cast<uint32_t>(queueFamilyIndices.size());
+        bufferCreateInfo.pQueueFamilyIndices = queueFamilyIndices.data();
+    } else {
+        bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
     // The flags parameter is used to configure sparse buffer memory,
     // which is not relevant right now. We'll leave it at the default value of 0.
 //        bufferCreateInfo.flags = 0;
@@ -744,24 +1250,16 @@ void Application::createBuffer(VkDeviceSize size, VkBufferUsageFlags usageFlags,
     VkMemoryRequirements memoryRequirements{};
     vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
 
-    VkMemoryAllocateInfo memoryAllocateInfo{};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    memoryAllocateInfo.memoryTypeIndex = findMemoryTypeIndex(memoryRequirements.memoryTypeBits,
-                                                             memoryPropertyFlags);
-
-    if (vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &deviceMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate memory!");
-    }
+    allocation = allocator.allocate(memoryRequirements, memoryPropertyFlags, false);
 
     // If the offset is non-zero, then it is required to be divisible by memRequirements.alignment.
-    vkBindBufferMemory(device, buffer, deviceMemory, 0);
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
 }
 
 void Application::createImage(int width, int height, uint32_t mips, VkSampleCountFlagBits numSamples, VkFormat format,
                               VkImageTiling tiling,
                               VkImageUsageFlags usage, VkMemoryPropertyFlags memoryPropertyFlags, VkImage &image,
-                              VkDeviceMemory &imageMemory) {
+                              MemoryAllocation &imageMemory) {
     // https://www.reddit.com/r/vulkan/comments/48cvzq/image_layouts/
     // Image tiling is the addressing layout of texels within an image. This is currently opaque, and it is not defined when you access it using the CPU.
     // The reason GPUs like image tiling to be "OPTIMAL" is for texel filtering. Consider a simple linear filter, the resulting value will have four texels contributing from a 2x2 quad.
@@ -807,18 +1305,9 @@ void Application::createImage(int width, int height, uint32_t mips, VkSampleCoun
     VkMemoryRequirements memoryRequirements;
     vkGetImageMemoryRequirements(device, image, &memoryRequirements);
 
-    VkMemoryAllocateInfo memoryAllocateInfo{};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    memoryAllocateInfo.memoryTypeIndex = findMemoryTypeIndex(
-            memoryRequirements.memoryTypeBits, memoryPropertyFlags);
-
-    if (vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate image memory! width: " +
-                                 std::to_string(width) + ", height: " + std::to_string(height));
-    }
+    imageMemory = allocator.allocate(memoryRequirements, memoryPropertyFlags, tiling == VK_IMAGE_TILING_OPTIMAL);
 
-    vkBindImageMemory(device, image, imageMemory, 0);
+    vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 }
 
 void Application::createImageView(VkImage image, VkFormat format, VkImageView &imageView,
@@ -875,11 +1364,13 @@ const std::vector<const char *> Application::getRequiredExtensions() {
 //            std::cout << '\t' << property.extensionName << std::endl;
 //        }
 
-    uint32_t glfwExtensionCount = 0;
-    // include VK_KHR_surface
-    const char **glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char *> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    std::vector<const char *> extensions;
+    if (!headless) {
+        uint32_t glfwExtensionCount = 0;
+        // include VK_KHR_surface
+        const char **glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
 #ifdef __APPLE__
     // macOS
     extensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
@@ -903,6 +1394,15 @@ int Application::ratePhysicalDeviceSuitability(const VkPhysicalDevice &targetPhy
     VkPhysicalDeviceFeatures features;
     vkGetPhysicalDeviceFeatures(targetPhysicalDevice, &features);
 
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features2{};
+    features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features2.pNext = &vulkan12Features;
+    if (properties.apiVersion >= VK_API_VERSION_1_2) {
+        vkGetPhysicalDeviceFeatures2(targetPhysicalDevice, &features2);
+    }
+
     int score = 0;
 
     if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
@@ -913,9 +1413,9 @@ int Application::ratePhysicalDeviceSuitability(const VkPhysicalDevice &targetPhy
 
     QueueFamilyIndices queueFamilies = findQueueFamilies(targetPhysicalDevice);
     if (!queueFamilies.isComplete() || !checkDeviceExtensionSupport(targetPhysicalDevice) ||
-        !features.samplerAnisotropy) {
+        !features.samplerAnisotropy || !vulkan12Features.timelineSemaphore || !vulkan12Features.hostQueryReset) {
         score = 0;
-    } else {
+    } else if (!headless) {
         SwapChainSupportDetails supportDetails = querySwapChainSupport(targetPhysicalDevice);
         if (supportDetails.formats.empty() || supportDetails.presentModes.empty()) {
             score = 0;
@@ -939,18 +1439,36 @@ QueueFamilyIndices Application::findQueueFamilies(const VkPhysicalDevice &target
 
     int i = 0;
     for (const auto &property: properties) {
-        if ((property.queueFlags & VK_QUEUE_GRAPHICS_BIT) && (property.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+        if (!queueFamilies.graphicsComputeFamily.has_value() &&
+            (property.queueFlags & VK_QUEUE_GRAPHICS_BIT) && (property.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
             queueFamilies.graphicsComputeFamily = i;
         }
 
+        if (!queueFamilies.transferFamily.has_value() && (property.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+            !(property.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            queueFamilies.transferFamily = i;
+        }
+
+        if (!queueFamilies.computeFamily.has_value() && (property.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+            !(property.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+            queueFamilies.computeFamily = i;
+        }
+
         VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(targetPhysicalDevice, i, surface, &presentSupport);
+        if (headless) {
+            // nothing is presented, the graphics family stands in so presentQueue is still a valid queue
+            presentSupport = queueFamilies.graphicsComputeFamily == i;
+        } else {
+            vkGetPhysicalDeviceSurfaceSupportKHR(targetPhysicalDevice, i, surface, &presentSupport);
+        }
 
-        if (presentSupport) {
+        if (!queueFamilies.presentFamily.has_value() && presentSupport) {
             queueFamilies.presentFamily = i;
         }
 
-        if (queueFamilies.isComplete()) {
+        // the transfer and compute families are optional, keep looking for them only while there are families left
+        if (queueFamilies.isComplete() && queueFamilies.transferFamily.has_value() &&
+            queueFamilies.computeFamily.has_value()) {
             break;
         }
 
@@ -969,7 +1487,10 @@ bool Application::checkDeviceExtensionSupport(const VkPhysicalDevice &targetPhys
 //            std::cout << extensionProperty.extensionName << std::endl;
 //        }
 
-    std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    std::set<std::string> requiredExtensions;
+    if (!headless) {
+        requiredExtensions.insert(deviceExtensions.begin(), deviceExtensions.end());
+    }
     for (const auto &extension: availableProperties) {
         requiredExtensions.erase(extension.extensionName);
     }
@@ -977,6 +1498,21 @@ bool Application::checkDeviceExtensionSupport(const VkPhysicalDevice &targetPhys
     return requiredExtensions.empty();
 }
 
+bool Application::isDeviceExtensionAvailable(const VkPhysicalDevice &targetPhysicalDevice,
+                                             const char *extensionName) {
+    uint32_t propertyCount = 0;
+    vkEnumerateDeviceExtensionProperties(targetPhysicalDevice, nullptr, &propertyCount, nullptr);
+    std::vector<VkExtensionProperties> availableProperties(propertyCount);
+    vkEnumerateDeviceExtensionProperties(targetPhysicalDevice, nullptr, &propertyCount, availableProperties.data());
+
+    for (const auto &extension: availableProperties) {
+        if (strcmp(extension.extensionName, extensionName) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 SwapChainSupportDetails Application::querySwapChainSupport(const VkPhysicalDevice &targetPhysicalDevice) {
     SwapChainSupportDetails details;
 
@@ -1065,31 +1601,33 @@ VkSampleCountFlagBits Application::getMaxUsableSampleCount() {
     return VK_SAMPLE_COUNT_1_BIT;
 }
 
-void Application::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-    VkCommandBuffer copyCommandBuffer = beginSingleTimeCommands();
-
-    VkBufferCopy copyRegion{0, 0, size};
-    vkCmdCopyBuffer(copyCommandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-    endSingleTimeCommands(copyCommandBuffer);
+void Application::copyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset,
+                             VkBuffer dstBuffer, VkDeviceSize size) {
+    VkBufferCopy copyRegion{srcOffset, 0, size};
+    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 }
 
-uint32_t Application::findMemoryTypeIndex(uint32_t typeBitsFilter, VkMemoryPropertyFlags propertyFlags) {
-    VkPhysicalDeviceMemoryProperties memoryProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-
-//        memoryProperties.memoryHeaps
-    for (int i = 0; i < memoryProperties.memoryTypeCount; ++i) {
-        if (typeBitsFilter & (1 << i) &&
-            (propertyFlags & memoryProperties.memoryTypes[i].propertyFlags) == propertyFlags) {
-            return i;
+void Application::drawIndexedIndirect(VkCommandBuffer commandBuffer, VkBuffer commands, VkBuffer count,
+                                      uint32_t maxDrawCount, VkDeviceSize commandsOffset, VkDeviceSize countOffset) {
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    if (drawIndirectCountSupported) {
+        vkCmdDrawIndexedIndirectCount(commandBuffer, commands, commandsOffset, count, countOffset, maxDrawCount,
+                                      stride);
+    } else if (multiDrawIndirectSupported) {
+        // the commands past the count are zeroed and draw nothing, in as few calls as the device limit allows
+        for (uint32_t first = 0; first < maxDrawCount; first += maxDrawIndirectCount) {
+            vkCmdDrawIndexedIndirect(commandBuffer, commands, commandsOffset + first * stride,
+                                     std::min(maxDrawCount - first, maxDrawIndirectCount), stride);
+        }
+    } else {
+        for (uint32_t i = 0; i < maxDrawCount; ++i) {
+            vkCmdDrawIndexedIndirect(commandBuffer, commands, commandsOffset + i * stride, 1, stride);
         }
     }
-
-    throw std::runtime_error("failed to find suitable memory type!");
 }
 
-void Application::generateMipmaps(VkImage image, VkFormat format, int32_t width, int32_t height, uint32_t mips) {
+void Application::generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, int32_t width,
+                                  int32_t height, uint32_t mips) {
     VkFormatProperties formatProperties;
     vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
 
@@ -1097,8 +1635,6 @@ void Application::generateMipmaps(VkImage image, VkFormat format, int32_t width,
         throw std::runtime_error("failed to generateMipmaps, texture image does not support linear filter!");
     }
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
     VkImageMemoryBarrier barrier{};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -1159,14 +1695,10 @@ void Application::generateMipmaps(VkImage image, VkFormat format, int32_t width,
     vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
                          0, 0, nullptr, 0, nullptr,
                          1, &barrier);
-
-    endSingleTimeCommands(commandBuffer);
 }
 
-void Application::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout,
-                                        VkImageLayout newLayout, uint32_t mips) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+void Application::transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format,
+                                        VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mips) {
     VkAccessFlags srcAccessMask, dstAccessMask;
     VkPipelineStageFlags srcStageMask, dstStageMask;
 
@@ -1232,14 +1764,12 @@ void Application::transitionImageLayout(VkImage image, VkFormat format, VkImageL
             0, nullptr,
             1, &imageMemoryBarrier
     );
-
-    endSingleTimeCommands(commandBuffer);
 }
 
-void Application::copyBufferToImage(VkBuffer srcBuffer, VkImage dstImage, int width, int height) {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+void Application::copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset,
+                                    VkImage dstImage, int width, int height) {
     VkBufferImageCopy region{};
-    region.bufferOffset = 0;
+    region.bufferOffset = srcOffset;
     // If either of these values is zero, that aspect of the buffer memory is considered to be tightly packed according to the imageExtent.
     region.bufferRowLength = 0;
     region.bufferImageHeight = 0;
@@ -1255,15 +1785,51 @@ void Application::copyBufferToImage(VkBuffer srcBuffer, VkImage dstImage, int wi
     region.imageSubresource.layerCount = 1;
 
     vkCmdCopyBufferToImage(commandBuffer, srcBuffer, dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    endSingleTimeCommands(commandBuffer);
 }
 
-VkCommandBuffer Application::beginSingleTimeCommands() {
+StagingAllocation Application::allocateStaging(VkDeviceSize size) {
+    StagingAllocation allocation{};
+
+    if (size > stagingRing.getSize()) {
+        // too big for the ring, fall back to a one-off buffer that lives as long as the batch
+        MemoryAllocation memory;
+        createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     allocation.buffer, memory);
+        allocation.data = memory.mapped;
+
+        beginUpload();
+        releaseAfterUpload([this, buffer = allocation.buffer, memory]() mutable {
+            vkDestroyBuffer(device, buffer, nullptr);
+            allocator.free(memory);
+        });
+        return allocation;
+    }
+
+    // 16 covers the texel size and the 4 byte offset alignment required by vkCmdCopyBufferToImage
+    while (!stagingRing.tryAllocate(size, 16, allocation)) {
+        if (!pendingUploads.empty()) {
+            waitUpload(pendingUploads.front().token);
+        } else {
+            // the open batch alone fills the ring
+            waitUpload(submitUpload());
+        }
+    }
+    // the space belongs to the open batch from now on, so it is reclaimed together with it
+    beginUpload();
+    return allocation;
+}
+
+VkCommandBuffer Application::beginUpload() {
+    if (openUpload.has_value()) {
+        return openUpload->commandBuffer;
+    }
+
     VkCommandBufferAllocateInfo bufferAllocateInfo{};
     bufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     bufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     bufferAllocateInfo.commandBufferCount = 1;
-    bufferAllocateInfo.commandPool = transientCommandPool;
+    bufferAllocateInfo.commandPool = uploadCommandPool;
 
     VkCommandBuffer commandBuffer;
     if (vkAllocateCommandBuffers(device, &bufferAllocateInfo, &commandBuffer) != VK_SUCCESS) {
@@ -1276,32 +1842,295 @@ VkCommandBuffer Application::beginSingleTimeCommands() {
 
     vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
+    openUpload = UploadBatch{nextUploadToken++, commandBuffer, VK_NULL_HANDLE, {}};
     return commandBuffer;
 }
 
-void Application::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-    vkEndCommandBuffer(commandBuffer);
+VkCommandBuffer Application::beginUploadGraphics() {
+    VkCommandBuffer commandBuffer = beginUpload();
+    if (!dedicatedTransferQueue) {
+        return commandBuffer;
+    }
+    if (openUpload->graphicsCommandBuffer != VK_NULL_HANDLE) {
+        return openUpload->graphicsCommandBuffer;
+    }
+
+    VkCommandBufferAllocateInfo bufferAllocateInfo{};
+    bufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    bufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    bufferAllocateInfo.commandBufferCount = 1;
+    bufferAllocateInfo.commandPool = transientCommandPool;
+
+    if (vkAllocateCommandBuffers(device, &bufferAllocateInfo, &openUpload->graphicsCommandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffer!");
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer(openUpload->graphicsCommandBuffer, &beginInfo);
+    return openUpload->graphicsCommandBuffer;
+}
+
+void Application::transferOwnership(VkBuffer buffer) {
+    // on a single queue the barrier at the end of the batch already makes the copy visible
+    if (!dedicatedTransferQueue) return;
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    barrier.srcQueueFamilyIndex = transferFamilyIndex;
+    barrier.dstQueueFamilyIndex = graphicsComputeFamilyIndex;
+
+    // release, dstAccessMask is ignored for the releasing queue
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_NONE;
+    vkCmdPipelineBarrier(beginUpload(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+    // acquire, the semaphore wait takes the place of srcAccessMask
+    barrier.srcAccessMask = VK_ACCESS_NONE;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    vkCmdPipelineBarrier(beginUploadGraphics(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void Application::transferOwnership(VkImage image, VkImageAspectFlags aspectMask, uint32_t mips,
+                                    VkImageLayout oldLayout, VkImageLayout newLayout) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.subresourceRange.aspectMask = aspectMask;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = mips;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    if (!dedicatedTransferQueue) {
+        if (oldLayout == newLayout) return;
+
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        vkCmdPipelineBarrier(beginUpload(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &barrier);
+        return;
+    }
+
+    // both halves have to specify the same layouts, the transition happens once between them
+    barrier.srcQueueFamilyIndex = transferFamilyIndex;
+    barrier.dstQueueFamilyIndex = graphicsComputeFamilyIndex;
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_NONE;
+    vkCmdPipelineBarrier(beginUpload(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    barrier.srcAccessMask = VK_ACCESS_NONE;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    vkCmdPipelineBarrier(beginUploadGraphics(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void Application::releaseAfterUpload(std::function<void()> release) {
+    if (!openUpload.has_value()) {
+        throw std::runtime_error("releaseAfterUpload called without an open upload batch!");
+    }
+    openUpload->releaseCallbacks.push_back(std::move(release));
+}
+
+UploadToken Application::submitUpload() {
+    if (!openUpload.has_value()) {
+        // nothing recorded, everything handed out so far is what the caller has to wait for
+        return nextUploadToken - 1;
+    }
+
+    UploadBatch batch = std::move(openUpload.value());
+    openUpload.reset();
+
+    // Copies are consumed as vertex/index/uniform/storage data by later submissions on the graphics queue,
+    // one global barrier here spares every caller from guessing the consumer stage.
+    VkMemoryBarrier memoryBarrier{};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    VkCommandBuffer lastCommandBuffer = batch.graphicsCommandBuffer != VK_NULL_HANDLE ? batch.graphicsCommandBuffer
+                                                                                      : batch.commandBuffer;
+    vkCmdPipelineBarrier(lastCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    vkEndCommandBuffer(batch.commandBuffer);
+    if (batch.graphicsCommandBuffer != VK_NULL_HANDLE) {
+        vkEndCommandBuffer(batch.graphicsCommandBuffer);
+    }
+
+    // the token doubles as the value the batch signals on the upload timeline
+    VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{};
+    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineSubmitInfo.signalSemaphoreValueCount = 1;
+    timelineSubmitInfo.pSignalSemaphoreValues = &batch.token;
 
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineSubmitInfo;
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.pCommandBuffers = &batch.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &uploadTimeline;
+
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit upload command buffer!");
+    }
+    submitCount++;
+
+    UploadToken token = batch.token;
+    stagingRing.markSubmitted(token);
+    pendingUploads.push_back(std::move(batch));
+    return token;
+}
+
+void Application::waitUpload(UploadToken token) {
+    if (!pendingUploads.empty()) {
+        // never wait for the open batch, it hasn't been submitted
+        uint64_t waitValue = std::min(token, pendingUploads.back().token);
+
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &uploadTimeline;
+        waitInfo.pValues = &waitValue;
+        vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    }
+    collectUploads();
+
+    if (uploadsToAcquire.empty()) return;
+
+    // no frame to piggyback on, run the graphics parts right away
+    std::vector<VkCommandBuffer> submitCommandBuffers;
+    uint64_t waitValue = takeUploadAcquires(submitCommandBuffers);
+    uint64_t signalValue = ++graphicsTimelineValue;
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{};
+    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineSubmitInfo.waitSemaphoreValueCount = 1;
+    timelineSubmitInfo.pWaitSemaphoreValues = &waitValue;
+    timelineSubmitInfo.signalSemaphoreValueCount = 1;
+    timelineSubmitInfo.pSignalSemaphoreValues = &signalValue;
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineSubmitInfo;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &uploadTimeline;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = static_cast<uint32_t>(submitCommandBuffers.size());
+    submitInfo.pCommandBuffers = submitCommandBuffers.data();
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &graphicsTimeline;
 
     if (vkQueueSubmit(graphicsComputeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
-        throw std::runtime_error("failed to submit singleTime command buffer!");
+        throw std::runtime_error("failed to submit upload graphics command buffer!");
     }
+    submitCount++;
 
-    // We should schedule multiple transfers simultaneously and wait for all of them complete, instead of executing one at a time.
-    vkDeviceWaitIdle(device);
-    vkFreeCommandBuffers(device, transientCommandPool, 1, &commandBuffer);
+    VkSemaphoreWaitInfo waitInfo{};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &graphicsTimeline;
+    waitInfo.pValues = &signalValue;
+    vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+    collectReleases();
+}
+
+void Application::collectUploads() {
+    uint64_t uploadValue;
+    vkGetSemaphoreCounterValue(device, uploadTimeline, &uploadValue);
+
+    while (!pendingUploads.empty() && pendingUploads.front().token <= uploadValue) {
+        UploadBatch &batch = pendingUploads.front();
+        for (auto &release: batch.releaseCallbacks) {
+            release();
+        }
+
+        vkFreeCommandBuffers(device, uploadCommandPool, 1, &batch.commandBuffer);
+        // the graphics part goes out ahead of anything recorded from now on, so the data is ready to use
+        completedUploadToken = batch.token;
+        if (batch.graphicsCommandBuffer != VK_NULL_HANDLE) {
+            uploadsToAcquire.push_back(std::move(batch));
+        }
+        pendingUploads.pop_front();
+    }
+
+    stagingRing.reclaim(completedUploadToken);
+}
+
+UploadToken Application::takeUploadAcquires(std::vector<VkCommandBuffer> &submitCommandBuffers) {
+    UploadToken waitToken = 0;
+    for (auto &batch: uploadsToAcquire) {
+        submitCommandBuffers.push_back(batch.graphicsCommandBuffer);
+        waitToken = batch.token;
+        // the graphics submit about to go out signals graphicsTimelineValue + 1
+        releaseAfter(graphicsTimelineValue + 1, computeTimelineValue,
+                     [this, commandBuffer = batch.graphicsCommandBuffer]() mutable {
+                         vkFreeCommandBuffers(device, transientCommandPool, 1, &commandBuffer);
+                     });
+    }
+    uploadsToAcquire.clear();
+    return waitToken;
+}
+
+void Application::releaseAfterFrame(std::function<void()> release) {
+    releaseAfter(graphicsTimelineValue, computeTimelineValue, std::move(release));
+}
+
+void Application::releaseAfter(uint64_t graphicsValue, uint64_t computeValue, std::function<void()> release) {
+    deferredReleases.push_back({graphicsValue, computeValue, std::move(release)});
+}
+
+void Application::collectReleases() {
+    uint64_t graphicsValue, computeValue;
+    vkGetSemaphoreCounterValue(device, graphicsTimeline, &graphicsValue);
+    vkGetSemaphoreCounterValue(device, computeTimeline, &computeValue);
+
+    // releases may defer further releases, so pick the completed ones out before running any
+    std::vector<std::function<void()>> completed;
+    for (auto it = deferredReleases.begin(); it != deferredReleases.end();) {
+        if (it->graphicsValue <= graphicsValue && it->computeValue <= computeValue) {
+            completed.push_back(std::move(it->release));
+            it = deferredReleases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto &release: completed) {
+        release();
+    }
 }
 
 VkFormat Application::findDepthFormat() {
-    return findSupportedFormat(
-            {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT},
-            VK_IMAGE_TILING_OPTIMAL,
-            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
-    );
+    std::vector<VkFormat> candidates{VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT};
+    if (occlusionCulling) {
+        // MeshRenderer builds its depth pyramid from the depth buffer
+        VkFormatFeatureFlags features = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                        VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+        for (VkFormat format: candidates) {
+            VkFormatProperties formatProperties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+            if ((formatProperties.optimalTilingFeatures & features) == features) {
+                return format;
+            }
+        }
+        std::cout << "Occlusion culling needs a depth format that can be sampled, drawing without\n";
+        occlusionCulling = false;
+    }
+    return findSupportedFormat(candidates, VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
 }
 
 VkFormat Application::findSupportedFormat(const std::vector<VkFormat> &candidates, VkImageTiling tiling,
@@ -1325,37 +2154,77 @@ bool Application::hasStencilComponent(VkFormat format) {
 }
 
 void Application::drawFrame() {
-    // There happens to be two kinds of semaphores in Vulkan, binary and timeline. We use binary semaphores here.
-    // A fence has a similar purpose, in that it is used to synchronize execution, but it is for ordering the execution on the CPU, otherwise known as the host.
-    vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+    if (requestedFramesInFlight != framesInFlight || requestedSwapChainImageCount != swapChainImageCount) {
+        applyFrameSettings();
+    }
+    if (requestedRendererIndex != rendererIndex) {
+        selectRenderer(requestedRendererIndex);
+    }
+    releaseIdleRenderers();
+
+    // There happens to be two kinds of semaphores in Vulkan, binary and timeline. Every graphics and compute submit
+    // signals the next value of its queue's timeline, so waiting until this frame's previous use of its command
+    // buffers and uniform buffers is done is a single host wait on both values. The swapchain still needs binary
+    // semaphores.
+    std::array<VkSemaphore, 2> frameTimelines{graphicsTimeline, computeTimeline};
+    std::array<uint64_t, 2> frameValues{frameGraphicsValues[currentFrame], frameComputeValues[currentFrame]};
+    VkSemaphoreWaitInfo frameWaitInfo{};
+    frameWaitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    frameWaitInfo.semaphoreCount = static_cast<uint32_t>(frameTimelines.size());
+    frameWaitInfo.pSemaphores = frameTimelines.data();
+    frameWaitInfo.pValues = frameValues.data();
+    vkWaitSemaphores(device, &frameWaitInfo, UINT64_MAX);
+    readFrameTimestamps(currentFrame);
+    gpuProfiler.beginFrame(currentFrame, frameNumber);
+    collectReleases();
+    collectUploads();
 
     uint32_t imageIndex;
-    VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
-                                            VK_NULL_HANDLE, &imageIndex);
-//    std::cout << std::string(string_VkResult(result)) + "\n";
-//    std::cout << "currentFrame: " + std::to_string(currentFrame) +
-//                 ", imageIndex: " + std::to_string(imageIndex) +
-//                 "\n";
-
-    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        recreateSwapChain();
-        return;
-    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-        throw std::runtime_error("failed to acquire swap chain image!");
+    if (headless) {
+        // the graphics queue runs frames in order, so writing an offscreen image never races the frame before it
+        imageIndex = nextOffscreenImage;
+        nextOffscreenImage = (nextOffscreenImage + 1) % swapChainImages.size();
+    } else {
+        VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+                                                imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+//        std::cout << std::string(string_VkResult(result)) + "\n";
+//        std::cout << "currentFrame: " + std::to_string(currentFrame) +
+//                     ", imageIndex: " + std::to_string(imageIndex) +
+//                     "\n";
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            recreateSwapChain();
+            return;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            throw std::runtime_error("failed to acquire swap chain image!");
+        }
     }
 
     updateData();
-    if (getRenderer()->needCompute) {
-        vkWaitForFences(device, 1, &computeInFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
 
-        vkResetFences(device, 1, &computeInFlightFences[currentFrame]);
+    // binary semaphores ignore their entry in waitValues
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<uint64_t> waitValues;
+    std::vector<VkPipelineStageFlags> waitStages;
+    if (!headless) {
+        waitSemaphores.push_back(imageAvailableSemaphores[currentFrame]);
+        waitValues.push_back(0);
+        waitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    }
+
+    if (getRenderer()->needCompute) {
         vkResetCommandBuffer(computeCommandBuffers[currentFrame], 0);
         recordComputeCommandBuffer(computeCommandBuffers[currentFrame]);
 
-        VkSemaphore signalSemaphores[] = {};
+        uint64_t computeSignalValue = ++computeTimelineValue;
+        VkTimelineSemaphoreSubmitInfo computeTimelineSubmitInfo{};
+        computeTimelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        computeTimelineSubmitInfo.signalSemaphoreValueCount = 1;
+        computeTimelineSubmitInfo.pSignalSemaphoreValues = &computeSignalValue;
 
         VkSubmitInfo computeSubmitInfo{};
         computeSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        computeSubmitInfo.pNext = &computeTimelineSubmitInfo;
         computeSubmitInfo.commandBufferCount = 1;
         computeSubmitInfo.pCommandBuffers = &computeCommandBuffers[currentFrame];
         computeSubmitInfo.waitSemaphoreCount = 0;
@@ -1364,66 +2233,137 @@ void Application::drawFrame() {
         computeSubmitInfo.pWaitDstStageMask = VK_NULL_HANDLE;
 
         computeSubmitInfo.signalSemaphoreCount = 1;
-        computeSubmitInfo.pSignalSemaphores = &computeFinishedSemaphores[currentFrame];
+        computeSubmitInfo.pSignalSemaphores = &computeTimeline;
 
-        if (vkQueueSubmit(graphicsComputeQueue, 1, &computeSubmitInfo, computeInFlightFences[currentFrame]) != VK_SUCCESS) {
+        // On a compute only family this runs alongside the graphics work of the previous frame, which only
+        // reads the particles this dispatch reads as well.
+        if (vkQueueSubmit(computeQueue, 1, &computeSubmitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
             throw std::runtime_error("failed to submit compute command buffer!");
         }
+        submitCount++;
+        frameComputeValues[currentFrame] = computeSignalValue;
+
+        waitSemaphores.push_back(computeTimeline);
+        waitValues.push_back(computeSignalValue);
+        waitStages.push_back(getRenderer()->graphicsWaitComputeStage);
     }
 
-    vkResetFences(device, 1, &inFlightFences[currentFrame]);
     vkResetCommandBuffer(commandBuffers[currentFrame], 0);
     recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
 
+    // uploads that finished on the transfer queue are acquired at the start of this frame
+    std::vector<VkCommandBuffer> submitCommandBuffers;
+    UploadToken acquireToken = takeUploadAcquires(submitCommandBuffers);
+    if (acquireToken != 0) {
+        waitSemaphores.push_back(uploadTimeline);
+        waitValues.push_back(acquireToken);
+        waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    }
+    submitCommandBuffers.push_back(commandBuffers[currentFrame]);
+
+    uint64_t graphicsSignalValue = ++graphicsTimelineValue;
+    std::vector<VkSemaphore> signalSemaphores{graphicsTimeline};
+    std::vector<uint64_t> signalValues{graphicsSignalValue};
+    if (!headless) {
+        signalSemaphores.push_back(renderFinishedSemaphores[currentFrame]);
+        signalValues.push_back(0);
+    }
+
+    VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{};
+    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineSubmitInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+    timelineSubmitInfo.pWaitSemaphoreValues = waitValues.data();
+    timelineSubmitInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size());
+    timelineSubmitInfo.pSignalSemaphoreValues = signalValues.data();
+
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineSubmitInfo;
 
-    std::vector<VkSemaphore> waitSemaphores {imageAvailableSemaphores[currentFrame]};
-    std::vector<VkPipelineStageFlags> waitStages {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    if (getRenderer()->needCompute) {
-        waitSemaphores.push_back(computeFinishedSemaphores[currentFrame]);
-        waitStages.push_back(getRenderer()->graphicsWaitComputeStage);
-    }
     submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
     submitInfo.pWaitSemaphores = waitSemaphores.data();
     submitInfo.pWaitDstStageMask = waitStages.data();
 
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = signalSemaphores;
+    submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+    submitInfo.pSignalSemaphores = signalSemaphores.data();
 
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+    submitInfo.commandBufferCount = static_cast<uint32_t>(submitCommandBuffers.size());
+    submitInfo.pCommandBuffers = submitCommandBuffers.data();
 
-    if (vkQueueSubmit(graphicsComputeQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+    if (vkQueueSubmit(graphicsComputeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
         throw std::runtime_error("failed to submit render command buffer!");
     }
+    submitCount++;
+    frameGraphicsValues[currentFrame] = graphicsSignalValue;
+    frameNumber++;
+
+    if (!headless) {
+        VkPresentInfoKHR presentInfo{};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame];
+
+        VkSwapchainKHR swapChains[] = {swapChain};
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = swapChains;
+        presentInfo.pImageIndices = &imageIndex;
+        presentInfo.pResults = nullptr;
+
+        // Queueing an image for presentation defines a set of queue operations, including waiting on the semaphores and submitting a presentation
+        // request to the presentation engine. However, the scope of this set of queue operations does not include the actual processing of the
+        // image by the presentation engine.
+        // vkQueuePresentKHR releases the acquisition of the image, which signals imageAvailableSemaphores for that image in later frames
+        VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
+//            std::cout << std::string(string_VkResult(result)) << ", framebufferResized: " << framebufferResized << "\n";
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
+            framebufferResized = false;
+            recreateSwapChain();
+        } else if (result != VK_SUCCESS) {
+            throw std::runtime_error("failed to present swap chain image!");
+        }
+    }
 
-    VkPresentInfoKHR presentInfo{};
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = signalSemaphores;
-
-    VkSwapchainKHR swapChains[] = {swapChain};
-    presentInfo.swapchainCount = 1;
-    presentInfo.pSwapchains = swapChains;
-    presentInfo.pImageIndices = &imageIndex;
-    presentInfo.pResults = nullptr;
-
-    // Queueing an image for presentation defines a set of queue operations, including waiting on the semaphores and submitting a presentation
-    // request to the presentation engine. However, the scope of this set of queue operations does not include the actual processing of the
-    // image by the presentation engine.
-    // vkQueuePresentKHR releases the acquisition of the image, which signals imageAvailableSemaphores for that image in later frames
-    result = vkQueuePresentKHR(presentQueue, &presentInfo);
-//        std::cout << std::string(string_VkResult(result)) << ", framebufferResized: " << framebufferResized << "\n";
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
-        framebufferResized = false;
-        recreateSwapChain();
-    } else if (result != VK_SUCCESS) {
-        throw std::runtime_error("failed to present swap chain image!");
+    currentFrame = (currentFrame + 1) % framesInFlight;
+}
+
+void Application::applyFrameSettings() {
+    vkDeviceWaitIdle(device);
+    for (uint32_t i = 0; i < framesInFlight; ++i) {
+        readFrameTimestamps(i);
     }
+    collectUploads();
+    collectReleases();
+
+    if (requestedFramesInFlight != framesInFlight) {
+        // pending releases ran above, so initialized is all there is
+        for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+            if (rendererStates[i].initialized) {
+                getRenderer(i)->cleanupFrameResources();
+            }
+        }
+
+        vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+        vkFreeCommandBuffers(device, computeCommandPool, static_cast<uint32_t>(computeCommandBuffers.size()),
+                             computeCommandBuffers.data());
+        cleanupSyncObjects();
+
+        framesInFlight = requestedFramesInFlight;
+        currentFrame = 0;
 
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        createCommandBuffer();
+        createSyncObjects();
+        for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+            if (rendererStates[i].initialized) {
+                getRenderer(i)->createFrameResources();
+            }
+        }
+        waitUpload(submitUpload());
+    }
+
+    if (requestedSwapChainImageCount != swapChainImageCount) {
+        swapChainImageCount = requestedSwapChainImageCount;
+        recreateSwapChain();
+    }
 }
 
 void Application::updateData() {
@@ -1432,7 +2372,18 @@ void Application::updateData() {
     auto currTime = std::chrono::high_resolution_clock::now();
     float deltaTime = std::chrono::duration<float, std::chrono::seconds::period>(currTime - startTime).count();
     startTime = currTime;
+    if (fixedDeltaTime > 0) {
+        deltaTime = fixedDeltaTime;
+    }
+
+    if (!headless) {
+        buildOptionsWindow();
+    }
 
+    getRenderer()->update(deltaTime, currentFrame);
+}
+
+void Application::buildOptionsWindow() {
     // Start the Dear ImGui frame
     ImGui_ImplVulkan_NewFrame();
     ImGui_ImplGlfw_NewFrame();
@@ -1446,15 +2397,19 @@ void Application::updateData() {
                                      ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoResize |
                                      ImGuiWindowFlags_NoMove);
 
-    const char *comboPreviewValue = Renderers[rendererIndex];
+    const char *comboPreviewValue = Renderers[requestedRendererIndex];
     ImGui::AlignTextToFramePadding();
     ImGui::Text("Renderer");
     ImGui::SameLine();
     if (ImGui::BeginCombo("##Renderer", comboPreviewValue, ImGuiComboFlags_None)) {
         for (int n = 0; n < IM_ARRAYSIZE(Renderers); n++) {
-            const bool isSelected = (rendererIndex == n);
+            const bool isSelected = (requestedRendererIndex == n);
             if (ImGui::Selectable(Renderers[n], isSelected)) {
-                rendererIndex = n;
+                requestedRendererIndex = n;
+            }
+            // hovering an entry is a good hint it is about to be picked
+            if (ImGui::IsItemHovered() && !isSelected) {
+                hintRenderer(Renderers[n]);
             }
 
             if (isSelected)
@@ -1463,10 +2418,62 @@ void Application::updateData() {
         ImGui::EndCombo();
     }
 
+    if (ImGui::CollapsingHeader("Frames")) {
+        // applied at the start of the next frame
+        ImGui::SliderInt("In flight", &requestedFramesInFlight, 1, MAX_FRAMES_IN_FLIGHT);
+        int imageCount = static_cast<int>(requestedSwapChainImageCount);
+        if (ImGui::SliderInt("Images", &imageCount, 0, 8, imageCount == 0 ? "auto" : "%d")) {
+            requestedSwapChainImageCount = static_cast<uint32_t>(imageCount);
+        }
+        ImGui::Text("Swapchain images: %zu", swapChainImages.size());
+    }
+
+    if (ImGui::CollapsingHeader("GPU")) {
+        // averaged over the last GpuProfiler::AVERAGE_FRAMES frames that recorded the scope
+        if (ImGui::BeginTable("##GpuScopes", 2, ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Scope");
+            ImGui::TableSetupColumn("ms", ImGuiTableColumnFlags_WidthFixed, 50);
+            ImGui::TableHeadersRow();
+            for (const auto &scope: gpuProfiler.getScopeStats()) {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::Indent(scope.depth * 10.0f);
+                ImGui::TextUnformatted(scope.name.c_str());
+                ImGui::Unindent(scope.depth * 10.0f);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", scope.averageMilliseconds);
+            }
+            ImGui::EndTable();
+        }
+        ImGui::Text("Frame total: %.3f ms", lastGpuFrameTime);
+    }
+
+    std::vector<RendererCounter> counters = getRenderer()->getCounters();
+    if (!counters.empty() && ImGui::CollapsingHeader("Scene")) {
+        for (const RendererCounter &counter: counters) {
+            ImGui::Text("%s: %llu", counter.name, static_cast<unsigned long long>(counter.value));
+        }
+    }
+
+    if (ImGui::CollapsingHeader("Memory")) {
+        MemoryAllocatorStats memoryStats = allocator.getStats();
+        ImGui::Text("Blocks: %u, allocations: %u", memoryStats.blockCount, memoryStats.allocationCount);
+        ImGui::Text("Used: %.1f / %.1f MB", memoryStats.usedBytes / (1024.0 * 1024.0),
+                    memoryStats.blockBytes / (1024.0 * 1024.0));
+        ImGui::Text("Wasted: %.1f KB", memoryStats.wastedBytes / 1024.0);
+        ImGui::Text("Fragmentation: %.2f (%u ranges)", memoryStats.fragmentation(), memoryStats.freeRangeCount);
+        ImGui::Text("Staging: %.1f / %.1f MB", stagingRing.getUsedBytes() / (1024.0 * 1024.0),
+                    stagingRing.getSize() / (1024.0 * 1024.0));
+        // applies to renderers deselected from now on as well as those already idle
+        ImGui::SliderFloat("Release (s)", &rendererReleaseDelay, -1.0f, 120.0f,
+                           rendererReleaseDelay < 0 ? "never" : "%.0f");
+        for (int i = 0; i < IM_ARRAYSIZE(Renderers); ++i) {
+            ImGui::Text("%s: %s", Renderers[i], rendererStates[i].initialized ? "resident" : "released");
+        }
+    }
+
     ImGui::End();
     ImGui::Render();
-
-    getRenderer()->update(deltaTime, currentFrame);
 }
 
 void Application::recordCommandBuffer(VkCommandBuffer currCommandBuffer, uint32_t imageIndex) {
@@ -1483,9 +2490,18 @@ void Application::recordCommandBuffer(VkCommandBuffer currCommandBuffer, uint32_
         throw std::runtime_error("failed to begin recording command buffer!");
     }
 
+    uint32_t frameScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Frame",
+                                                 graphicsComputeFamilyIndex);
+
+    uint32_t prepareScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Prepare",
+                                                   graphicsComputeFamilyIndex);
+    getRenderer()->prepareRender(currCommandBuffer, currentFrame);
+    gpuProfiler.endScope(currCommandBuffer, currentFrame, prepareScope);
+
+    Renderer *renderer = getRenderer();
     VkRenderPassBeginInfo renderPassBeginInfo{};
     renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassBeginInfo.renderPass = renderPass;
+    renderPassBeginInfo.renderPass = renderer->splitRenderPass ? earlyRenderPass : renderPass;
     renderPassBeginInfo.framebuffer = swapChainFramebuffers[imageIndex];
     renderPassBeginInfo.renderArea.offset = {0, 0};
     renderPassBeginInfo.renderArea.extent = swapChainExtent;
@@ -1501,11 +2517,39 @@ void Application::recordCommandBuffer(VkCommandBuffer currCommandBuffer, uint32_
 //          The render pass commands will be executed from secondary command buffers.
     vkCmdBeginRenderPass(currCommandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-    getRenderer()->render(currCommandBuffer, currentFrame);
-    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), currCommandBuffer);
+    uint32_t sceneScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Scene", graphicsComputeFamilyIndex);
+    renderer->render(currCommandBuffer, currentFrame);
+    gpuProfiler.endScope(currCommandBuffer, currentFrame, sceneScope);
+
+    if (renderer->splitRenderPass) {
+        vkCmdEndRenderPass(currCommandBuffer);
+
+        uint32_t betweenScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Between passes",
+                                                       graphicsComputeFamilyIndex);
+        renderer->betweenRenderPasses(currCommandBuffer, currentFrame);
+        gpuProfiler.endScope(currCommandBuffer, currentFrame, betweenScope);
+
+        // loads everything, the clear values are ignored
+        renderPassBeginInfo.renderPass = lateRenderPass;
+        vkCmdBeginRenderPass(currCommandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+        uint32_t lateScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Scene late",
+                                                    graphicsComputeFamilyIndex);
+        renderer->renderLate(currCommandBuffer, currentFrame);
+        gpuProfiler.endScope(currCommandBuffer, currentFrame, lateScope);
+    }
+
+    if (!headless) {
+        uint32_t imGuiScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "ImGui",
+                                                     graphicsComputeFamilyIndex);
+        ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), currCommandBuffer);
+        gpuProfiler.endScope(currCommandBuffer, currentFrame, imGuiScope);
+    }
 
     vkCmdEndRenderPass(currCommandBuffer);
 
+    gpuProfiler.endScope(currCommandBuffer, currentFrame, frameScope);
+
     if (vkEndCommandBuffer(currCommandBuffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
     }
@@ -1523,7 +2567,9 @@ void Application::recordComputeCommandBuffer(VkCommandBuffer currCommandBuffer)
 
     vkBeginCommandBuffer(currCommandBuffer, &commandBufferBeginInfo);
 
+    uint32_t computeScope = gpuProfiler.beginScope(currCommandBuffer, currentFrame, "Compute", computeFamilyIndex);
     getRenderer()->compute(computeCommandBuffers[currentFrame], currentFrame);
+    gpuProfiler.endScope(currCommandBuffer, currentFrame, computeScope);
 
     if (vkEndCommandBuffer(currCommandBuffer) != VK_SUCCESS) {
         throw std::runtime_error("failed to record compute command buffer!");
@@ -1,6 +1,13 @@
 #include <vector>
+#include <deque>
 #include <iostream>
 #include <optional>
+#include <functional>
+#include <string>
+#include <ctime>
+#include <future>
+#include <chrono>
+#include <iterator>
 
 #ifndef RENDERER_APPLICATION_H
 #define RENDERER_APPLICATION_H
@@ -10,6 +17,12 @@
 #include <GLFW/glfw3.h>
 
 #include "Renderer.h"
+#include "MemoryAllocator.h"
+#include "StagingRing.h"
+#include "Benchmark.h"
+#include "GpuProfiler.h"
+#include "PipelineCache.h"
+#include "ThreadPool.h"
 #include "MeshRenderer.h"
 #include "ParticleRenderer.h"
 
@@ -28,6 +41,10 @@ struct DescriptorPoolRequirement {
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsComputeFamily;
     std::optional<uint32_t> presentFamily;
+    // transfer capable but neither graphics nor compute, usually a DMA engine that copies alongside rendering
+    std::optional<uint32_t> transferFamily;
+    // compute capable without graphics, lets compute work overlap with rendering
+    std::optional<uint32_t> computeFamily;
 
     bool isComplete() {
         return graphicsComputeFamily.has_value() && presentFamily.has_value();
@@ -35,6 +52,28 @@ struct QueueFamilyIndices {
     }
 };
 
+// Monotonically increasing id of a submitted upload batch, 0 is never handed out.
+// Also the value the batch signals on Application::uploadTimeline.
+typedef uint64_t UploadToken;
+
+struct UploadBatch {
+    UploadToken token;
+    // recorded for the transfer queue
+    VkCommandBuffer commandBuffer;
+    // With a dedicated transfer queue: acquire barriers and work only the graphics queue can do (blits, graphics
+    // stage transitions), executed by the first graphics submit after the copies finished. VK_NULL_HANDLE otherwise.
+    VkCommandBuffer graphicsCommandBuffer;
+    // run once the batch has completed on the GPU, e.g. to destroy staging buffers
+    std::vector<std::function<void()>> releaseCallbacks;
+};
+
+// run once the graphics and compute timelines have reached the given values
+struct DeferredRelease {
+    uint64_t graphicsValue;
+    uint64_t computeValue;
+    std::function<void()> release;
+};
+
 struct SwapChainSupportDetails {
     VkSurfaceCapabilitiesKHR capabilities;
     std::vector<VkSurfaceFormatKHR> formats;
@@ -46,30 +85,119 @@ class Application {
 public:
     void run();
 
-    static const int MAX_FRAMES_IN_FLIGHT = 2;
-
-    GLFWwindow *window;
+    // upper bound for framesInFlight, descriptor pools and ImGui are sized for it
+    static const int MAX_FRAMES_IN_FLIGHT = 4;
+    static const VkDeviceSize STAGING_RING_SIZE = 32 * 1024 * 1024;
+
+    // Renders into a ring of offscreen images instead of a window: GLFW, the surface, the swapchain and ImGui are
+    // never created, and mainLoop draws headlessFrameCount frames and returns. Set before run().
+    bool headless = false;
+    uint32_t headlessFrameCount = 0;
+    VkExtent2D headlessExtent{800, 600};
+    // the last headless frame is written there as a binary PPM, empty to skip
+    std::string headlessOutputPath;
+
+    // With benchFrameCount > 0, mainLoop draws benchWarmupFrames + benchFrameCount frames with BENCH_DELTA_TIME and
+    // BENCH_SEED, then writes a JSON report to benchReportPath (stdout when empty). Windowed or headless.
+    static constexpr float BENCH_DELTA_TIME = 1.0f / 60.0f;
+    static const uint32_t BENCH_SEED = 1;
+    uint32_t benchFrameCount = 0;
+    uint32_t benchWarmupFrames = 60;
+    std::string benchReportPath;
+
+    // relative to the working directory, like the shaders
+    std::string pipelineCachePath = "pipeline_cache.bin";
+    PipelineCache pipelineCache;
+    // compiles pipelines at startup, lives as long as the device
+    ThreadPool threadPool;
+    // from run() until the first frame can be drawn
+    double startupMilliseconds = 0;
+
+    // seconds passed to Renderer::update every frame, 0 to use the measured time between frames
+    float fixedDeltaTime = 0;
+    // A renderer is initialized the first time it is selected. Deselected renderers release their resources after
+    // rendererReleaseDelay seconds, negative keeps them until exit.
+    float rendererReleaseDelay = 30.0f;
+    // reorder loaded meshes for the vertex cache, early-Z and vertex fetch (MeshOptimizer) before they are cached
+    bool optimizeMeshes = true;
+    // upload meshes as CompactVertex, with compactVertexColors a color per vertex instead of one for the mesh
+    bool compactVertices = false;
+    bool compactVertexColors = false;
+    // positions in a vertex buffer of their own, for passes that read nothing else
+    bool splitVertexStreams = false;
+    // meshes with too many vertices for 16-bit indices are drawn in parts that each fit, instead of with 32-bit ones
+    bool splitSubmeshes = false;
+    // MeshRenderer lays down depth with a position only pipeline first, then shades with depth compare equal
+    bool depthPrepass = false;
+    // MeshRenderer draws the meshlets a compute pass finds inside the frustum and not facing away (MeshletBuilder)
+    bool meshletCulling = false;
+    // MeshRenderer draws this many copies of the model on a grid with a single instanced draw, 0 for the one turning
+    // model. meshletCulling is for the single model only.
+    uint32_t sceneInstanceCount = 0;
+    // MeshRenderer culls its instances against the frustum in a compute pass and draws the rest indirectly, so the
+    // CPU records the same few commands however many instances there are
+    bool gpuCulling = false;
+    // gpuCulling, plus two phase occlusion culling: what was visible last frame is drawn first, a depth pyramid of
+    // that is built, and whatever else it doesn't hide is drawn after. Cleared when no depth format can be sampled.
+    bool occlusionCulling = false;
+    // MeshRenderer simplifies the model into coarser levels of detail at load time (MeshSimplifier, cached with the
+    // mesh) and draws each instance with the coarsest one that is at most lodPixelError pixels off on screen.
+    // More than one instance implies gpuCulling, the cull shader picks the level per instance.
+    bool meshLods = false;
+    float lodPixelError = 1.0f;
+
+    // for renderers that generate random data
+    uint32_t randomSeed = static_cast<uint32_t>(time(nullptr));
+
+    GLFWwindow *window = nullptr;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debugMessenger;
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
 
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice device;
+    MemoryAllocator allocator;
     VkSwapchainKHR swapChain;
 
     VkQueue graphicsComputeQueue;
     VkQueue presentQueue;
+    // graphicsComputeQueue unless the device has a transfer only family
+    VkQueue transferQueue;
+    bool dedicatedTransferQueue = false;
+    // graphicsComputeQueue unless the device has a compute only family
+    VkQueue computeQueue;
+    bool dedicatedComputeQueue = false;
+    // optional device features, enabled when supported
+    bool multiDrawIndirectSupported = false;
+    bool drawIndirectCountSupported = false;
+    bool drawIndirectFirstInstanceSupported = false;
+    // device limits renderers size their indirect draws and dispatches by
+    uint32_t maxDrawIndirectCount = 1;
+    uint32_t maxComputeWorkGroupCountX = 65535;
+    uint32_t graphicsComputeFamilyIndex;
+    uint32_t transferFamilyIndex;
+    uint32_t computeFamilyIndex;
+    // distinct families of the queues above, for resources created with VK_SHARING_MODE_CONCURRENT
+    std::vector<uint32_t> queueFamilyIndices;
 
     VkFormat swapChainImageFormat;
     VkExtent2D swapChainExtent;
+    // swapchain images, or the offscreen images when headless
     std::vector<VkImage> swapChainImages;
     std::vector<VkImageView> swapChainImageViews;
+    std::vector<MemoryAllocation> offscreenImageMemories;
+    uint32_t nextOffscreenImage = 0;
 
     VkRenderPass renderPass;
+    // renderPass split in two around Renderer::betweenRenderPasses, see createRenderPass
+    VkRenderPass earlyRenderPass;
+    VkRenderPass lateRenderPass;
     std::vector<VkFramebuffer> swapChainFramebuffers;
     VkDescriptorPool descriptorPool;
 
     VkCommandPool transientCommandPool;
+    VkCommandPool uploadCommandPool;
+    VkCommandPool computeCommandPool;
     VkCommandPool commandPool;
     std::vector<VkCommandBuffer> commandBuffers;
     std::vector<VkCommandBuffer> computeCommandBuffers;
@@ -77,60 +205,168 @@ public:
     VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 
     VkImage colorImage;
-    VkDeviceMemory colorImageMemory;
+    MemoryAllocation colorImageMemory;
     VkImageView colorImageView;
     VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    MemoryAllocation depthImageMemory;
     VkImageView depthImageView;
+    // bumped whenever recreateSwapChain replaces the images above, for renderers holding on to views of them
+    uint32_t swapChainGeneration = 0;
 
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
-    std::vector<VkFence> inFlightFences;
-    std::vector<VkSemaphore> computeFinishedSemaphores;
-    std::vector<VkFence> computeInFlightFences;
+    // Each submission signals the next value of its queue's timeline: graphicsTimelineValue/computeTimelineValue
+    // are the last values handed out, upload batches signal their token.
+    VkSemaphore graphicsTimeline;
+    VkSemaphore computeTimeline;
+    VkSemaphore uploadTimeline;
+    uint64_t graphicsTimelineValue = 0;
+    uint64_t computeTimelineValue = 0;
+    // values signaled by the last submissions of frame i, reached before frame i records again
+    std::vector<uint64_t> frameGraphicsValues;
+    std::vector<uint64_t> frameComputeValues;
     uint32_t currentFrame;
-
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-
+    // Frames the CPU may record ahead of the GPU, fewer means less input latency, more keeps the GPU busier.
+    // Changes to the requested values are applied between frames.
+    int framesInFlight = 2;
+    int requestedFramesInFlight = 2;
+    // minImageCount asked from the swapchain, 0 for the surface's minimum + 1
+    uint32_t swapChainImageCount = 0;
+    uint32_t requestedSwapChainImageCount = 0;
+    std::deque<DeferredRelease> deferredReleases;
+
+    GpuProfiler gpuProfiler;
+    // frames submitted so far
+    uint64_t frameNumber = 0;
+    // vkQueueSubmit calls so far, uploads included
+    uint64_t submitCount = 0;
+    // graphics plus compute time of the latest frame read back, in milliseconds
+    double lastGpuFrameTime = 0;
+
+    StagingRing stagingRing;
+    std::optional<UploadBatch> openUpload;
+    std::deque<UploadBatch> pendingUploads;
+    UploadToken nextUploadToken = 1;
+    UploadToken completedUploadToken = 0;
+    // copies done, graphics part waiting for the next graphics submit
+    std::vector<UploadBatch> uploadsToAcquire;
+
+    void copyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, VkBuffer dstBuffer,
+                    VkDeviceSize size);
+
+    // Draws the first *count VkDrawIndexedIndirectCommands of commands, with vkCmdDrawIndexedIndirectCount when the
+    // device has it. Otherwise all maxDrawCount of them are drawn, so the ones past the count must have been zeroed.
+    // Without multiDrawIndirect either that is a call per command, only for draws that don't scale with the scene.
+    void drawIndexedIndirect(VkCommandBuffer commandBuffer, VkBuffer commands, VkBuffer count, uint32_t maxDrawCount,
+                             VkDeviceSize commandsOffset = 0, VkDeviceSize countOffset = 0);
+
+    // concurrent: accessible from every queue family without ownership transfers, for buffers that several queues
+    // use at the same time
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usageFlags,
                       VkMemoryPropertyFlags memoryPropertyFlags, VkBuffer &buffer,
-                      VkDeviceMemory &deviceMemory);
+                      MemoryAllocation &allocation, bool concurrent = false);
 
-    void generateMipmaps(VkImage image, VkFormat format, int32_t width, int32_t height, uint32_t mips);
+    void generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, int32_t width, int32_t height,
+                         uint32_t mips);
 
     void createImage(int width, int height, uint32_t mips, VkSampleCountFlagBits numSamples, VkFormat format,
                      VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags memoryPropertyFlags,
-                     VkImage &image, VkDeviceMemory &imageMemory);
+                     VkImage &image, MemoryAllocation &imageMemory);
 
     void createImageView(VkImage image, VkFormat format, VkImageView &imageView, VkImageAspectFlags aspectFlags,
                          uint32_t mips);
 
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout,
-                               uint32_t mips);
+    void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout,
+                               VkImageLayout newLayout, uint32_t mips);
+
+    void copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, VkImage dstImage,
+                           int width, int height);
+
+    // Host visible scratch memory for the open upload batch, valid until that batch completes.
+    // May have to submit the open batch to make room, so call it before beginUpload and record the copy after.
+    StagingAllocation allocateStaging(VkDeviceSize size);
+
+    // Returns the command buffer of the open upload batch, opening a new batch if there is none.
+    // Everything recorded until submitUpload goes to the GPU in a single submission.
+    VkCommandBuffer beginUpload();
 
-    void copyBufferToImage(VkBuffer srcBuffer, VkImage dstImage, int width, int height);
+    // Like beginUpload, but for commands the transfer queue can't execute. Runs on the graphics queue after the
+    // copies of the batch, following every transferOwnership recorded so far.
+    VkCommandBuffer beginUploadGraphics();
 
-    VkCommandBuffer beginSingleTimeCommands();
+    // Hands a resource written by the open batch over to the graphics queue family. A no-op (or a plain layout
+    // transition for images) without a dedicated transfer queue.
+    void transferOwnership(VkBuffer buffer);
 
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer);
+    void transferOwnership(VkImage image, VkImageAspectFlags aspectMask, uint32_t mips, VkImageLayout oldLayout,
+                           VkImageLayout newLayout);
+
+    // Defers release until the open batch has completed, e.g. destroying a staging buffer.
+    void releaseAfterUpload(std::function<void()> release);
+
+    UploadToken submitUpload();
+
+    // Blocks until the batch identified by token (and every batch before it) has completed, graphics part included.
+    void waitUpload(UploadToken token);
+
+    // Retires completed batches without blocking.
+    void collectUploads();
+
+    // Runs release once every graphics and compute submission made so far has completed, e.g. destroying a buffer
+    // that frames still in flight may be using.
+    void releaseAfterFrame(std::function<void()> release);
 
     VkShaderModule createShaderModule(const std::vector<char> &code);
 
+    // Starts the jobs of Renderer::getPipelineJobs on threadPool, the caller keeps going with its other resources.
+    // Everything started is done (or has thrown) once waitPipelines returns.
+    void compilePipelines(const std::vector<std::function<void()>> &jobs);
+
+    void waitPipelines();
+
+    // selects one of Renderers by name, throws for an unknown name
+    void setRenderer(const std::string &name);
+
+    // The renderer is likely to be selected soon: runs its Renderer::load on threadPool, so initializing it on
+    // selection only has to create and upload the GPU resources. Before run() the load starts with initVulkan.
+    void hintRenderer(const std::string &name);
+
 private:
     inline static const char *Renderers[] = {"Mesh", "Particle"};
     int rendererIndex = 0;
+    // set by the Renderer combo, applied at the start of the next frame
+    int requestedRendererIndex = 0;
     MeshRenderer *meshDrawer = new MeshRenderer();
     ParticleRenderer *particleDrawer = new ParticleRenderer();
 
-    Renderer *getRenderer() {
-        if (Renderers[rendererIndex] == std::string("Mesh")) {
+    struct RendererState {
+        bool initialized = false;
+        bool hinted = false;
+        // Renderer::load on threadPool, started by hintRenderer
+        std::future<void> loading;
+        // the deferred cleanup is waiting for the frames that may still use the renderer
+        bool releasing = false;
+        std::chrono::steady_clock::time_point deselectedTime;
+    };
+    RendererState rendererStates[std::size(Renderers)];
+
+    std::vector<std::future<void>> pipelineJobs;
+
+    Renderer *getRenderer(int index) {
+        if (Renderers[index] == std::string("Mesh")) {
             return meshDrawer;
         }
         return particleDrawer;
     }
 
+    Renderer *getRenderer() {
+        return getRenderer(rendererIndex);
+    }
+
     bool framebufferResized = false;
 
+    Benchmark benchmark;
+
     void initWindow();
 
     void initVulkan();
@@ -139,8 +375,12 @@ private:
 
     void mainLoop();
 
+    void runBenchmark();
+
     void updateData();
 
+    void buildOptionsWindow();
+
     void cleanup();
 
     void createInstance();
@@ -171,12 +411,30 @@ private:
 
     void createSyncObjects();
 
+    void cleanupSyncObjects();
+
+    void createTimelineSemaphores();
+
+    // reads a frame slot's timestamps, its timeline values have to be reached
+    void readFrameTimestamps(uint32_t frame);
+
+    // rebuilds per frame resources and the swapchain after the requested settings changed
+    void applyFrameSettings();
+
+    int findRenderer(const std::string &name);
+
+    // waits for a running load, then runs Renderer::init and its uploads to completion
+    void initRenderer(int index);
+
+    void selectRenderer(int index);
+
+    // deferred cleanup of deselected renderers idle for longer than rendererReleaseDelay
+    void releaseIdleRenderers();
+
     static void framebufferResizeCallback(GLFWwindow *window, int width, int height);
 
     const std::vector<const char *> getRequiredExtensions();
 
-    uint32_t findMemoryTypeIndex(uint32_t typeBitsFilter, VkMemoryPropertyFlags propertyFlags);
-
     void cleanupSwapChain();
 
     void recreateSwapChain();
@@ -185,12 +443,25 @@ private:
 
     void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE);
 
+    void createOffscreenImages();
+
+    // copies a headless color image (in TRANSFER_SRC_OPTIMAL) back to the host and writes it as a PPM
+    void saveOffscreenImage(VkImage image, const std::string &path);
+
     void drawFrame();
 
     void recordCommandBuffer(VkCommandBuffer currCommandBuffer, uint32_t imageIndex);
 
     void recordComputeCommandBuffer(VkCommandBuffer currCommandBuffer);
 
+    // Moves the graphics part of every upload whose copies have finished into the next graphics submit.
+    // Returns the upload timeline value that submit has to wait for, 0 if there was nothing to acquire.
+    UploadToken takeUploadAcquires(std::vector<VkCommandBuffer> &submitCommandBuffers);
+
+    void releaseAfter(uint64_t graphicsValue, uint64_t computeValue, std::function<void()> release);
+
+    void collectReleases();
+
     VkSampleCountFlagBits getMaxUsableSampleCount();
 
     VkFormat findDepthFormat();
@@ -208,6 +479,8 @@ private:
 
     bool checkDeviceExtensionSupport(const VkPhysicalDevice &targetPhysicalDevice);
 
+    bool isDeviceExtensionAvailable(const VkPhysicalDevice &targetPhysicalDevice, const char *extensionName);
+
     SwapChainSupportDetails querySwapChainSupport(const VkPhysicalDevice &targetPhysicalDevice);
 
     VkSurfaceFormatKHR
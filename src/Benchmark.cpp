@@ -0,0 +1,78 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+void Benchmark::addFrame(uint64_t frameNumber, double cpuMilliseconds, uint32_t submits) {
+    if (frameNumber < warmupFrames) return;
+
+    cpuFrameTimes.push_back(cpuMilliseconds);
+    submitCounts.push_back(submits);
+}
+
+void Benchmark::addGpuTime(uint64_t frameNumber, double gpuMilliseconds) {
+    if (frameNumber < warmupFrames) return;
+
+    gpuFrameTimes.push_back(gpuMilliseconds);
+}
+
+double Benchmark::percentile(const std::vector<double> &sortedValues, double p) {
+    if (sortedValues.empty()) return 0;
+
+    auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sortedValues.size())));
+    return sortedValues[std::clamp<size_t>(rank, 1, sortedValues.size()) - 1];
+}
+
+void Benchmark::writeStats(std::ostream &out, const std::vector<double> &values) {
+    std::vector<double> sorted(values);
+    std::sort(sorted.begin(), sorted.end());
+    double mean = sorted.empty() ? 0 : std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+
+    out << "{\"mean\": " << mean
+        << ", \"p50\": " << percentile(sorted, 50)
+        << ", \"p95\": " << percentile(sorted, 95)
+        << ", \"p99\": " << percentile(sorted, 99)
+        << ", \"min\": " << (sorted.empty() ? 0 : sorted.front())
+        << ", \"max\": " << (sorted.empty() ? 0 : sorted.back()) << "}";
+}
+
+void Benchmark::writeReport(std::ostream &out) const {
+    uint64_t totalSubmits = std::accumulate(submitCounts.begin(), submitCounts.end(), uint64_t(0));
+    uint32_t maxSubmits = submitCounts.empty() ? 0 : *std::max_element(submitCounts.begin(), submitCounts.end());
+
+    auto quoted = [](const std::string &value) {
+        std::string result = "\"";
+        for (char c: value) {
+            if (c == '"' || c == '\\') result += '\\';
+            result += c;
+        }
+        return result + "\"";
+    };
+
+    out << "{\n";
+    out << "  \"renderer\": " << quoted(rendererName) << ",\n";
+    out << "  \"device\": " << quoted(deviceName) << ",\n";
+    out << "  \"frames\": " << cpuFrameTimes.size() << ",\n";
+    out << "  \"warmup_frames\": " << warmupFrames << ",\n";
+    out << "  \"frames_in_flight\": " << framesInFlight << ",\n";
+    out << "  \"fixed_delta_time\": " << fixedDeltaTime << ",\n";
+    out << "  \"seed\": " << randomSeed << ",\n";
+    out << "  \"startup_ms\": " << startupMilliseconds << ",\n";
+    out << "  \"pipeline_cache\": " << (pipelineCacheWarm ? "\"warm\"" : "\"cold\"") << ",\n";
+    out << "  \"cpu_frame_ms\": ";
+    writeStats(out, cpuFrameTimes);
+    out << ",\n";
+    out << "  \"gpu_frame_ms\": ";
+    if (gpuFrameTimes.empty()) {
+        // no timestamp support on the queues used
+        out << "null";
+    } else {
+        writeStats(out, gpuFrameTimes);
+    }
+    out << ",\n";
+    out << "  \"submits\": {\"total\": " << totalSubmits
+        << ", \"per_frame_mean\": " << (submitCounts.empty() ? 0.0 : double(totalSubmits) / submitCounts.size())
+        << ", \"per_frame_max\": " << maxSubmits << "}\n";
+    out << "}\n";
+}
@@ -0,0 +1,39 @@
+#ifndef RENDERER_BENCHMARK_H
+#define RENDERER_BENCHMARK_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+// Collects per frame numbers of a --bench run and writes them out as a JSON report. Frames numbered below
+// warmupFrames are dropped, GPU times arrive a few frames late and are matched up by frame number.
+class Benchmark {
+public:
+    std::string rendererName;
+    std::string deviceName;
+    uint32_t warmupFrames = 0;
+    uint32_t framesInFlight = 0;
+    float fixedDeltaTime = 0;
+    uint32_t randomSeed = 0;
+    double startupMilliseconds = 0;
+    bool pipelineCacheWarm = false;
+
+    void addFrame(uint64_t frameNumber, double cpuMilliseconds, uint32_t submits);
+
+    void addGpuTime(uint64_t frameNumber, double gpuMilliseconds);
+
+    void writeReport(std::ostream &out) const;
+
+private:
+    std::vector<double> cpuFrameTimes;
+    std::vector<double> gpuFrameTimes;
+    std::vector<uint32_t> submitCounts;
+
+    // nearest rank on a sorted copy
+    static double percentile(const std::vector<double> &sortedValues, double p);
+
+    static void writeStats(std::ostream &out, const std::vector<double> &values);
+};
+
+#endif //RENDERER_BENCHMARK_H
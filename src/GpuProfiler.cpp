@@ -0,0 +1,132 @@
+#include "GpuProfiler.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+void GpuProfiler::init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, uint32_t frameCount) {
+    device = logicalDevice;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    timestampPeriod = properties.limits.timestampPeriod;
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    timestampMasks.resize(queueFamilyCount);
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        uint32_t validBits = queueFamilies[i].timestampValidBits;
+        timestampMasks[i] = validBits >= 64 ? UINT64_MAX : (uint64_t(1) << validBits) - 1;
+    }
+
+    frames.resize(frameCount);
+
+    VkQueryPoolCreateInfo queryPoolCreateInfo{};
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = frameCount * MAX_SCOPES_PER_FRAME * 2;
+
+    if (vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timestamp query pool!");
+    }
+    // queries start out undefined, a reset makes them writable
+    vkResetQueryPool(device, queryPool, 0, queryPoolCreateInfo.queryCount);
+}
+
+void GpuProfiler::cleanup() {
+    vkDestroyQueryPool(device, queryPool, nullptr);
+}
+
+void GpuProfiler::beginFrame(uint32_t frame, uint64_t frameNumber) {
+    frames[frame].frameNumber = frameNumber;
+}
+
+bool GpuProfiler::collectFrame(uint32_t frame, uint64_t &frameNumber, double &milliseconds) {
+    FrameScopes &frameScopes = frames[frame];
+    bool hasResults = !frameScopes.scopes.empty();
+
+    if (hasResults) {
+        frameNumber = frameScopes.frameNumber;
+        milliseconds = 0;
+
+        for (uint32_t i = 0; i < frameScopes.scopes.size(); ++i) {
+            const Scope &scope = frameScopes.scopes[i];
+            // never written, reading it would report VK_NOT_READY
+            if (scope.timestampMask == 0) continue;
+
+            std::array<uint64_t, 2> timestamps{};
+            if (vkGetQueryPoolResults(device, queryPool, firstQuery(frame) + i * 2, 2, sizeof(timestamps),
+                                      timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+                continue;
+            }
+
+            uint64_t ticks = (timestamps[1] - timestamps[0]) & scope.timestampMask;
+            double scopeMilliseconds = static_cast<double>(ticks) * timestampPeriod / 1e6;
+            addSample(scope, scopeMilliseconds);
+            if (scope.depth == 0) {
+                milliseconds += scopeMilliseconds;
+            }
+        }
+
+        uint32_t queryCount = static_cast<uint32_t>(frameScopes.scopes.size()) * 2;
+        vkResetQueryPool(device, queryPool, firstQuery(frame), queryCount);
+    }
+
+    frameScopes.scopes.clear();
+    frameScopes.openScopes = 0;
+    return hasResults;
+}
+
+uint32_t GpuProfiler::beginScope(VkCommandBuffer commandBuffer, uint32_t frame, const char *name,
+                                 uint32_t queueFamilyIndex) {
+    FrameScopes &frameScopes = frames[frame];
+    if (frameScopes.scopes.size() == MAX_SCOPES_PER_FRAME) {
+        return UINT32_MAX;
+    }
+
+    uint32_t scope = static_cast<uint32_t>(frameScopes.scopes.size());
+    frameScopes.scopes.push_back({name, frameScopes.openScopes++, timestampMasks[queueFamilyIndex]});
+
+    if (frameScopes.scopes.back().timestampMask != 0) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool,
+                            firstQuery(frame) + scope * 2);
+    }
+    return scope;
+}
+
+void GpuProfiler::endScope(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope) {
+    if (scope == UINT32_MAX) return;
+
+    FrameScopes &frameScopes = frames[frame];
+    frameScopes.openScopes--;
+
+    if (frameScopes.scopes[scope].timestampMask != 0) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool,
+                            firstQuery(frame) + scope * 2 + 1);
+    }
+}
+
+void GpuProfiler::addSample(const Scope &scope, double milliseconds) {
+    uint32_t index = 0;
+    while (index < scopeStats.size() && scopeStats[index].name != scope.name) {
+        index++;
+    }
+    if (index == scopeStats.size()) {
+        scopeStats.push_back({scope.name, scope.depth});
+        scopeHistories.emplace_back();
+    }
+
+    ScopeHistory &history = scopeHistories[index];
+    history.samples[history.next] = milliseconds;
+    history.next = (history.next + 1) % AVERAGE_FRAMES;
+    history.count = std::min(history.count + 1, AVERAGE_FRAMES);
+
+    double sum = 0;
+    for (uint32_t i = 0; i < history.count; ++i) {
+        sum += history.samples[i];
+    }
+    scopeStats[index].averageMilliseconds = sum / history.count;
+    scopeStats[index].latestMilliseconds = milliseconds;
+}
@@ -0,0 +1,80 @@
+#ifndef RENDERER_GPUPROFILER_H
+#define RENDERER_GPUPROFILER_H
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <array>
+#include <string>
+#include <cstdint>
+
+// Named GPU timestamp scopes, one range of queries per frame slot. A slot's results are read when the slot comes
+// around again, after its timeline values have been waited for, so reading never stalls. Scopes may nest, the
+// outermost ones add up to the frame's GPU time.
+class GpuProfiler {
+public:
+    static const uint32_t MAX_SCOPES_PER_FRAME = 16;
+    // frames the averages in getScopeStats run over
+    static const uint32_t AVERAGE_FRAMES = 64;
+
+    struct ScopeStats {
+        std::string name;
+        uint32_t depth = 0;
+        double averageMilliseconds = 0;
+        double latestMilliseconds = 0;
+    };
+
+    // queries are reset from the host, VkPhysicalDeviceVulkan12Features::hostQueryReset has to be enabled
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t frameCount);
+
+    void cleanup();
+
+    // The slot's scopes from here on belong to the frame identified by frameNumber.
+    void beginFrame(uint32_t frame, uint64_t frameNumber);
+
+    // Reads and resets the slot's queries once the GPU is done with them. Returns false if there was nothing to
+    // read, otherwise the frameNumber given to beginFrame and the summed time of the outermost scopes.
+    bool collectFrame(uint32_t frame, uint64_t &frameNumber, double &milliseconds);
+
+    // queueFamilyIndex: family of the queue commandBuffer is submitted to, families without timestamps are skipped
+    uint32_t beginScope(VkCommandBuffer commandBuffer, uint32_t frame, const char *name, uint32_t queueFamilyIndex);
+
+    void endScope(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope);
+
+    // in the order the scopes were first seen
+    const std::vector<ScopeStats> &getScopeStats() const { return scopeStats; }
+
+private:
+    struct Scope {
+        const char *name;
+        uint32_t depth;
+        uint64_t timestampMask;
+    };
+
+    struct FrameScopes {
+        uint64_t frameNumber = 0;
+        std::vector<Scope> scopes;
+        uint32_t openScopes = 0;
+    };
+
+    struct ScopeHistory {
+        std::array<double, AVERAGE_FRAMES> samples{};
+        uint32_t count = 0;
+        uint32_t next = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    float timestampPeriod = 1;
+    // per queue family, only the low timestampValidBits bits of a timestamp are meaningful, 0 without timestamps
+    std::vector<uint64_t> timestampMasks;
+
+    std::vector<FrameScopes> frames;
+    std::vector<ScopeStats> scopeStats;
+    std::vector<ScopeHistory> scopeHistories;
+
+    uint32_t firstQuery(uint32_t frame) const { return frame * MAX_SCOPES_PER_FRAME * 2; }
+
+    void addSample(const Scope &scope, double milliseconds);
+};
+
+#endif //RENDERER_GPUPROFILER_H
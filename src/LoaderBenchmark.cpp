@@ -0,0 +1,408 @@
+#include "LoaderBenchmark.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+
+#include <tiny_obj_loader.h>
+
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+#include "MeshRenderer.h"
+#include "MeshSimplifier.h"
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "VertexWeldMap.h"
+
+// what MeshRenderer::loadModel did before ObjLoader, kept as the baseline
+static void loadTinyobj(const std::string &path, std::vector<Vertex> &vertices, std::vector<uint32_t> &indices) {
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string err;
+
+    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, path.c_str(), nullptr, true)) {
+        throw std::runtime_error(err);
+    }
+
+    std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+
+    for (const auto &shape: shapes) {
+        for (const auto &index: shape.mesh.indices) {
+            Vertex vertex{};
+
+            vertex.position = {
+                    attrib.vertices[3 * index.vertex_index + 0],
+                    attrib.vertices[3 * index.vertex_index + 1],
+                    attrib.vertices[3 * index.vertex_index + 2],
+            };
+            if (index.texcoord_index >= 0) {
+                vertex.uv = {
+                        attrib.texcoords[2 * index.texcoord_index + 0],
+                        1.0 - attrib.texcoords[2 * index.texcoord_index + 1],
+                };
+            }
+            vertex.color = {1.0, 1.0, 1.0};
+
+            if (uniqueVertices.count(vertex) == 0) {
+                uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
+                vertices.push_back(vertex);
+            }
+
+            indices.push_back(uniqueVertices[vertex]);
+        }
+    }
+}
+
+std::string LoaderBenchmark::generateGrid(uint32_t size) {
+    std::string path = "grid_" + std::to_string(size) + ".obj";
+    if (std::filesystem::exists(path)) {
+        return path;
+    }
+
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to write " + path);
+    }
+    for (uint32_t y = 0; y <= size; ++y) {
+        for (uint32_t x = 0; x <= size; ++x) {
+            file << "v " << x << " " << y << " 0\n";
+        }
+    }
+    for (uint32_t y = 0; y <= size; ++y) {
+        for (uint32_t x = 0; x <= size; ++x) {
+            file << "vt " << static_cast<float>(x) / size << " " << static_cast<float>(y) / size << "\n";
+        }
+    }
+    for (uint32_t y = 0; y < size; ++y) {
+        for (uint32_t x = 0; x < size; ++x) {
+            uint32_t a = y * (size + 1) + x + 1;
+            uint32_t b = a + 1;
+            uint32_t c = a + size + 2;
+            uint32_t d = a + size + 1;
+            file << "f " << a << "/" << a << " " << b << "/" << b << " " << c << "/" << c << " " << d << "/" << d
+                 << "\n";
+        }
+    }
+    return path;
+}
+
+std::string LoaderBenchmark::resolvePath(const std::string &path) {
+    if (path.rfind("grid:", 0) == 0) {
+        return generateGrid(static_cast<uint32_t>(std::stoul(path.substr(5))));
+    }
+    return path;
+}
+
+template<typename Load>
+double LoaderBenchmark::bestOf(Load load) const {
+    double best = std::numeric_limits<double>::max();
+    for (uint32_t i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        load();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+void LoaderBenchmark::runObjScaling(const std::string &path, std::ostream &out) const {
+    std::string objPath = resolvePath(path);
+
+    std::vector<Vertex> referenceVertices;
+    std::vector<uint32_t> referenceIndices;
+    double baseline = bestOf([&] {
+        referenceVertices.clear();
+        referenceIndices.clear();
+        loadTinyobj(objPath, referenceVertices, referenceIndices);
+    });
+
+    uint32_t threadLimit = maxThreads > 0 ? maxThreads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> threadCounts;
+    for (uint32_t threads = 1; threads < threadLimit; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(threadLimit);
+
+    out << "{\n";
+    out << "  \"file\": \"" << objPath << "\",\n";
+    out << "  \"triangles\": " << referenceIndices.size() / 3 << ",\n";
+    out << "  \"vertices\": " << referenceVertices.size() << ",\n";
+    out << "  \"tinyobj_ms\": " << baseline << ",\n";
+    out << "  \"obj_loader\": [";
+
+    double singleThreaded = 0;
+    for (size_t i = 0; i < threadCounts.size(); ++i) {
+        // the calling thread takes part in parallelFor, so the pool holds one thread less
+        ThreadPool pool;
+        if (threadCounts[i] > 1) {
+            pool.init(threadCounts[i] - 1);
+        }
+
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        double time = bestOf([&] {
+            ObjLoader::load(objPath, threadCounts[i] > 1 ? &pool : nullptr, vertices, indices);
+        });
+        pool.cleanup();
+        if (i == 0) {
+            singleThreaded = time;
+        }
+
+        // same welding, same first use order: anything else is a bug, not a measurement
+        bool matches = vertices == referenceVertices && indices == referenceIndices;
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"threads\": " << threadCounts[i] << ", \"ms\": " << time
+            << ", \"speedup\": " << singleThreaded / time << ", \"vs_tinyobj\": " << baseline / time
+            << ", \"matches_tinyobj\": " << (matches ? "true" : "false") << "}";
+    }
+    out << "\n  ]\n";
+    out << "}\n";
+}
+
+void LoaderBenchmark::runWeldMaps(const std::string &path, std::ostream &out) const {
+    std::string objPath = resolvePath(path);
+
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    ObjLoader::load(objPath, nullptr, vertices, indices);
+    std::vector<Vertex> corners(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        corners[i] = vertices[indices[i]];
+    }
+
+    size_t uniqueCount = 0;
+    auto report = [&](const char *name, double time, bool last) {
+        out << "    {\"map\": \"" << name << "\", \"ms\": " << time << ", \"ns_per_corner\": "
+            << time * 1e6 / std::max<size_t>(1, corners.size()) << ", \"unique\": " << uniqueCount << "}"
+            << (last ? "\n" : ",\n");
+    };
+
+    out << "{\n";
+    out << "  \"file\": \"" << objPath << "\",\n";
+    out << "  \"corners\": " << corners.size() << ",\n";
+    out << "  \"vertices\": " << vertices.size() << ",\n";
+
+    std::unordered_set<size_t> stdHashes;
+    std::unordered_set<uint64_t> weldHashes;
+    VertexWeldMap keyMap;
+    for (const Vertex &vertex: vertices) {
+        stdHashes.insert(std::hash<Vertex>()(vertex));
+        weldHashes.insert(VertexWeldMap::hash(keyMap.makeKey(vertex)));
+    }
+    out << "  \"distinct_hashes\": {\"std_hash\": " << stdHashes.size() << ", \"weld_map\": " << weldHashes.size()
+        << "},\n";
+    out << "  \"maps\": [\n";
+
+    double time = bestOf([&] {
+        std::unordered_map<Vertex, uint32_t> uniqueVertices;
+        uint32_t next = 0;
+        for (const Vertex &vertex: corners) {
+            if (uniqueVertices.count(vertex) == 0) {
+                uniqueVertices[vertex] = next++;
+            }
+            volatile uint32_t index = uniqueVertices[vertex];
+            (void) index;
+        }
+        uniqueCount = uniqueVertices.size();
+    });
+    report("unordered_map", time, false);
+
+    time = bestOf([&] {
+        std::unordered_map<Vertex, uint32_t> uniqueVertices;
+        uniqueVertices.reserve(corners.size() / 4);
+        for (const Vertex &vertex: corners) {
+            auto [it, inserted] = uniqueVertices.try_emplace(vertex, static_cast<uint32_t>(uniqueVertices.size()));
+            volatile uint32_t index = it->second;
+            (void) index;
+        }
+        uniqueCount = uniqueVertices.size();
+    });
+    report("unordered_map_reserved", time, false);
+
+    time = bestOf([&] {
+        VertexWeldMap uniqueVertices;
+        uniqueVertices.reserve(corners.size() / 4);
+        for (const Vertex &vertex: corners) {
+            volatile uint32_t index = uniqueVertices.insert(vertex, static_cast<uint32_t>(uniqueVertices.size())).first;
+            (void) index;
+        }
+        uniqueCount = uniqueVertices.size();
+    });
+    report("weld_map", time, false);
+
+    time = bestOf([&] {
+        VertexWeldMap uniqueVertices;
+        uniqueVertices.quantization = 1e-5f;
+        uniqueVertices.reserve(corners.size() / 4);
+        for (const Vertex &vertex: corners) {
+            volatile uint32_t index = uniqueVertices.insert(vertex, static_cast<uint32_t>(uniqueVertices.size())).first;
+            (void) index;
+        }
+        uniqueCount = uniqueVertices.size();
+    });
+    report("weld_map_quantized_1e-5", time, true);
+
+    out << "  ]\n";
+    out << "}\n";
+}
+
+bool LoaderBenchmark::runLodCheck(const std::string &path, std::ostream &out) const {
+    std::string objPath = resolvePath(path);
+
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> baseIndices;
+    ObjLoader::load(objPath, nullptr, vertices, baseIndices);
+
+    std::vector<uint32_t> indices;
+    std::vector<MeshLod> lods;
+    double time = bestOf([&] {
+        indices = baseIndices;
+        lods = MeshSimplifier::buildLods(vertices, indices, MeshCache::MAX_LODS);
+    });
+
+    // UV and color seams split vertices that are one point of the surface, the checks only look at positions
+    std::vector<uint32_t> positionIds(vertices.size());
+    std::vector<glm::vec3> positions;
+    VertexWeldMap positionMap;
+    positionMap.reserve(vertices.size());
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        Vertex key{};
+        key.position = vertices[i].position;
+        auto [id, inserted] = positionMap.insert(key, static_cast<uint32_t>(positions.size()));
+        if (inserted) {
+            positions.push_back(key.position);
+        }
+        positionIds[i] = id;
+    }
+
+    std::vector<bool> originalBorder(positions.size(), false);
+    double originalBorderLength = 0;
+    bool passed = true;
+
+    out << "{\n";
+    out << "  \"file\": \"" << objPath << "\",\n";
+    out << "  \"vertices\": " << vertices.size() << ",\n";
+    out << "  \"build_ms\": " << time << ",\n";
+    out << "  \"lods\": [";
+
+    for (size_t level = 0; level < lods.size(); ++level) {
+        const MeshLod &lod = lods[level];
+        bool inRange = true;
+        std::map<std::pair<uint32_t, uint32_t>, uint32_t> edgeUses;
+        std::map<std::array<uint32_t, 3>, uint32_t> triangleUses;
+        for (uint32_t i = lod.firstIndex; i + 2 < lod.firstIndex + lod.indexCount && inRange; i += 3) {
+            std::array<uint32_t, 3> corners{};
+            for (uint32_t k = 0; k < 3; ++k) {
+                inRange = inRange && indices[i + k] < vertices.size();
+                corners[k] = inRange ? positionIds[indices[i + k]] : 0;
+            }
+            for (uint32_t k = 0; k < 3; ++k) {
+                uint32_t a = corners[k];
+                uint32_t b = corners[(k + 1) % 3];
+                ++edgeUses[{std::min(a, b), std::max(a, b)}];
+            }
+            std::sort(corners.begin(), corners.end());
+            ++triangleUses[corners];
+        }
+
+        bool manifold = true;
+        bool borderOnOriginal = true;
+        double borderLength = 0;
+        for (const auto &[edge, uses]: edgeUses) {
+            manifold = manifold && uses <= 2;
+            if (uses != 1) {
+                continue;
+            }
+            if (level == 0) {
+                originalBorder[edge.first] = true;
+                originalBorder[edge.second] = true;
+            }
+            borderOnOriginal = borderOnOriginal && originalBorder[edge.first] && originalBorder[edge.second];
+            borderLength += glm::length(positions[edge.first] - positions[edge.second]);
+        }
+        size_t duplicates = 0;
+        for (const auto &[triangle, uses]: triangleUses) {
+            duplicates += uses - 1;
+        }
+        if (level == 0) {
+            originalBorderLength = borderLength;
+        }
+        // border vertices never collapse, only rounding may change the length
+        double borderChange = std::abs(borderLength - originalBorderLength);
+        bool borderKept = borderChange <= BORDER_LENGTH_TOLERANCE * originalBorderLength;
+        passed = passed && inRange && manifold && duplicates == 0 && borderOnOriginal && borderKept;
+
+        out << (level == 0 ? "\n" : ",\n");
+        out << "    {\"triangles\": " << lod.indexCount / 3 << ", \"error\": " << lod.error
+            << ", \"indices_in_range\": " << (inRange ? "true" : "false")
+            << ", \"manifold\": " << (manifold ? "true" : "false")
+            << ", \"duplicate_triangles\": " << duplicates << ", \"border_length\": " << borderLength
+            << ", \"border_on_original\": " << (borderOnOriginal ? "true" : "false")
+            << ", \"border_kept\": " << (borderKept ? "true" : "false") << "}";
+    }
+    out << "\n  ],\n";
+    out << "  \"passed\": " << (passed ? "true" : "false") << "\n";
+    out << "}\n";
+    return passed;
+}
+
+bool LoaderBenchmark::runOptimizerCheck(const std::string &path, std::ostream &out) const {
+    std::string objPath = resolvePath(path);
+
+    std::vector<Vertex> baseVertices;
+    std::vector<uint32_t> baseIndices;
+    ObjLoader::load(objPath, nullptr, baseVertices, baseIndices);
+    auto vertexCount = static_cast<uint32_t>(baseVertices.size());
+
+    std::vector<uint32_t> cacheIndices;
+    double cacheTime = bestOf([&] {
+        cacheIndices = baseIndices;
+        MeshOptimizer::optimizeVertexCache(cacheIndices, vertexCount);
+    });
+    std::vector<uint32_t> overdrawIndices;
+    double overdrawTime = bestOf([&] {
+        overdrawIndices = cacheIndices;
+        MeshOptimizer::optimizeOverdraw(overdrawIndices, baseVertices);
+    });
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    double fetchTime = bestOf([&] {
+        vertices = baseVertices;
+        indices = overdrawIndices;
+        MeshOptimizer::optimizeVertexFetch(vertices, indices);
+    });
+
+    float inputAcmr = MeshOptimizer::analyzeVertexCache(baseIndices, vertexCount).acmr;
+    float cacheAcmr = MeshOptimizer::analyzeVertexCache(cacheIndices, vertexCount).acmr;
+    float overdrawAcmr = MeshOptimizer::analyzeVertexCache(overdrawIndices, vertexCount).acmr;
+    bool passed = overdrawAcmr <= MeshOptimizer::OVERDRAW_THRESHOLD * cacheAcmr;
+
+    out << "{\n";
+    out << "  \"file\": \"" << objPath << "\",\n";
+    out << "  \"triangles\": " << baseIndices.size() / 3 << ",\n";
+    out << "  \"vertices\": " << vertexCount << ",\n";
+    out << "  \"input_acmr\": " << inputAcmr << ",\n";
+    out << "  \"passes\": [\n";
+    out << "    {\"pass\": \"vertex_cache\", \"ms\": " << cacheTime << ", \"acmr\": " << cacheAcmr << "},\n";
+    out << "    {\"pass\": \"overdraw\", \"ms\": " << overdrawTime << ", \"acmr\": " << overdrawAcmr << "},\n";
+    out << "    {\"pass\": \"vertex_fetch\", \"ms\": " << fetchTime << ", \"vertices\": " << vertices.size() << "}\n";
+    out << "  ],\n";
+    out << "  \"overdraw_acmr_ratio\": " << overdrawAcmr / std::max(cacheAcmr, 1e-6f) << ",\n";
+    out << "  \"passed\": " << (passed ? "true" : "false") << "\n";
+    out << "}\n";
+    return passed;
+}
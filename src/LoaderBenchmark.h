@@ -0,0 +1,47 @@
+#ifndef RENDERER_LOADERBENCHMARK_H
+#define RENDERER_LOADERBENCHMARK_H
+
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+// Times mesh loading outside of the renderer (--obj-bench), no window or device needed. Results go out as JSON
+// like the frame benchmark report.
+class LoaderBenchmark {
+public:
+    // best of this many runs per configuration, the first run also pays for the page cache
+    uint32_t runs = 3;
+    // highest thread count measured, 0 for the hardware thread count
+    uint32_t maxThreads = 0;
+    // relative change of the open border length runLodCheck accepts between levels
+    static constexpr double BORDER_LENGTH_TOLERANCE = 1e-4;
+
+    // Loads path with the old tinyobj + std::unordered_map loop and with ObjLoader at 1, 2, 4, ... threads.
+    // "grid:<n>" writes an n x n quad grid (2 n^2 triangles) to grid_<n>.obj first and benchmarks that.
+    void runObjScaling(const std::string &path, std::ostream &out) const;
+
+    // Welds the corner stream of path (every index expanded to its vertex, what welding sees while loading) with
+    // std::unordered_map the way loadModel used to, with it reserved and a single lookup, and with VertexWeldMap
+    // exact and quantized. Also counts distinct std::hash<Vertex> and VertexWeldMap::hash values.
+    void runWeldMaps(const std::string &path, std::ostream &out) const;
+
+    // Times MeshSimplifier::buildLods on path (--lod-bench) and checks every level on positions alone, seams welded:
+    // indices in range, no edge shared by more than two triangles, no triangle twice, and every border edge running
+    // between border vertices of the full detail mesh, so the simplifier neither pinches nor tears the surface, with
+    // the border as long as at full detail. False if any level fails.
+    bool runLodCheck(const std::string &path, std::ostream &out) const;
+
+    // Times the MeshOptimizer passes loadModel runs on path (--optimize-bench) with the ACMR after each. False if
+    // optimizeOverdraw leaves it above MeshOptimizer::OVERDRAW_THRESHOLD times what optimizeVertexCache reached.
+    bool runOptimizerCheck(const std::string &path, std::ostream &out) const;
+
+private:
+    static std::string generateGrid(uint32_t size);
+
+    static std::string resolvePath(const std::string &path);
+
+    template<typename Load>
+    double bestOf(Load load) const;
+};
+
+#endif //RENDERER_LOADERBENCHMARK_H
@@ -0,0 +1,248 @@
+#include "MemoryAllocator.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+void MemoryAllocator::init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice) {
+    device = logicalDevice;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    bufferImageGranularity = properties.limits.bufferImageGranularity;
+    maxMemoryAllocationCount = properties.limits.maxMemoryAllocationCount;
+}
+
+void MemoryAllocator::cleanup() {
+    for (uint32_t i = 0; i < blocks.size(); ++i) {
+        destroyBlock(i);
+    }
+    blocks.clear();
+}
+
+uint32_t MemoryAllocator::findMemoryTypeIndex(uint32_t typeBitsFilter, VkMemoryPropertyFlags propertyFlags) const {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+        if (typeBitsFilter & (1 << i) &&
+            (propertyFlags & memoryProperties.memoryTypes[i].propertyFlags) == propertyFlags) {
+            return i;
+        }
+    }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceSize MemoryAllocator::getBlockSize(uint32_t memoryTypeIndex) const {
+    uint32_t heapIndex = memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+    VkDeviceSize heapSize = memoryProperties.memoryHeaps[heapIndex].size;
+
+    // small heaps (e.g. the 256MB device local + host visible BAR heap) shouldn't be eaten by a few blocks
+    if (heapSize <= 1024ull * 1024 * 1024) {
+        return std::min(preferredBlockSize, heapSize / 8);
+    }
+    return preferredBlockSize;
+}
+
+uint32_t MemoryAllocator::createBlock(uint32_t memoryTypeIndex, VkDeviceSize size, bool optimalTiling,
+                                      bool dedicated) {
+    if (liveBlockCount >= maxMemoryAllocationCount) {
+        throw std::runtime_error("failed to allocate memory block, maxMemoryAllocationCount reached!");
+    }
+
+    MemoryBlock block{};
+    block.size = size;
+    block.memoryTypeIndex = memoryTypeIndex;
+    block.optimalTiling = optimalTiling;
+    block.dedicated = dedicated;
+
+    VkMemoryAllocateInfo memoryAllocateInfo{};
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.allocationSize = size;
+    memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    if (vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &block.memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate memory block! size: " + std::to_string(size));
+    }
+
+    // A memory object can only be mapped once, so host visible blocks are mapped here and every
+    // sub-allocation gets a pointer into that mapping instead of calling vkMapMemory itself.
+    if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        if (vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped) != VK_SUCCESS) {
+            throw std::runtime_error("failed to map memory block!");
+        }
+    }
+
+    block.freeRanges[0] = size;
+    liveBlockCount++;
+
+    for (uint32_t i = 0; i < blocks.size(); ++i) {
+        if (blocks[i].memory == VK_NULL_HANDLE) {
+            blocks[i] = std::move(block);
+            return i;
+        }
+    }
+    blocks.push_back(std::move(block));
+    return static_cast<uint32_t>(blocks.size() - 1);
+}
+
+void MemoryAllocator::destroyBlock(uint32_t blockIndex) {
+    MemoryBlock &block = blocks[blockIndex];
+    if (block.memory == VK_NULL_HANDLE) return;
+
+    // vkFreeMemory implicitly unmaps
+    vkFreeMemory(device, block.memory, nullptr);
+    block = MemoryBlock{};
+    liveBlockCount--;
+}
+
+bool MemoryAllocator::allocateFromBlock(uint32_t blockIndex, VkDeviceSize size, VkDeviceSize alignment,
+                                        MemoryAllocation &allocation) {
+    MemoryBlock &block = blocks[blockIndex];
+
+    // best fit: the smallest free range that still holds the aligned allocation
+    auto bestRange = block.freeRanges.end();
+    VkDeviceSize bestPadding = 0;
+    for (auto range = block.freeRanges.begin(); range != block.freeRanges.end(); ++range) {
+        VkDeviceSize alignedOffset = (range->first + alignment - 1) / alignment * alignment;
+        VkDeviceSize padding = alignedOffset - range->first;
+        if (padding + size > range->second) continue;
+
+        if (bestRange == block.freeRanges.end() || range->second < bestRange->second) {
+            bestRange = range;
+            bestPadding = padding;
+        }
+    }
+
+    if (bestRange == block.freeRanges.end()) {
+        return false;
+    }
+
+    VkDeviceSize rangeOffset = bestRange->first;
+    VkDeviceSize rangeSize = bestRange->second;
+    block.freeRanges.erase(bestRange);
+
+    VkDeviceSize usedSize = bestPadding + size;
+    if (rangeSize > usedSize) {
+        block.freeRanges[rangeOffset + usedSize] = rangeSize - usedSize;
+    }
+
+    block.allocationCount++;
+    block.usedBytes += usedSize;
+    block.wastedBytes += bestPadding;
+
+    allocation.memory = block.memory;
+    allocation.offset = rangeOffset + bestPadding;
+    allocation.size = size;
+    allocation.padding = bestPadding;
+    allocation.blockIndex = blockIndex;
+    allocation.mapped = block.mapped ? static_cast<char *>(block.mapped) + allocation.offset : nullptr;
+    return true;
+}
+
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements &requirements,
+                                           VkMemoryPropertyFlags propertyFlags, bool optimalTiling) {
+    uint32_t memoryTypeIndex = findMemoryTypeIndex(requirements.memoryTypeBits, propertyFlags);
+
+    // Linear (buffers) and optimal (images) resources placed closer than bufferImageGranularity may alias
+    // on some hardware. Rather than padding every neighbour we never mix both kinds in one block.
+    bool separateTiling = bufferImageGranularity > 1;
+    bool blockTiling = separateTiling && optimalTiling;
+
+    MemoryAllocation allocation{};
+    VkDeviceSize blockSize = getBlockSize(memoryTypeIndex);
+
+    if (requirements.size > blockSize / 2) {
+        uint32_t blockIndex = createBlock(memoryTypeIndex, requirements.size, blockTiling, true);
+        allocateFromBlock(blockIndex, requirements.size, requirements.alignment, allocation);
+        return allocation;
+    }
+
+    for (uint32_t i = 0; i < blocks.size(); ++i) {
+        const MemoryBlock &block = blocks[i];
+        if (block.memory == VK_NULL_HANDLE || block.dedicated || block.memoryTypeIndex != memoryTypeIndex ||
+            block.optimalTiling != blockTiling) {
+            continue;
+        }
+        if (allocateFromBlock(i, requirements.size, requirements.alignment, allocation)) {
+            return allocation;
+        }
+    }
+
+    uint32_t blockIndex = createBlock(memoryTypeIndex, blockSize, blockTiling, false);
+    if (!allocateFromBlock(blockIndex, requirements.size, requirements.alignment, allocation)) {
+        throw std::runtime_error("failed to sub-allocate memory! size: " + std::to_string(requirements.size));
+    }
+    return allocation;
+}
+
+void MemoryAllocator::free(MemoryAllocation &allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) return;
+
+    MemoryBlock &block = blocks[allocation.blockIndex];
+
+    VkDeviceSize offset = allocation.offset - allocation.padding;
+    VkDeviceSize size = allocation.size + allocation.padding;
+
+    block.allocationCount--;
+    block.usedBytes -= size;
+    block.wastedBytes -= allocation.padding;
+    allocation = MemoryAllocation{};
+
+    if (block.allocationCount == 0) {
+        uint32_t blockIndex = &block - blocks.data();
+        // keep one empty block per memory type and tiling around so a free/allocate pair doesn't hit the driver,
+        // an empty block of the other tiling is no use when allocate keeps the two apart
+        bool keep = !block.dedicated;
+        for (uint32_t i = 0; keep && i < blocks.size(); ++i) {
+            const MemoryBlock &other = blocks[i];
+            if (i != blockIndex && other.memory != VK_NULL_HANDLE && !other.dedicated &&
+                other.memoryTypeIndex == block.memoryTypeIndex && other.optimalTiling == block.optimalTiling &&
+                other.allocationCount == 0) {
+                keep = false;
+            }
+        }
+        if (!keep) {
+            destroyBlock(blockIndex);
+            return;
+        }
+        block.freeRanges.clear();
+        block.freeRanges[0] = block.size;
+        return;
+    }
+
+    auto inserted = block.freeRanges.emplace(offset, size).first;
+
+    auto next = std::next(inserted);
+    if (next != block.freeRanges.end() && inserted->first + inserted->second == next->first) {
+        inserted->second += next->second;
+        block.freeRanges.erase(next);
+    }
+
+    if (inserted != block.freeRanges.begin()) {
+        auto prev = std::prev(inserted);
+        if (prev->first + prev->second == inserted->first) {
+            prev->second += inserted->second;
+            block.freeRanges.erase(inserted);
+        }
+    }
+}
+
+MemoryAllocatorStats MemoryAllocator::getStats() const {
+    MemoryAllocatorStats stats{};
+    for (const auto &block: blocks) {
+        if (block.memory == VK_NULL_HANDLE) continue;
+
+        stats.blockCount++;
+        stats.allocationCount += block.allocationCount;
+        stats.blockBytes += block.size;
+        stats.usedBytes += block.usedBytes;
+        stats.wastedBytes += block.wastedBytes;
+        for (const auto &[offset, size]: block.freeRanges) {
+            stats.freeBytes += size;
+            stats.freeRangeCount++;
+            stats.largestFreeRange = std::max(stats.largestFreeRange, size);
+        }
+    }
+    return stats;
+}
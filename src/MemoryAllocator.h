@@ -0,0 +1,94 @@
+#ifndef RENDERER_MEMORYALLOCATOR_H
+#define RENDERER_MEMORYALLOCATOR_H
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+struct MemoryAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    // null unless the memory type is HOST_VISIBLE, blocks of those types stay mapped for their whole lifetime
+    void *mapped = nullptr;
+
+    uint32_t blockIndex = 0;
+    // bytes skipped in front of offset to satisfy the alignment, given back to the block on free
+    VkDeviceSize padding = 0;
+};
+
+struct MemoryAllocatorStats {
+    uint32_t blockCount = 0;
+    uint32_t allocationCount = 0;
+    VkDeviceSize blockBytes = 0;
+    VkDeviceSize usedBytes = 0;
+    // alignment padding, counted in usedBytes as well
+    VkDeviceSize wastedBytes = 0;
+    VkDeviceSize freeBytes = 0;
+    VkDeviceSize largestFreeRange = 0;
+    uint32_t freeRangeCount = 0;
+
+    // 0 when all free memory is one contiguous range, approaching 1 as it gets split into small pieces
+    float fragmentation() const {
+        return freeBytes == 0 ? 0.0f : 1.0f - static_cast<float>(largestFreeRange) / static_cast<float>(freeBytes);
+    }
+};
+
+// Sub-allocates buffers and images out of large VkDeviceMemory blocks, one set of blocks per memory type,
+// instead of calling vkAllocateMemory per resource (maxMemoryAllocationCount can be as low as 4096).
+class MemoryAllocator {
+public:
+    VkDeviceSize preferredBlockSize = 64 * 1024 * 1024;
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice device);
+
+    void cleanup();
+
+    // optimalTiling: the resource is a VK_IMAGE_TILING_OPTIMAL image, see bufferImageGranularity
+    MemoryAllocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags propertyFlags,
+                              bool optimalTiling);
+
+    void free(MemoryAllocation &allocation);
+
+    MemoryAllocatorStats getStats() const;
+
+    uint32_t findMemoryTypeIndex(uint32_t typeBitsFilter, VkMemoryPropertyFlags propertyFlags) const;
+
+private:
+    struct MemoryBlock {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        uint32_t memoryTypeIndex = 0;
+        bool optimalTiling = false;
+        // created for a single large resource, released as soon as that resource is freed
+        bool dedicated = false;
+        void *mapped = nullptr;
+
+        // offset -> size, ordered by offset so neighbouring ranges can be merged on free
+        std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+        uint32_t allocationCount = 0;
+        VkDeviceSize usedBytes = 0;
+        VkDeviceSize wastedBytes = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    VkDeviceSize bufferImageGranularity = 1;
+    uint32_t maxMemoryAllocationCount = 0;
+
+    // released blocks keep their slot (memory == VK_NULL_HANDLE) so MemoryAllocation::blockIndex stays valid
+    std::vector<MemoryBlock> blocks;
+    uint32_t liveBlockCount = 0;
+
+    VkDeviceSize getBlockSize(uint32_t memoryTypeIndex) const;
+
+    uint32_t createBlock(uint32_t memoryTypeIndex, VkDeviceSize size, bool optimalTiling, bool dedicated);
+
+    void destroyBlock(uint32_t blockIndex);
+
+    bool allocateFromBlock(uint32_t blockIndex, VkDeviceSize size, VkDeviceSize alignment,
+                           MemoryAllocation &allocation);
+};
+
+#endif //RENDERER_MEMORYALLOCATOR_H
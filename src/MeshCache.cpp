@@ -0,0 +1,186 @@
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MeshRenderer.h"
+
+bool MeshCache::open(const std::string &path, const std::string &sourcePath, uint32_t contentFlags) {
+    close();
+
+    uint64_t sourceSize = 0;
+    int64_t sourceModified = 0;
+    statFile(sourcePath, sourceSize, sourceModified);
+
+    size_t size = 0;
+    void *data = mapFile(path, size);
+    if (!data) {
+        return false;
+    }
+
+    const auto *fileHeader = static_cast<const FileHeader *>(data);
+    bool valid = size >= sizeof(FileHeader) && fileHeader->magic == MAGIC &&
+                 fileHeader->fileVersion == FILE_VERSION && fileHeader->vertexSize == sizeof(Vertex) &&
+                 fileHeader->indexSize == sizeof(uint32_t) && fileHeader->sourceSize == sourceSize &&
+                 fileHeader->contentFlags == contentFlags &&
+                 size == sizeof(FileHeader) + static_cast<size_t>(fileHeader->vertexCount) * sizeof(Vertex) +
+                         static_cast<size_t>(fileHeader->indexCount) * sizeof(uint32_t) &&
+                 fileHeader->lodCount >= 1 && fileHeader->lodCount <= MAX_LODS;
+    for (uint32_t lod = 0; valid && lod < fileHeader->lodCount; ++lod) {
+        const MeshLod &range = fileHeader->lods[lod];
+        valid = range.firstIndex <= fileHeader->indexCount &&
+                range.indexCount <= fileHeader->indexCount - range.firstIndex;
+    }
+    if (valid && fileHeader->sourceModified != sourceModified) {
+        // touched or copied without changing size, only the contents can tell
+        valid = fileHeader->sourceHash == hashFile(sourcePath);
+    }
+    if (valid) {
+        // damaged index data would have the upload (and splitSubmeshes) read and write past the vertices, one pass
+        // over the mapping costs little next to copying it to the GPU
+        size_t indexOffset = sizeof(FileHeader) + static_cast<size_t>(fileHeader->vertexCount) * sizeof(Vertex);
+        const auto *indices = reinterpret_cast<const uint32_t *>(static_cast<const char *>(data) + indexOffset);
+        uint32_t maxIndex = 0;
+        for (uint32_t i = 0; i < fileHeader->indexCount; ++i) {
+            maxIndex = std::max(maxIndex, indices[i]);
+        }
+        valid = fileHeader->indexCount == 0 || maxIndex < fileHeader->vertexCount;
+    }
+    if (!valid) {
+        std::cout << "mesh cache " << path << " is stale or damaged, rebuilding it\n";
+        munmap(data, size);
+        return false;
+    }
+
+    mapping = data;
+    mappingSize = size;
+    header = fileHeader;
+    return true;
+}
+
+void MeshCache::close() {
+    if (mapping) {
+        munmap(mapping, mappingSize);
+    }
+    mapping = nullptr;
+    mappingSize = 0;
+    header = nullptr;
+}
+
+const Vertex *MeshCache::getVertices() const {
+    static_assert(sizeof(FileHeader) % alignof(Vertex) == 0, "vertices behind the header must stay aligned");
+    return reinterpret_cast<const Vertex *>(static_cast<const char *>(mapping) + sizeof(FileHeader));
+}
+
+const uint32_t *MeshCache::getIndices() const {
+    return reinterpret_cast<const uint32_t *>(getVertices() + header->vertexCount);
+}
+
+bool MeshCache::write(const std::string &path, const std::string &sourcePath, uint32_t contentFlags,
+                      const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                      const std::vector<MeshLod> &lods) {
+    if (lods.empty() || lods.size() > MAX_LODS) {
+        throw std::runtime_error("mesh cache holds 1 to " + std::to_string(MAX_LODS) + " levels of detail!");
+    }
+
+    FileHeader fileHeader{};
+    fileHeader.magic = MAGIC;
+    fileHeader.fileVersion = FILE_VERSION;
+    fileHeader.vertexSize = sizeof(Vertex);
+    fileHeader.indexSize = sizeof(uint32_t);
+    statFile(sourcePath, fileHeader.sourceSize, fileHeader.sourceModified);
+    fileHeader.sourceHash = hashFile(sourcePath);
+    fileHeader.vertexCount = static_cast<uint32_t>(vertices.size());
+    fileHeader.indexCount = static_cast<uint32_t>(indices.size());
+    fileHeader.contentFlags = contentFlags;
+    fileHeader.lodCount = static_cast<uint32_t>(lods.size());
+    std::copy(lods.begin(), lods.end(), fileHeader.lods);
+
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "failed to write mesh cache " << tempPath << "\n";
+            return false;
+        }
+        file.write(reinterpret_cast<const char *>(&fileHeader), sizeof(fileHeader));
+        file.write(reinterpret_cast<const char *>(vertices.data()),
+                   static_cast<std::streamsize>(vertices.size() * sizeof(Vertex)));
+        file.write(reinterpret_cast<const char *>(indices.data()),
+                   static_cast<std::streamsize>(indices.size() * sizeof(uint32_t)));
+        file.flush();
+        if (!file) {
+            std::cout << "failed to write mesh cache " << tempPath << "\n";
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::cout << "failed to replace mesh cache " << path << ": " << error.message() << "\n";
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+    return true;
+}
+
+uint64_t MeshCache::hashFile(const std::string &path) {
+    size_t size = 0;
+    void *data = mapFile(path, size);
+    if (!data) {
+        throw std::runtime_error("failed to open file! " + path);
+    }
+
+    // FNV-1a, only has to notice that the source changed
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    uint64_t value = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        value ^= bytes[i];
+        value *= 0x100000001b3ull;
+    }
+
+    munmap(data, size);
+    return value;
+}
+
+void MeshCache::statFile(const std::string &path, uint64_t &size, int64_t &modified) {
+    struct stat fileStat{};
+    if (stat(path.c_str(), &fileStat) != 0) {
+        throw std::runtime_error("failed to open file! " + path);
+    }
+    size = static_cast<uint64_t>(fileStat.st_size);
+    modified = static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec;
+}
+
+void *MeshCache::mapFile(const std::string &path, size_t &size) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat fileStat{};
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    size = static_cast<size_t>(fileStat.st_size);
+
+    // the mapping keeps the file referenced, the descriptor isn't needed past this point
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    // read front to back into the staging buffer
+    madvise(data, size, MADV_SEQUENTIAL);
+    return data;
+}
@@ -0,0 +1,91 @@
+#ifndef RENDERER_MESHCACHE_H
+#define RENDERER_MESHCACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct Vertex;
+
+// one level of detail, a range of the index array drawn with the same vertices as every other level
+struct MeshLod {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    // about how far the surface is from the full detail one, in model units
+    float error;
+};
+
+// A welded mesh on disk: a header followed by the raw Vertex and uint32_t index arrays, exactly as they are copied
+// into the staging buffer. Opening maps the file, so a warm load is the page cache plus a memcpy. The header holds
+// the size, modification time and a hash of the source file, an edited OBJ (or a changed Vertex layout) makes the
+// cache stale instead of wrong. The source is only read again when its size matches but its time doesn't.
+// The indices of the coarser levels of detail follow those of the full detail mesh, the header has their ranges.
+class MeshCache {
+public:
+    static const uint32_t MAX_LODS = 4;
+
+    ~MeshCache() { close(); }
+
+    // Maps path if it is a cache of this format built from sourcePath as it is now, false otherwise. Throws if
+    // sourcePath doesn't exist. contentFlags are the caller's processing options, a cache written with other ones
+    // is stale too.
+    bool open(const std::string &path, const std::string &sourcePath, uint32_t contentFlags);
+
+    void close();
+
+    bool isOpen() const { return mapping != nullptr; }
+
+    const Vertex *getVertices() const;
+
+    uint32_t getVertexCount() const { return header->vertexCount; }
+
+    const uint32_t *getIndices() const;
+
+    uint32_t getIndexCount() const { return header->indexCount; }
+
+    // at least 1, the full detail mesh
+    uint32_t getLodCount() const { return header->lodCount; }
+
+    const MeshLod &getLod(uint32_t lod) const { return header->lods[lod]; }
+
+    // writes next to path and renames over it like PipelineCache::save, false if the directory isn't writable
+    static bool write(const std::string &path, const std::string &sourcePath, uint32_t contentFlags,
+                      const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices,
+                      const std::vector<MeshLod> &lods);
+
+    // of the whole file, throws if it can't be read
+    static uint64_t hashFile(const std::string &path);
+
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t fileVersion;
+        uint32_t vertexSize;
+        uint32_t indexSize;
+        uint64_t sourceSize;
+        // nanoseconds since the epoch
+        int64_t sourceModified;
+        uint64_t sourceHash;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t contentFlags;
+        uint32_t lodCount;
+        MeshLod lods[MAX_LODS];
+    };
+
+    static const uint32_t MAGIC = 0x48534d52; // "RMSH"
+    // bump whenever Vertex or the layout of the file changes
+    static const uint32_t FILE_VERSION = 4;
+
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const FileHeader *header = nullptr;
+
+    // read only, nullptr for a missing or empty file
+    static void *mapFile(const std::string &path, size_t &size);
+
+    // throws if path can't be stat'ed
+    static void statFile(const std::string &path, uint64_t &size, int64_t &modified);
+};
+
+#endif //RENDERER_MESHCACHE_H
@@ -0,0 +1,306 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Forsyth's scoring ("Linear-Speed Vertex Cache Optimisation"), modelled on an LRU cache of this size
+static const int FORSYTH_CACHE_SIZE = 32;
+static const uint32_t FORSYTH_MAX_VALENCE = 32;
+
+struct ForsythScores {
+    float cache[FORSYTH_CACHE_SIZE];
+    float valence[FORSYTH_MAX_VALENCE + 1];
+
+    ForsythScores() {
+        for (int i = 0; i < FORSYTH_CACHE_SIZE; ++i) {
+            // the last triangle's vertices get a fixed score, so the next one isn't simply its neighbour in the strip
+            cache[i] = i < 3 ? 0.75f : std::pow(1.0f - static_cast<float>(i - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+        }
+        valence[0] = 0;
+        for (uint32_t i = 1; i <= FORSYTH_MAX_VALENCE; ++i) {
+            // vertices with few triangles left are finished off first, so they can leave the cache for good
+            valence[i] = 2.0f / std::sqrt(static_cast<float>(i));
+        }
+    }
+
+    float vertex(int cachePosition, uint32_t remainingTriangles) const {
+        if (remainingTriangles == 0) return -1.0f;
+        float score = valence[std::min(remainingTriangles, FORSYTH_MAX_VALENCE)];
+        if (cachePosition >= 0) {
+            score += cache[cachePosition];
+        }
+        return score;
+    }
+};
+
+void MeshOptimizer::optimizeVertexCache(std::vector<uint32_t> &indices, uint32_t vertexCount) {
+    static const ForsythScores scores;
+    auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    if (triangleCount == 0) return;
+
+    // triangles of every vertex, the first remaining[v] of a vertex's range are the ones not emitted yet
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    for (uint32_t index: indices) {
+        remaining[index]++;
+    }
+    std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+    std::partial_sum(remaining.begin(), remaining.end(), adjacencyOffsets.begin() + 1);
+    std::vector<uint32_t> adjacency(indices.size());
+    std::vector<uint32_t> filled(vertexCount, 0);
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = indices[t * 3 + k];
+            adjacency[adjacencyOffsets[v] + filled[v]++] = t;
+        }
+    }
+
+    std::vector<int> cachePositions(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        vertexScores[v] = scores.vertex(-1, remaining[v]);
+    }
+    std::vector<float> triangleScores(triangleCount);
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] +
+                            vertexScores[indices[t * 3 + 2]];
+    }
+    std::vector<bool> emitted(triangleCount, false);
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> newCache;
+    cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+
+    uint32_t nextTriangle = static_cast<uint32_t>(std::max_element(triangleScores.begin(), triangleScores.end()) -
+                                                  triangleScores.begin());
+    // dead ends fall back to the next triangle in input order, instead of a full scan for the best score
+    uint32_t inputCursor = 0;
+
+    for (uint32_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount) {
+        if (nextTriangle == UINT32_MAX) {
+            while (emitted[inputCursor]) {
+                inputCursor++;
+            }
+            nextTriangle = inputCursor;
+        }
+
+        uint32_t t = nextTriangle;
+        emitted[t] = true;
+        const uint32_t *triangle = &indices[t * 3];
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = triangle[k];
+            result.push_back(v);
+
+            // drop t from the vertex's remaining triangles
+            uint32_t *begin = &adjacency[adjacencyOffsets[v]];
+            uint32_t *end = begin + remaining[v];
+            std::iter_swap(std::find(begin, end, t), end - 1);
+            remaining[v]--;
+        }
+
+        // the triangle's vertices move to the front, everything else shifts back and may fall out
+        newCache.assign(triangle, triangle + 3);
+        for (uint32_t v: cache) {
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2]) {
+                newCache.push_back(v);
+            }
+        }
+        for (size_t i = FORSYTH_CACHE_SIZE; i < newCache.size(); ++i) {
+            cachePositions[newCache[i]] = -1;
+            vertexScores[newCache[i]] = scores.vertex(-1, remaining[newCache[i]]);
+        }
+        newCache.resize(std::min<size_t>(newCache.size(), FORSYTH_CACHE_SIZE));
+        std::swap(cache, newCache);
+
+        for (size_t i = 0; i < cache.size(); ++i) {
+            cachePositions[cache[i]] = static_cast<int>(i);
+            vertexScores[cache[i]] = scores.vertex(static_cast<int>(i), remaining[cache[i]]);
+        }
+
+        // only triangles touching the cache changed score, the best of them goes next
+        nextTriangle = UINT32_MAX;
+        float bestScore = -1.0f;
+        for (uint32_t v: cache) {
+            for (uint32_t a = 0; a < remaining[v]; ++a) {
+                uint32_t other = adjacency[adjacencyOffsets[v] + a];
+                const uint32_t *otherTriangle = &indices[other * 3];
+                float score = vertexScores[otherTriangle[0]] + vertexScores[otherTriangle[1]] +
+                              vertexScores[otherTriangle[2]];
+                if (score > bestScore) {
+                    bestScore = score;
+                    nextTriangle = other;
+                }
+            }
+        }
+    }
+
+    indices = std::move(result);
+}
+
+std::vector<uint32_t> MeshOptimizer::findClusters(const std::vector<uint32_t> &indices, uint32_t vertexCount,
+                                                  float threshold) {
+    auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+
+    // FIFO cache simulation, timestamps instead of a queue: a vertex is cached if it was missed recently enough
+    std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+    uint32_t timestamp = ANALYZE_CACHE_SIZE + 1;
+    auto miss = [&](uint32_t v) {
+        if (timestamp - cacheTimestamps[v] > ANALYZE_CACHE_SIZE) {
+            cacheTimestamps[v] = timestamp++;
+            return 1u;
+        }
+        return 0u;
+    };
+    auto resetCache = [&] { timestamp += ANALYZE_CACHE_SIZE + 1; };
+
+    // hard boundaries: triangles where the cache starts over anyway, optimizeVertexCache hit a dead end there
+    std::vector<uint32_t> hardClusters;
+    for (uint32_t t = 0; t < triangleCount; ++t) {
+        uint32_t misses = miss(indices[t * 3]) + miss(indices[t * 3 + 1]) + miss(indices[t * 3 + 2]);
+        if (misses == 3 || t == 0) {
+            hardClusters.push_back(t);
+        }
+    }
+    hardClusters.push_back(triangleCount);
+
+    // soft boundaries: within a hard cluster, cut as soon as the part so far is cache efficient enough on its own
+    std::vector<uint32_t> clusters;
+    for (size_t c = 0; c + 1 < hardClusters.size(); ++c) {
+        uint32_t begin = hardClusters[c];
+        uint32_t end = hardClusters[c + 1];
+
+        resetCache();
+        uint32_t clusterMisses = 0;
+        for (uint32_t t = begin; t < end; ++t) {
+            clusterMisses += miss(indices[t * 3]) + miss(indices[t * 3 + 1]) + miss(indices[t * 3 + 2]);
+        }
+        float clusterThreshold = threshold * static_cast<float>(clusterMisses) / static_cast<float>(end - begin);
+
+        resetCache();
+        clusters.push_back(begin);
+        uint32_t start = begin;
+        uint32_t misses = 0;
+        for (uint32_t t = begin; t < end; ++t) {
+            misses += miss(indices[t * 3]) + miss(indices[t * 3 + 1]) + miss(indices[t * 3 + 2]);
+            if (t + 1 < end && static_cast<float>(misses) / static_cast<float>(t - start + 1) <= clusterThreshold) {
+                clusters.push_back(t + 1);
+                start = t + 1;
+                misses = 0;
+                resetCache();
+            }
+        }
+    }
+    clusters.push_back(triangleCount);
+    return clusters;
+}
+
+std::vector<uint32_t> MeshOptimizer::sortClusters(const std::vector<uint32_t> &indices,
+                                                  const std::vector<Vertex> &vertices,
+                                                  const std::vector<uint32_t> &clusters,
+                                                  const glm::vec3 &meshCentroid) {
+    size_t clusterCount = clusters.size() - 1;
+
+    // clusters facing away from the mesh centre are more likely in front of the rest, draw them first
+    std::vector<float> sortKeys(clusterCount);
+    for (size_t c = 0; c < clusterCount; ++c) {
+        glm::vec3 centroid{0, 0, 0};
+        glm::vec3 normal{0, 0, 0};
+        float area = 0;
+        for (uint32_t t = clusters[c]; t < clusters[c + 1]; ++t) {
+            const glm::vec3 &p0 = vertices[indices[t * 3]].position;
+            const glm::vec3 &p1 = vertices[indices[t * 3 + 1]].position;
+            const glm::vec3 &p2 = vertices[indices[t * 3 + 2]].position;
+            glm::vec3 crossProduct = glm::cross(p1 - p0, p2 - p0);
+            float triangleArea = glm::length(crossProduct);
+            centroid += (p0 + p1 + p2) * (triangleArea / 3.0f);
+            normal += crossProduct;
+            area += triangleArea;
+        }
+        if (area > 0) {
+            centroid /= area;
+        }
+        float normalLength = glm::length(normal);
+        sortKeys[c] = normalLength > 0 ? glm::dot(centroid - meshCentroid, normal / normalLength) : 0;
+    }
+
+    std::vector<uint32_t> order(clusterCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    for (uint32_t c: order) {
+        result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+    }
+    return result;
+}
+
+void MeshOptimizer::optimizeOverdraw(std::vector<uint32_t> &indices, const std::vector<Vertex> &vertices,
+                                     float threshold) {
+    auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    if (triangleCount == 0) return;
+
+    auto vertexCount = static_cast<uint32_t>(vertices.size());
+    float maxAcmr = threshold * analyzeVertexCache(indices, vertexCount).acmr;
+    std::vector<uint32_t> clusters = findClusters(indices, vertexCount, threshold);
+
+    glm::vec3 meshCentroid{0, 0, 0};
+    for (const Vertex &vertex: vertices) {
+        meshCentroid += vertex.position;
+    }
+    meshCentroid /= static_cast<float>(std::max<size_t>(1, vertexCount));
+
+    // The cuts findClusters makes start the cache over, next to whatever cluster the sort puts there. When that
+    // costs more than threshold, neighbouring clusters merge pairwise and sort again, a single cluster is the input.
+    std::vector<uint32_t> result = sortClusters(indices, vertices, clusters, meshCentroid);
+    while (clusters.size() > 2 && analyzeVertexCache(result, vertexCount).acmr > maxAcmr) {
+        std::vector<uint32_t> merged;
+        merged.reserve(clusters.size() / 2 + 1);
+        for (size_t c = 0; c + 1 < clusters.size(); c += 2) {
+            merged.push_back(clusters[c]);
+        }
+        merged.push_back(triangleCount);
+        clusters = std::move(merged);
+        result = sortClusters(indices, vertices, clusters, meshCentroid);
+    }
+    indices = std::move(result);
+}
+
+void MeshOptimizer::optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices) {
+    std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+    std::vector<Vertex> result;
+    result.reserve(vertices.size());
+
+    for (uint32_t &index: indices) {
+        if (remap[index] == UINT32_MAX) {
+            remap[index] = static_cast<uint32_t>(result.size());
+            result.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    // vertices no triangle uses are dropped
+    vertices = std::move(result);
+}
+
+VertexCacheStats MeshOptimizer::analyzeVertexCache(const std::vector<uint32_t> &indices, uint32_t vertexCount,
+                                                   uint32_t cacheSize) {
+    VertexCacheStats stats{};
+    if (indices.empty() || vertexCount == 0) return stats;
+
+    std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+    uint32_t timestamp = cacheSize + 1;
+    uint32_t misses = 0;
+    for (uint32_t index: indices) {
+        if (timestamp - cacheTimestamps[index] > cacheSize) {
+            cacheTimestamps[index] = timestamp++;
+            misses++;
+        }
+    }
+
+    stats.acmr = static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+    stats.atvr = static_cast<float>(misses) / static_cast<float>(vertexCount);
+    return stats;
+}
@@ -0,0 +1,49 @@
+#ifndef RENDERER_MESHOPTIMIZER_H
+#define RENDERER_MESHOPTIMIZER_H
+
+#include <vector>
+#include <cstdint>
+
+#include "MeshRenderer.h"
+
+struct VertexCacheStats {
+    // vertex shader invocations per triangle, 0.5 is the best a regular grid gets, 3 means no reuse at all
+    float acmr = 0;
+    // invocations per vertex, 1 means every vertex is transformed exactly once
+    float atvr = 0;
+};
+
+// Reorders an indexed triangle list for the GPU without changing what it draws: triangles for post-transform
+// vertex cache hits (Forsyth), then groups of them so front facing parts come first for early-Z (Tipsify's
+// cluster sort), then the vertices in the order the triangles first use them.
+class MeshOptimizer {
+public:
+    // the FIFO size analyzeVertexCache models, small enough to be pessimistic about every GPU around
+    static const uint32_t ANALYZE_CACHE_SIZE = 16;
+    // how much worse than optimizeVertexCache's ACMR optimizeOverdraw may leave it by default
+    static constexpr float OVERDRAW_THRESHOLD = 1.05f;
+
+    static void optimizeVertexCache(std::vector<uint32_t> &indices, uint32_t vertexCount);
+
+    // Keeps runs that hit the vertex cache well together, so reordering them costs at most threshold times
+    // the ACMR (merging neighbouring clusters until the sorted result measures within it). Expects indices from
+    // optimizeVertexCache.
+    static void optimizeOverdraw(std::vector<uint32_t> &indices, const std::vector<Vertex> &vertices,
+                                 float threshold = OVERDRAW_THRESHOLD);
+
+    static void optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices);
+
+    static VertexCacheStats analyzeVertexCache(const std::vector<uint32_t> &indices, uint32_t vertexCount,
+                                               uint32_t cacheSize = ANALYZE_CACHE_SIZE);
+
+private:
+    // triangle indices of every cluster start, followed by the triangle count
+    static std::vector<uint32_t> findClusters(const std::vector<uint32_t> &indices, uint32_t vertexCount,
+                                              float threshold);
+
+    // the triangles of indices with the clusters (as findClusters returns them) outward facing first
+    static std::vector<uint32_t> sortClusters(const std::vector<uint32_t> &indices, const std::vector<Vertex> &vertices,
+                                              const std::vector<uint32_t> &clusters, const glm::vec3 &meshCentroid);
+};
+
+#endif //RENDERER_MESHOPTIMIZER_H
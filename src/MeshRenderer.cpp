@@ -1,43 +1,146 @@
 #include "MeshRenderer.h"
 
 #include <iostream>
-#include <unordered_map>
+#include <random>
 
 #define STB_IMAGE_IMPLEMENTATION
-#define TINYOBJLOADER_IMPLEMENTATION
 
 #include <stb_image.h>
-#include <tiny_obj_loader.h>
+#include <glm/gtc/packing.hpp>
 
 #include "Application.h"
+#include "ObjLoader.h"
+#include "MeshOptimizer.h"
+#include "MeshletBuilder.h"
+#include "MeshSimplifier.h"
 #include "utils.h"
 
+static const std::string MODEL_PATH = "assets/viking_room.obj";
+// written on the first load, next to the model it was built from
+static const std::string MODEL_CACHE_PATH = "assets/viking_room.mesh";
+// MeshCache content flags
+static const uint32_t MESH_OPTIMIZED = 1;
+static const uint32_t MESH_LODS = 2;
+// between neighbouring instances of the scene grid, the model is about two units wide
+static const float INSTANCE_SPACING = 2.5f;
+// vertices a 16-bit index buffer may address, 0xffff is left out so the buffer stays valid with primitive restart
+static const uint32_t MAX_UINT16_VERTICES = 0xffff;
+
+// a full mip chain down to 1x1, as far as there are descriptors for
+static uint32_t getPyramidLevelCount(VkExtent2D extent) {
+    auto levelCount = static_cast<uint32_t>(std::floor(std::log2(std::max(extent.width, extent.height)))) + 1;
+    return std::min(levelCount, MeshRenderer::MAX_PYRAMID_LEVELS);
+}
+
+void MeshRenderer::load(Application *application) {
+    app = application;
+    if (texturePixels.empty()) {
+        loadTexture();
+    }
+    if (!vertexData) {
+        loadModel();
+    }
+}
+
 void MeshRenderer::init(Application *application) {
     app = application;
+    compactVertices = app->compactVertices;
+    splitVertexStreams = app->splitVertexStreams;
+    depthPrepass = app->depthPrepass;
+    instanceCount = std::max(app->sceneInstanceCount, 1u);
+    meshletCulling = app->meshletCulling && instanceCount == 1;
+    if (app->meshletCulling && !meshletCulling) {
+        std::cout << "Meshlet culling is for the single model, drawing " << instanceCount << " instances without\n";
+    }
+    useLods = lodsEnabled();
+    if (app->meshLods && !useLods) {
+        std::cout << "Levels of detail are not for meshlet culling, drawing the full detail model\n";
+    }
+    // finer grained, the single model only has one instance to cull. Occlusion culling builds on culling instances,
+    // and one instanced draw can't give its instances levels of detail of their own, the cull shader does.
+    gpuCulling = (app->gpuCulling || app->occlusionCulling || (useLods && instanceCount > 1)) && !meshletCulling;
+    if (gpuCulling && !app->drawIndirectFirstInstanceSupported) {
+        // the indirect draws pick their instance with firstInstance
+        std::cout << "GPU culling needs drawIndirectFirstInstance, drawing every instance\n";
+        gpuCulling = false;
+    }
+    if (gpuCulling && !app->drawIndirectCountSupported && !app->multiDrawIndirectSupported) {
+        // a vkCmdDrawIndexedIndirect per submesh and instance would cost more than the culling saves
+        std::cout << "GPU culling needs drawIndirectCount or multiDrawIndirect, drawing every instance\n";
+        gpuCulling = false;
+    }
+    occlusionCulling = app->occlusionCulling && gpuCulling;
+    if (app->occlusionCulling && !occlusionCulling) {
+        std::cout << "Occlusion culling is for GPU culled instances, drawing without\n";
+    }
+    indirectDraws = meshletCulling || gpuCulling;
+    splitRenderPass = occlusionCulling;
 
     createDescriptorSetLayout();
-    createPipeline();
+    createPipelineLayout();
+    // compiles on the thread pool while the texture and the model load below
+    app->compilePipelines(getPipelineJobs());
 
+    load(app);
     createTextureImage();
     createTextureImageView();
     createTextureImageSampler();
-    loadModel();
-    createVertexBuffer();
+    prepareLods();
+    chooseIndexType();
+    createVertexBuffers();
     createIndexBuffer();
+    createInstanceBuffer();
+    if (indirectDraws) {
+        createClusterBuffer();
+    }
+    // reloading from the mesh cache is cheap, no need to hold on to the model until the next init
+    releaseModelData();
+
+    createFrameResources();
+}
 
+void MeshRenderer::createFrameResources() {
     createUniformBuffers();
     createDescriptorSets();
+    if (indirectDraws) {
+        createCullResources();
+    }
+}
+
+void MeshRenderer::cleanupFrameResources() {
+    vkFreeDescriptorSets(app->device, app->descriptorPool, static_cast<uint32_t>(descriptorSets.size()),
+                         descriptorSets.data());
+    descriptorSets.clear();
+
+    for (int i = 0; i < uniformBuffers.size(); ++i) {
+        vkDestroyBuffer(app->device, uniformBuffers[i], nullptr);
+        app->allocator.free(uniformBufferMemories[i]);
+    }
+    uniformBuffers.clear();
+    uniformBufferMemories.clear();
+    uniformBufferMemoriesMapped.clear();
+
+    cleanupCullResources();
 }
 
 const DescriptorPoolRequirement MeshRenderer::getDescriptorPoolRequirement() {
-    std::vector<VkDescriptorPoolSize> descriptorPoolSizes{2};
+    // the pool is created before the renderers, room for the culling sets whether culling ends up on or not
+    std::vector<VkDescriptorPoolSize> descriptorPoolSizes{4};
+    // a depth pyramid's sets, twice: the one of the old swapchain is freed once the frames using it are done
+    const uint32_t pyramidSets = (MAX_PYRAMID_LEVELS + 1) * 2;
 
     descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptorPoolSizes[0].descriptorCount = static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT);
+    descriptorPoolSizes[0].descriptorCount = static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT) * 2;
     descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    descriptorPoolSizes[1].descriptorCount = static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT);
-
-    return {descriptorPoolSizes, static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT)};
+    descriptorPoolSizes[1].descriptorCount = static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT) + pyramidSets;
+    descriptorPoolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    // the instances, then the clusters, the draw commands, their count, the instances again and the visibility for
+    // culling
+    descriptorPoolSizes[2].descriptorCount = static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT) * 6;
+    descriptorPoolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    descriptorPoolSizes[3].descriptorCount = MAX_PYRAMID_LEVELS * 2;
+
+    return {descriptorPoolSizes, static_cast<uint32_t>(app->MAX_FRAMES_IN_FLIGHT) * 2 + pyramidSets};
 }
 
 void MeshRenderer::createDescriptorSetLayout() {
@@ -54,7 +157,14 @@ void MeshRenderer::createDescriptorSetLayout() {
     samplerLayoutBinding.descriptorCount = 1;
     samplerLayoutBinding.pImmutableSamplers = nullptr;
 
-    std::array<VkDescriptorSetLayoutBinding, 2> bindings = {uniformLayoutBinding, samplerLayoutBinding};
+    VkDescriptorSetLayoutBinding instanceLayoutBinding{};
+    instanceLayoutBinding.binding = 2;
+    instanceLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    instanceLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    instanceLayoutBinding.descriptorCount = 1;
+
+    std::array<VkDescriptorSetLayoutBinding, 3> bindings = {uniformLayoutBinding, samplerLayoutBinding,
+                                                            instanceLayoutBinding};
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo{};
     descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     descriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(bindings.size());
@@ -64,12 +174,215 @@ void MeshRenderer::createDescriptorSetLayout() {
         VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor set layout!");
     }
+
+    if (!indirectDraws) {
+        return;
+    }
+    // CullUniforms, the clusters, the draw commands, their count, the instance transforms and with
+    // occlusionCulling the visibility
+    std::array<VkDescriptorSetLayoutBinding, 6> cullBindings{};
+    uint32_t cullBindingCount = occlusionCulling ? 6 : 5;
+    for (uint32_t i = 0; i < cullBindingCount; ++i) {
+        cullBindings[i].binding = i;
+        cullBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        cullBindings[i].descriptorCount = 1;
+        cullBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo cullSetLayoutCreateInfo{};
+    cullSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    cullSetLayoutCreateInfo.bindingCount = cullBindingCount;
+    cullSetLayoutCreateInfo.pBindings = cullBindings.data();
+
+    if (vkCreateDescriptorSetLayout(app->device, &cullSetLayoutCreateInfo, nullptr, &cullDescriptorSetLayout) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create cull descriptor set layout!");
+    }
+
+    if (!occlusionCulling) {
+        return;
+    }
+    // the level above (or the depth buffer) and the level depth_pyramid.comp writes, only the first for culling
+    std::array<VkDescriptorSetLayoutBinding, 2> pyramidBindings{};
+    for (uint32_t i = 0; i < pyramidBindings.size(); ++i) {
+        pyramidBindings[i].binding = i;
+        pyramidBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                                                   : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        pyramidBindings[i].descriptorCount = 1;
+        pyramidBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo pyramidSetLayoutCreateInfo{};
+    pyramidSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    pyramidSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(pyramidBindings.size());
+    pyramidSetLayoutCreateInfo.pBindings = pyramidBindings.data();
+
+    if (vkCreateDescriptorSetLayout(app->device, &pyramidSetLayoutCreateInfo, nullptr, &pyramidBuildSetLayout) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create depth pyramid descriptor set layout!");
+    }
+
+    pyramidSetLayoutCreateInfo.bindingCount = 1;
+    if (vkCreateDescriptorSetLayout(app->device, &pyramidSetLayoutCreateInfo, nullptr, &pyramidSetLayout) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create depth pyramid descriptor set layout!");
+    }
+}
+
+void MeshRenderer::createPipelineLayout() {
+    VkPipelineLayoutCreateInfo layoutCreateInfo{};
+    layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutCreateInfo.setLayoutCount = 1;
+    layoutCreateInfo.pSetLayouts = &descriptorSetLayout;
+    layoutCreateInfo.pushConstantRangeCount = 0;
+    layoutCreateInfo.pPushConstantRanges = nullptr;
+
+    if (vkCreatePipelineLayout(app->device, &layoutCreateInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline layout!");
+    }
+
+    if (!indirectDraws) {
+        return;
+    }
+    // occlusion_cull.comp's depth pyramid in set 1
+    std::array<VkDescriptorSetLayout, 2> cullSetLayouts{cullDescriptorSetLayout, pyramidSetLayout};
+    VkPipelineLayoutCreateInfo cullLayoutCreateInfo{};
+    cullLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    cullLayoutCreateInfo.setLayoutCount = occlusionCulling ? 2 : 1;
+    cullLayoutCreateInfo.pSetLayouts = cullSetLayouts.data();
+
+    if (vkCreatePipelineLayout(app->device, &cullLayoutCreateInfo, nullptr, &cullPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create cull pipeline layout!");
+    }
+
+    if (!occlusionCulling) {
+        return;
+    }
+    VkPipelineLayoutCreateInfo pyramidLayoutCreateInfo{};
+    pyramidLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pyramidLayoutCreateInfo.setLayoutCount = 1;
+    pyramidLayoutCreateInfo.pSetLayouts = &pyramidBuildSetLayout;
+
+    if (vkCreatePipelineLayout(app->device, &pyramidLayoutCreateInfo, nullptr, &pyramidPipelineLayout) !=
+        VK_SUCCESS) {
+        throw std::runtime_error("failed to create depth pyramid pipeline layout!");
+    }
+}
+
+std::vector<std::function<void()>> MeshRenderer::getPipelineJobs() {
+    std::vector<std::function<void()>> jobs{[this] { createGraphicsPipeline(false); }};
+    if (depthPrepass) {
+        jobs.emplace_back([this] { createGraphicsPipeline(true); });
+    }
+    if (indirectDraws) {
+        jobs.emplace_back([this] { createCullPipeline(false); });
+    }
+    if (occlusionCulling) {
+        jobs.emplace_back([this] { createCullPipeline(true); });
+        jobs.emplace_back([this] {
+            createComputePipeline("./shaders/depth_pyramid.comp.spv", pyramidPipelineLayout, nullptr,
+                                  pyramidPipeline);
+        });
+        if (app->msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+            jobs.emplace_back([this] {
+                createComputePipeline("./shaders/depth_pyramid_ms.comp.spv", pyramidPipelineLayout, nullptr,
+                                      pyramidMsPipeline);
+            });
+        }
+    }
+    return jobs;
+}
+
+void MeshRenderer::createCullPipeline(bool late) {
+    if (!occlusionCulling) {
+        createComputePipeline(meshletCulling ? "./shaders/meshlet_cull.comp.spv" : "./shaders/instance_cull.comp.spv",
+                              cullPipelineLayout, nullptr, cullPipeline);
+        return;
+    }
+
+    // occlusion_cull.comp's LATE
+    VkBool32 lateValue = late ? VK_TRUE : VK_FALSE;
+    VkSpecializationMapEntry lateEntry{0, 0, sizeof(lateValue)};
+    VkSpecializationInfo specializationInfo{1, &lateEntry, sizeof(lateValue), &lateValue};
+    createComputePipeline("./shaders/occlusion_cull.comp.spv", cullPipelineLayout, &specializationInfo,
+                          late ? lateCullPipeline : cullPipeline);
+}
+
+void MeshRenderer::createComputePipeline(const std::string &path, VkPipelineLayout layout,
+                                         const VkSpecializationInfo *specializationInfo, VkPipeline &pipeline) {
+    auto computeShaderCode = readFile(path);
+
+    VkShaderModule computeShaderModule = app->createShaderModule(computeShaderCode);
+
+    VkPipelineShaderStageCreateInfo computeStageCreateInfo{};
+    computeStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    computeStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    computeStageCreateInfo.module = computeShaderModule;
+    computeStageCreateInfo.pName = "main";
+    computeStageCreateInfo.pSpecializationInfo = specializationInfo;
+
+    VkComputePipelineCreateInfo computePipelineCreateInfo{};
+    computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    computePipelineCreateInfo.stage = computeStageCreateInfo;
+    computePipelineCreateInfo.layout = layout;
+    computePipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
+    computePipelineCreateInfo.basePipelineIndex = -1;
+
+    if (vkCreateComputePipelines(app->device, app->pipelineCache.get(), 1, &computePipelineCreateInfo,
+                                 nullptr, &pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create compute pipeline " + path + "!");
+    }
+
+    vkDestroyShaderModule(app->device, computeShaderModule, nullptr);
 }
 
-void MeshRenderer::createPipeline() {
+MeshRenderer::VertexInput MeshRenderer::getVertexInput(bool positionOnly) const {
+    VertexInput input;
+    auto addBinding = [&](uint32_t stride, VkVertexInputRate inputRate) {
+        input.bindings.push_back({static_cast<uint32_t>(input.bindings.size()), stride, inputRate});
+    };
+    // to the binding added last
+    auto addAttribute = [&](uint32_t location, VkFormat format, uint32_t offset) {
+        input.attributes.push_back({location, static_cast<uint32_t>(input.bindings.size() - 1), format, offset});
+    };
+
+    VkFormat positionFormat = compactVertices ? VK_FORMAT_R16G16B16A16_UNORM : VK_FORMAT_R32G32B32_SFLOAT;
+    if (splitVertexStreams) {
+        addBinding(compactVertices ? sizeof(uint64_t) : sizeof(glm::vec3), VK_VERTEX_INPUT_RATE_VERTEX);
+        addAttribute(0, positionFormat, 0);
+        if (!positionOnly && compactVertices) {
+            addBinding(sizeof(uint32_t), VK_VERTEX_INPUT_RATE_VERTEX);
+            addAttribute(2, VK_FORMAT_R16G16_SFLOAT, 0);
+        } else if (!positionOnly) {
+            addBinding(sizeof(VertexAttributes), VK_VERTEX_INPUT_RATE_VERTEX);
+            addAttribute(1, VK_FORMAT_R32G32B32_SFLOAT, offsetof(VertexAttributes, color));
+            addAttribute(2, VK_FORMAT_R32G32_SFLOAT, offsetof(VertexAttributes, uv));
+        }
+    } else if (compactVertices) {
+        addBinding(sizeof(CompactVertex), VK_VERTEX_INPUT_RATE_VERTEX);
+        addAttribute(0, positionFormat, offsetof(CompactVertex, position));
+        if (!positionOnly) {
+            addAttribute(2, VK_FORMAT_R16G16_SFLOAT, offsetof(CompactVertex, uv));
+        }
+    } else {
+        auto attributes = Vertex::getAttributeDescriptions();
+        input.bindings.push_back(Vertex::getBindingDescription());
+        input.attributes.assign(attributes.begin(), positionOnly ? attributes.begin() + 1 : attributes.end());
+    }
+
+    if (compactVertices && !positionOnly) {
+        // one color per instance, the same for all of them, see createVertexBuffers
+        addBinding(sizeof(uint32_t), app->compactVertexColors ? VK_VERTEX_INPUT_RATE_VERTEX
+                                                              : VK_VERTEX_INPUT_RATE_INSTANCE);
+        addAttribute(1, VK_FORMAT_R8G8B8A8_UNORM, 0);
+    }
+    return input;
+}
+
+void MeshRenderer::createGraphicsPipeline(bool depthOnly) {
     // The Vulkan SDK includes libshaderc, which is a library to compile GLSL code to SPIR-V from within your program.
     // https://github.com/google/shaderc
-    auto vertShaderCode = readFile("./shaders/shader.vert.spv");
+    auto vertShaderCode = readFile(depthOnly ? "./shaders/depth.vert.spv" : "./shaders/shader.vert.spv");
     auto fragShaderCode = readFile("./shaders/shader.frag.spv");
 
     VkShaderModule vertShaderModule = app->createShaderModule(vertShaderCode);
@@ -95,15 +408,15 @@ void MeshRenderer::createPipeline() {
 
     VkPipelineShaderStageCreateInfo shaderStageCreateInfos[] = {vertStageCreateInfo, fragStageCreateInfo};
 
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    // the depth pass reads positions only, so it fetches just the first stream
+    VertexInput vertexInput = getVertexInput(depthOnly);
 
     VkPipelineVertexInputStateCreateInfo vertexInputStateCreateInfo{};
     vertexInputStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputStateCreateInfo.vertexBindingDescriptionCount = 1;
-    vertexInputStateCreateInfo.pVertexBindingDescriptions = &bindingDescription;
-    vertexInputStateCreateInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-    vertexInputStateCreateInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+    vertexInputStateCreateInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(vertexInput.bindings.size());
+    vertexInputStateCreateInfo.pVertexBindingDescriptions = vertexInput.bindings.data();
+    vertexInputStateCreateInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertexInput.attributes.size());
+    vertexInputStateCreateInfo.pVertexAttributeDescriptions = vertexInput.attributes.data();
 
     VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateCreateInfo{};
     inputAssemblyStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -176,6 +489,9 @@ void MeshRenderer::createPipeline() {
     colorBlendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
     colorBlendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
     colorBlendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
+    if (depthOnly) {
+        colorBlendAttachmentState.colorWriteMask = 0;
+    }
 
     VkPipelineColorBlendStateCreateInfo colorBlendStateCreateInfo{};
     colorBlendStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
@@ -201,21 +517,16 @@ void MeshRenderer::createPipeline() {
     depthStencilStateCreateInfo.depthBoundsTestEnable = VK_FALSE;
     depthStencilStateCreateInfo.minDepthBounds = 0.0;
     depthStencilStateCreateInfo.maxDepthBounds = 1.0;
-
-    VkPipelineLayoutCreateInfo layoutCreateInfo{};
-    layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    layoutCreateInfo.setLayoutCount = 1;
-    layoutCreateInfo.pSetLayouts = &descriptorSetLayout;
-    layoutCreateInfo.pushConstantRangeCount = 0;
-    layoutCreateInfo.pPushConstantRanges = nullptr;
-
-    if (vkCreatePipelineLayout(app->device, &layoutCreateInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create pipeline layout!");
+    if (depthPrepass && !depthOnly) {
+        // only the fragments that won the prepass get shaded
+        depthStencilStateCreateInfo.depthWriteEnable = VK_FALSE;
+        depthStencilStateCreateInfo.depthCompareOp = VK_COMPARE_OP_EQUAL;
     }
 
     VkGraphicsPipelineCreateInfo graphicsPipelineCreateInfo{};
     graphicsPipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    graphicsPipelineCreateInfo.stageCount = 2;
+    // no fragment shader for depth only
+    graphicsPipelineCreateInfo.stageCount = depthOnly ? 1 : 2;
     graphicsPipelineCreateInfo.pStages = shaderStageCreateInfos;
     graphicsPipelineCreateInfo.pVertexInputState = &vertexInputStateCreateInfo;
     graphicsPipelineCreateInfo.pInputAssemblyState = &inputAssemblyStateCreateInfo;
@@ -233,8 +544,8 @@ void MeshRenderer::createPipeline() {
     graphicsPipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
     graphicsPipelineCreateInfo.basePipelineIndex = -1;
 
-    if (vkCreateGraphicsPipelines(app->device, VK_NULL_HANDLE, 1, &graphicsPipelineCreateInfo, nullptr,
-                                  &graphicsPipeline) != VK_SUCCESS) {
+    if (vkCreateGraphicsPipelines(app->device, app->pipelineCache.get(), 1, &graphicsPipelineCreateInfo, nullptr,
+                                  depthOnly ? &depthPipeline : &graphicsPipeline) != VK_SUCCESS) {
         throw std::runtime_error("failed to create graphics pipeline!");
     }
 
@@ -243,24 +554,24 @@ void MeshRenderer::createPipeline() {
 }
 
 void MeshRenderer::createUniformBuffers() {
-    uniformBuffers.resize(app->MAX_FRAMES_IN_FLIGHT);
-    uniformBufferMemories.resize(app->MAX_FRAMES_IN_FLIGHT);
-    uniformBufferMemoriesMapped.resize(app->MAX_FRAMES_IN_FLIGHT);
+    uniformBuffers.resize(app->framesInFlight);
+    uniformBufferMemories.resize(app->framesInFlight);
+    uniformBufferMemoriesMapped.resize(app->framesInFlight);
 
     VkDeviceSize bufferSize = sizeof(UniformBufferObject);
 
-    for (int i = 0; i < app->MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (int i = 0; i < app->framesInFlight; ++i) {
         app->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                           uniformBuffers[i], uniformBufferMemories[i]);
 
-        vkMapMemory(app->device, uniformBufferMemories[i], 0, bufferSize, 0, &uniformBufferMemoriesMapped[i]);
+        uniformBufferMemoriesMapped[i] = uniformBufferMemories[i].mapped;
     }
 }
 
 void MeshRenderer::createDescriptorSets() {
-    descriptorSets.resize(app->MAX_FRAMES_IN_FLIGHT);
-    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(app->MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
+    descriptorSets.resize(app->framesInFlight);
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(app->framesInFlight, descriptorSetLayout);
 
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -284,7 +595,9 @@ void MeshRenderer::createDescriptorSets() {
         imageInfo.imageView = textureImageView;
         imageInfo.sampler = textureImageSampler;
 
-        std::array<VkWriteDescriptorSet, 2> writeDescriptorSets{};
+        VkDescriptorBufferInfo instanceInfo{instanceBuffer, 0, VK_WHOLE_SIZE};
+
+        std::array<VkWriteDescriptorSet, 3> writeDescriptorSets{};
 
         writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         writeDescriptorSets[0].dstSet = descriptorSets[i];
@@ -304,51 +617,299 @@ void MeshRenderer::createDescriptorSets() {
         writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         writeDescriptorSets[1].pImageInfo = &imageInfo;
 
+        writeDescriptorSets[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSets[2].dstSet = descriptorSets[i];
+        writeDescriptorSets[2].dstBinding = 2;
+        writeDescriptorSets[2].dstArrayElement = 0;
+        writeDescriptorSets[2].descriptorCount = 1;
+        writeDescriptorSets[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeDescriptorSets[2].pBufferInfo = &instanceInfo;
+
         vkUpdateDescriptorSets(app->device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
     }
 }
 
-void MeshRenderer::createTextureImage() {
-    int texWidth, texHeight, texChannels;
-    stbi_uc *pixels = stbi_load("assets/viking_room.png", &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-    mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+void MeshRenderer::createCullResources() {
+    cullUniformBuffers.resize(app->framesInFlight);
+    cullUniformBufferMemories.resize(app->framesInFlight);
+    drawCommandBuffers.resize(app->framesInFlight);
+    drawCommandBufferMemories.resize(app->framesInFlight);
+    drawCountBuffers.resize(app->framesInFlight);
+    drawCountBufferMemories.resize(app->framesInFlight);
+    cullStatsBuffers.resize(app->framesInFlight);
+    cullStatsBufferMemories.resize(app->framesInFlight);
+    cullStats = {};
+
+    VkDeviceSize commandsSize = sizeof(VkDrawIndexedIndirectCommand) * std::max(maxDrawCount, 1u) *
+                                (occlusionCulling ? 2 : 1);
+    // storage for the compute pass, transfer for the per frame clear and the stats readback
+    VkBufferUsageFlags indirectUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                       VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    for (int i = 0; i < app->framesInFlight; ++i) {
+        app->createBuffer(sizeof(CullUniforms), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          cullUniformBuffers[i], cullUniformBufferMemories[i]);
+        app->createBuffer(commandsSize, indirectUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          drawCommandBuffers[i], drawCommandBufferMemories[i]);
+        app->createBuffer(sizeof(cullStats), indirectUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          drawCountBuffers[i], drawCountBufferMemories[i]);
+        app->createBuffer(sizeof(cullStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                          cullStatsBuffers[i], cullStatsBufferMemories[i]);
+        memset(cullStatsBufferMemories[i].mapped, 0, sizeof(cullStats));
+    }
+
+    cullDescriptorSets.resize(app->framesInFlight);
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(app->framesInFlight, cullDescriptorSetLayout);
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = app->descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = static_cast<uint32_t>(descriptorSetLayouts.size());
+    descriptorSetAllocateInfo.pSetLayouts = descriptorSetLayouts.data();
+
+    if (vkAllocateDescriptorSets(app->device, &descriptorSetAllocateInfo, cullDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate cull descriptor sets!");
+    }
+
+    for (int i = 0; i < cullDescriptorSets.size(); ++i) {
+        std::array<VkDescriptorBufferInfo, 6> bufferInfos{};
+        bufferInfos[0] = {cullUniformBuffers[i], 0, sizeof(CullUniforms)};
+        bufferInfos[1] = {clusterBuffer, 0, VK_WHOLE_SIZE};
+        bufferInfos[2] = {drawCommandBuffers[i], 0, VK_WHOLE_SIZE};
+        bufferInfos[3] = {drawCountBuffers[i], 0, VK_WHOLE_SIZE};
+        bufferInfos[4] = {instanceBuffer, 0, VK_WHOLE_SIZE};
+        bufferInfos[5] = {visibilityBuffer, 0, VK_WHOLE_SIZE};
+
+        std::array<VkWriteDescriptorSet, 6> writeDescriptorSets{};
+        uint32_t bindingCount = occlusionCulling ? 6 : 5;
+        for (uint32_t binding = 0; binding < bindingCount; ++binding) {
+            writeDescriptorSets[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writeDescriptorSets[binding].dstSet = cullDescriptorSets[i];
+            writeDescriptorSets[binding].dstBinding = binding;
+            writeDescriptorSets[binding].descriptorCount = 1;
+            writeDescriptorSets[binding].descriptorType =
+                    binding == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writeDescriptorSets[binding].pBufferInfo = &bufferInfos[binding];
+        }
+
+        vkUpdateDescriptorSets(app->device, bindingCount, writeDescriptorSets.data(), 0, nullptr);
+    }
+}
+
+void MeshRenderer::cleanupCullResources() {
+    if (!cullDescriptorSets.empty()) {
+        vkFreeDescriptorSets(app->device, app->descriptorPool, static_cast<uint32_t>(cullDescriptorSets.size()),
+                             cullDescriptorSets.data());
+        cullDescriptorSets.clear();
+    }
+
+    for (int i = 0; i < cullUniformBuffers.size(); ++i) {
+        vkDestroyBuffer(app->device, cullUniformBuffers[i], nullptr);
+        app->allocator.free(cullUniformBufferMemories[i]);
+        vkDestroyBuffer(app->device, drawCommandBuffers[i], nullptr);
+        app->allocator.free(drawCommandBufferMemories[i]);
+        vkDestroyBuffer(app->device, drawCountBuffers[i], nullptr);
+        app->allocator.free(drawCountBufferMemories[i]);
+        vkDestroyBuffer(app->device, cullStatsBuffers[i], nullptr);
+        app->allocator.free(cullStatsBufferMemories[i]);
+    }
+    cullUniformBuffers.clear();
+    cullUniformBufferMemories.clear();
+    drawCommandBuffers.clear();
+    drawCommandBufferMemories.clear();
+    drawCountBuffers.clear();
+    drawCountBufferMemories.clear();
+    cullStatsBuffers.clear();
+    cullStatsBufferMemories.clear();
+}
+
+void MeshRenderer::createDepthPyramid(VkCommandBuffer commandBuffer) {
+    cleanupDepthPyramid(true);
+    pyramidExtent = app->swapChainExtent;
+    pyramidGeneration = app->swapChainGeneration;
+
+    if (pyramidSampler == VK_NULL_HANDLE) {
+        // only ever read with texelFetch
+        VkSamplerCreateInfo samplerCreateInfo{};
+        samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerCreateInfo.magFilter = VK_FILTER_NEAREST;
+        samplerCreateInfo.minFilter = VK_FILTER_NEAREST;
+        samplerCreateInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerCreateInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerCreateInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerCreateInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerCreateInfo.anisotropyEnable = VK_FALSE;
+        samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
+        samplerCreateInfo.compareEnable = VK_FALSE;
+        samplerCreateInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+        samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        samplerCreateInfo.minLod = 0.0f;
+        samplerCreateInfo.maxLod = static_cast<float>(MAX_PYRAMID_LEVELS);
+
+        if (vkCreateSampler(app->device, &samplerCreateInfo, nullptr, &pyramidSampler) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create depth pyramid sampler!");
+        }
+    }
+
+    uint32_t levelCount = getPyramidLevelCount(pyramidExtent);
+    app->createImage(static_cast<int>(pyramidExtent.width), static_cast<int>(pyramidExtent.height), levelCount,
+                     VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+                     VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     pyramidImage, pyramidImageMemory);
+    app->createImageView(pyramidImage, VK_FORMAT_R32_SFLOAT, pyramidImageView, VK_IMAGE_ASPECT_COLOR_BIT,
+                         levelCount);
+
+    pyramidLevelViews.resize(levelCount);
+    for (uint32_t level = 0; level < levelCount; ++level) {
+        VkImageViewCreateInfo viewCreateInfo{};
+        viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewCreateInfo.image = pyramidImage;
+        viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+        viewCreateInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1};
+
+        if (vkCreateImageView(app->device, &viewCreateInfo, nullptr, &pyramidLevelViews[level]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create depth pyramid level view!");
+        }
+    }
+
+    // GENERAL for good, depth_pyramid.comp writes the levels occlusion_cull.comp and the next level read
+    VkImageMemoryBarrier layoutBarrier{};
+    layoutBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    layoutBarrier.srcAccessMask = 0;
+    layoutBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    layoutBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    layoutBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    layoutBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    layoutBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    layoutBarrier.image = pyramidImage;
+    layoutBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, 0, 1};
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &layoutBarrier);
+
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(levelCount, pyramidBuildSetLayout);
+    descriptorSetLayouts.push_back(pyramidSetLayout);
+    std::vector<VkDescriptorSet> sets(descriptorSetLayouts.size());
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = app->descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = static_cast<uint32_t>(descriptorSetLayouts.size());
+    descriptorSetAllocateInfo.pSetLayouts = descriptorSetLayouts.data();
+
+    if (vkAllocateDescriptorSets(app->device, &descriptorSetAllocateInfo, sets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate depth pyramid descriptor sets!");
+    }
+    pyramidSet = sets.back();
+    sets.pop_back();
+    pyramidBuildSets = sets;
+
+    std::vector<VkDescriptorImageInfo> imageInfos;
+    imageInfos.reserve(levelCount * 2 + 1);
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+    auto addWrite = [&](VkDescriptorSet set, uint32_t binding, VkDescriptorType type, VkDescriptorImageInfo info) {
+        imageInfos.push_back(info);
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = set;
+        write.dstBinding = binding;
+        write.descriptorCount = 1;
+        write.descriptorType = type;
+        write.pImageInfo = &imageInfos.back();
+        writeDescriptorSets.push_back(write);
+    };
+    // level 0 from the depth buffer as the early render pass left it
+    for (uint32_t level = 0; level < levelCount; ++level) {
+        addWrite(pyramidBuildSets[level], 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                 level == 0 ? VkDescriptorImageInfo{pyramidSampler, app->depthImageView,
+                                                    VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL}
+                            : VkDescriptorImageInfo{pyramidSampler, pyramidLevelViews[level - 1],
+                                                    VK_IMAGE_LAYOUT_GENERAL});
+        addWrite(pyramidBuildSets[level], 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                 {VK_NULL_HANDLE, pyramidLevelViews[level], VK_IMAGE_LAYOUT_GENERAL});
+    }
+    addWrite(pyramidSet, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+             {pyramidSampler, pyramidImageView, VK_IMAGE_LAYOUT_GENERAL});
+
+    vkUpdateDescriptorSets(app->device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(),
+                           0, nullptr);
+}
+
+void MeshRenderer::cleanupDepthPyramid(bool deferred) {
+    if (pyramidImage == VK_NULL_HANDLE) {
+        return;
+    }
+
+    std::vector<VkDescriptorSet> sets = pyramidBuildSets;
+    sets.push_back(pyramidSet);
+    auto release = [app = app, image = pyramidImage, memory = pyramidImageMemory, view = pyramidImageView,
+                    levelViews = pyramidLevelViews, sets]() mutable {
+        vkFreeDescriptorSets(app->device, app->descriptorPool, static_cast<uint32_t>(sets.size()), sets.data());
+        for (VkImageView levelView: levelViews) {
+            vkDestroyImageView(app->device, levelView, nullptr);
+        }
+        vkDestroyImageView(app->device, view, nullptr);
+        vkDestroyImage(app->device, image, nullptr);
+        app->allocator.free(memory);
+    };
+    if (deferred) {
+        app->releaseAfterFrame(release);
+    } else {
+        release();
+    }
+
+    pyramidImage = VK_NULL_HANDLE;
+    pyramidLevelViews.clear();
+    pyramidBuildSets.clear();
+    pyramidSet = VK_NULL_HANDLE;
+}
+
+void MeshRenderer::loadTexture() {
+    int texChannels;
+    stbi_uc *pixels = stbi_load("assets/viking_room.png", &textureWidth, &textureHeight, &texChannels,
+                                STBI_rgb_alpha);
 
     if (!pixels) {
         throw std::runtime_error("failed to load texture image!");
     }
 
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
+    texturePixels.assign(pixels, pixels + textureWidth * textureHeight * 4);
+    stbi_image_free(pixels);
+}
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    app->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      stagingBuffer, stagingBufferMemory);
+void MeshRenderer::createTextureImage() {
+    int texWidth = textureWidth;
+    int texHeight = textureHeight;
+    mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
 
-    void *data;
-    vkMapMemory(app->device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, imageSize);
-    vkUnmapMemory(app->device, stagingBufferMemory);
+    VkDeviceSize imageSize = texturePixels.size();
 
-    stbi_image_free(pixels);
+    StagingAllocation staging = app->allocateStaging(imageSize);
+    memcpy(staging.data, texturePixels.data(), imageSize);
+
+    texturePixels.clear();
+    texturePixels.shrink_to_fit();
 
     app->createImage(texWidth, texHeight, mipLevels, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB,
                      VK_IMAGE_TILING_OPTIMAL,
                      VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
 
-    app->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
+    VkCommandBuffer commandBuffer = app->beginUpload();
+    app->transitionImageLayout(commandBuffer, textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
-    app->copyBufferToImage(stagingBuffer, textureImage, texWidth, texHeight);
+    app->copyBufferToImage(commandBuffer, staging.buffer, staging.offset, textureImage, texWidth, texHeight);
     if (mipLevels > 1) {
-        app->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, mipLevels);
+        // blits need the graphics queue
+        app->transferOwnership(textureImage, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        app->generateMipmaps(app->beginUploadGraphics(), textureImage, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight,
+                             mipLevels);
     } else {
-        app->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1);
+        app->transferOwnership(textureImage, VK_IMAGE_ASPECT_COLOR_BIT, 1,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
     }
-
-    vkDestroyBuffer(app->device, stagingBuffer, nullptr);
-    vkFreeMemory(app->device, stagingBufferMemory, nullptr);
 }
 
 void MeshRenderer::createTextureImageView() {
@@ -384,94 +945,392 @@ void MeshRenderer::createTextureImageSampler() {
 }
 
 void MeshRenderer::loadModel() {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string err;
-
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, "assets/viking_room.obj", nullptr, true)) {
-        throw std::runtime_error(err);
-    }
-
-    std::unordered_map<Vertex, uint32_t> uniqueVertices{};
-
-    for (const auto &shape: shapes) {
-        for (const auto &index: shape.mesh.indices) {
-            Vertex vertex{};
-
-            vertex.position = {
-                    attrib.vertices[3 * index.vertex_index + 0],
-                    attrib.vertices[3 * index.vertex_index + 1],
-                    attrib.vertices[3 * index.vertex_index + 2],
-            };
-            vertex.uv = {
-                    attrib.texcoords[2 * index.texcoord_index + 0],
-                    1.0 - attrib.texcoords[2 * index.texcoord_index + 1],
-            };
-            vertex.color = {1.0, 1.0, 1.0};
-
-            if (uniqueVertices.count(vertex) == 0) {
-                uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-                vertices.push_back(vertex);
-            }
-
-            indices.push_back(uniqueVertices[vertex]);
+    uint32_t contentFlags = (app->optimizeMeshes ? MESH_OPTIMIZED : 0) | (lodsEnabled() ? MESH_LODS : 0);
+    if (meshCache.open(MODEL_CACHE_PATH, MODEL_PATH, contentFlags)) {
+        vertexData = meshCache.getVertices();
+        vertexCount = meshCache.getVertexCount();
+        indexData = meshCache.getIndices();
+        indexCount = meshCache.getIndexCount();
+        lods.clear();
+        for (uint32_t lod = 0; lod < meshCache.getLodCount(); ++lod) {
+            lods.push_back(meshCache.getLod(lod));
         }
+        std::cout << "Vertex count: " << vertexCount << " (cached)\n";
+        return;
     }
 
-    std::cout << "Vertex count: " << vertices.size() << "\n";
+    parseModel();
+    if (app->optimizeMeshes) {
+        optimizeModel();
+    }
+    // after optimizeModel, the coarser levels index the vertices in their final order
+    lods = MeshSimplifier::buildLods(vertices, indices, lodsEnabled() ? MeshCache::MAX_LODS : 1);
+    // failing to write (e.g. a read only assets directory) only means parsing again next time
+    MeshCache::write(MODEL_CACHE_PATH, MODEL_PATH, contentFlags, vertices, indices, lods);
+
+    vertexData = vertices.data();
+    vertexCount = static_cast<uint32_t>(vertices.size());
+    indexData = indices.data();
+    indexCount = static_cast<uint32_t>(indices.size());
+    std::cout << "Vertex count: " << vertexCount << "\n";
 }
 
-void MeshRenderer::createVertexBuffer() {
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
+void MeshRenderer::releaseModelData() {
+    meshCache.close();
+    vertices.clear();
+    vertices.shrink_to_fit();
+    indices.clear();
+    indices.shrink_to_fit();
+    vertexData = nullptr;
+    indexData = nullptr;
+}
+
+void MeshRenderer::parseModel() {
+    // load() may run on a pool thread, parallelFor lets it take part in the work instead of waiting on it
+    ObjLoader::load(MODEL_PATH, &app->threadPool, vertices, indices);
+}
 
-    VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-    app->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      stagingBuffer, stagingBufferMemory);
+void MeshRenderer::optimizeModel() {
+    auto weldedCount = static_cast<uint32_t>(vertices.size());
+    VertexCacheStats before = MeshOptimizer::analyzeVertexCache(indices, weldedCount);
+
+    MeshOptimizer::optimizeVertexCache(indices, weldedCount);
+    float cacheAcmr = MeshOptimizer::analyzeVertexCache(indices, weldedCount).acmr;
+    MeshOptimizer::optimizeOverdraw(indices, vertices);
+    float overdrawAcmr = MeshOptimizer::analyzeVertexCache(indices, weldedCount).acmr;
+    MeshOptimizer::optimizeVertexFetch(vertices, indices);
+
+    // optimizeVertexFetch drops the vertices no triangle uses, both ATVRs count per vertex that is left
+    VertexCacheStats after = MeshOptimizer::analyzeVertexCache(indices, static_cast<uint32_t>(vertices.size()));
+    float beforeAtvr = before.atvr * static_cast<float>(weldedCount) /
+                       static_cast<float>(std::max<size_t>(vertices.size(), 1));
+    std::cout << "Mesh optimization: ACMR " << before.acmr << " -> " << cacheAcmr << " (vertex cache) -> "
+              << overdrawAcmr << " (overdraw), ATVR " << beforeAtvr << " -> " << after.atvr << "\n";
+}
 
+bool MeshRenderer::lodsEnabled() const {
+    return app->meshLods && !(app->meshletCulling && std::max(app->sceneInstanceCount, 1u) == 1);
+}
+
+void MeshRenderer::prepareLods() {
+    if (!useLods && lods.size() > 1) {
+        // the coarser levels follow the full detail one, leaving them out of the upload is enough
+        lods.resize(1);
+    }
+    indexCount = lods.back().firstIndex + lods.back().indexCount;
+
+    meshSphere = glm::vec4(0.0f);
+    if (lods[0].indexCount > 0) {
+        Meshlet bounds = MeshletBuilder::computeBounds(vertexData, indexData, 0, lods[0].indexCount);
+        meshSphere = glm::vec4(bounds.center, bounds.radius);
+    }
+    if (lods.size() > 1) {
+        std::cout << "Levels of detail:";
+        for (const MeshLod &lod: lods) {
+            std::cout << " " << lod.indexCount / 3 << " triangles (error " << lod.error << ")";
+        }
+        std::cout << "\n";
+    }
+}
+
+uint32_t MeshRenderer::selectLod(const glm::mat4 &model, const glm::vec3 &cameraPosition, float lodScale) const {
+    glm::vec3 center(model * glm::vec4(glm::vec3(meshSphere), 1.0f));
+    float scale = std::max(glm::length(glm::vec3(model[0])),
+                           std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    float distance = std::max(glm::length(center - cameraPosition) - meshSphere.w * scale, 0.0f);
+    uint32_t lod = 0;
+    for (uint32_t i = 1; i < lodRanges.size(); ++i) {
+        lod = lodRanges[i].error * scale * lodScale <= distance ? i : lod;
+    }
+    return lod;
+}
+
+void MeshRenderer::createVertexStream(VkDeviceSize size, const std::function<void(void *)> &fill) {
+    StagingAllocation staging = app->allocateStaging(size);
     // The transfer of data to the GPU is an operation that happens in the background and the specification
     // simply tells us that it is guaranteed to be complete as of the next call to vkQueueSubmit.
     // https://registry.khronos.org/vulkan/specs/1.3-extensions/html/chap7.html#synchronization-submission-host-writes
-    void *data;
-    vkMapMemory(app->device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, vertices.data(), (size_t) bufferSize);
+    fill(staging.data);
 //        vkFlushMappedMemoryRanges vkInvalidateMappedMemoryRanges
-    vkUnmapMemory(app->device, stagingBufferMemory);
 
-    app->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    VkBuffer buffer;
+    MemoryAllocation memory;
+    app->createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                      vertexBuffer, vertexBufferMemory);
+                      buffer, memory);
+
+    app->copyBuffer(app->beginUpload(), staging.buffer, staging.offset, buffer, size);
+    app->transferOwnership(buffer);
+    vertexStreams.push_back(buffer);
+    vertexStreamMemories.push_back(memory);
+    vertexStreamBytes += size;
+}
+
+void MeshRenderer::createVertexBuffers() {
+    vertexStreamBytes = 0;
+    positionScale = glm::vec4(1.0f);
+    positionOffset = glm::vec4(0.0f);
+    glm::vec3 boundsMin{0.0f};
+    glm::vec3 extent{1.0f};
+    if (compactVertices && vertexCount > 0) {
+        boundsMin = vertexData[0].position;
+        glm::vec3 boundsMax = boundsMin;
+        for (uint32_t i = 1; i < vertexCount; ++i) {
+            boundsMin = glm::min(boundsMin, vertexData[i].position);
+            boundsMax = glm::max(boundsMax, vertexData[i].position);
+        }
+        extent = boundsMax - boundsMin;
+        // a flat mesh still has to divide by something
+        extent = glm::vec3(extent.x > 0 ? extent.x : 1.0f, extent.y > 0 ? extent.y : 1.0f,
+                           extent.z > 0 ? extent.z : 1.0f);
+        positionScale = glm::vec4(extent, 0.0f);
+        positionOffset = glm::vec4(boundsMin, 0.0f);
+    }
+    auto encodePosition = [&](const glm::vec3 &position) {
+        return glm::packUnorm4x16(glm::vec4((position - boundsMin) / extent, 0.0f));
+    };
 
-    app->copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
+    // streams in binding order, see getVertexInput
+    if (!compactVertices && !splitVertexStreams) {
+        createVertexStream(sizeof(Vertex) * vertexCount, [&](void *data) {
+            memcpy(data, vertexData, sizeof(Vertex) * vertexCount);
+        });
+    } else if (!compactVertices) {
+        createVertexStream(sizeof(glm::vec3) * vertexCount, [&](void *data) {
+            auto *positions = static_cast<glm::vec3 *>(data);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                positions[i] = vertexData[i].position;
+            }
+        });
+        createVertexStream(sizeof(VertexAttributes) * vertexCount, [&](void *data) {
+            auto *attributes = static_cast<VertexAttributes *>(data);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                attributes[i] = {vertexData[i].color, vertexData[i].uv};
+            }
+        });
+    } else if (!splitVertexStreams) {
+        createVertexStream(sizeof(CompactVertex) * vertexCount, [&](void *data) {
+            auto *compact = static_cast<CompactVertex *>(data);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                uint64_t position = encodePosition(vertexData[i].position);
+                uint32_t uv = glm::packHalf2x16(vertexData[i].uv);
+                memcpy(compact[i].position, &position, sizeof(position));
+                memcpy(compact[i].uv, &uv, sizeof(uv));
+            }
+        });
+    } else {
+        createVertexStream(sizeof(uint64_t) * vertexCount, [&](void *data) {
+            auto *positions = static_cast<uint64_t *>(data);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                positions[i] = encodePosition(vertexData[i].position);
+            }
+        });
+        createVertexStream(sizeof(uint32_t) * vertexCount, [&](void *data) {
+            auto *uvs = static_cast<uint32_t *>(data);
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                uvs[i] = glm::packHalf2x16(vertexData[i].uv);
+            }
+        });
+    }
+
+    if (compactVertices) {
+        // without a color stream every instance gets the first vertex's, loadModel makes them all white anyway
+        uint32_t colorCount = app->compactVertexColors ? vertexCount : instanceCount;
+        createVertexStream(sizeof(uint32_t) * colorCount, [&](void *data) {
+            auto *colors = static_cast<uint32_t *>(data);
+            for (uint32_t i = 0; i < colorCount; ++i) {
+                const Vertex *vertex = app->compactVertexColors ? &vertexData[i] : vertexData;
+                colors[i] = vertexCount > 0 ? glm::packUnorm4x8(glm::vec4(vertex->color, 1.0f)) : UINT32_MAX;
+            }
+        });
+    }
 
-    vkDestroyBuffer(app->device, stagingBuffer, nullptr);
-    vkFreeMemory(app->device, stagingBufferMemory, nullptr);
+    if (compactVertices || splitVertexStreams) {
+        std::cout << "Vertex streams: " << vertexStreams.size() << ", " << vertexStreamBytes << " bytes instead of "
+                  << sizeof(Vertex) * vertexCount << "\n";
+    }
 }
 
-void MeshRenderer::createIndexBuffer() {
-    VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+void MeshRenderer::createInstanceBuffer() {
+    std::vector<glm::mat4> transforms(instanceCount, glm::mat4(1.0f));
+    sceneRadius = 0;
+    if (instanceCount > 1) {
+        // the model is Z up, stand it on the XZ plane like the single one
+        glm::mat4 upright = glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+        auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(instanceCount))));
+        float center = (side - 1) * INSTANCE_SPACING * 0.5f;
+        std::mt19937 randomEngine(app->randomSeed);
+        std::uniform_real_distribution<float> randomAngle(0.0f, glm::radians(360.0f));
+
+        for (uint32_t i = 0; i < instanceCount; ++i) {
+            glm::vec3 position(i % side * INSTANCE_SPACING - center, 0.0f, i / side * INSTANCE_SPACING - center);
+            transforms[i] = glm::translate(glm::mat4(1.0f), position) *
+                            glm::rotate(glm::mat4(1.0f), randomAngle(randomEngine), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                            upright;
+            sceneRadius = std::max(sceneRadius, glm::length(position));
+        }
+    }
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    app->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      stagingBuffer, stagingBufferMemory);
+    VkDeviceSize bufferSize = sizeof(glm::mat4) * instanceCount;
+    StagingAllocation staging = app->allocateStaging(bufferSize);
+    memcpy(staging.data, transforms.data(), bufferSize);
 
-    void *data;
-    vkMapMemory(app->device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices.data(), bufferSize);
-    vkUnmapMemory(app->device, stagingBufferMemory);
+    app->createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      instanceBuffer, instanceBufferMemory);
+
+    app->copyBuffer(app->beginUpload(), staging.buffer, staging.offset, instanceBuffer, bufferSize);
+    app->transferOwnership(instanceBuffer);
+}
+
+void MeshRenderer::createClusterBuffer() {
+    std::vector<Meshlet> clusters;
+    for (uint32_t lod = 0; lod < lodRanges.size(); ++lod) {
+        const LodRange &range = lodRanges[lod];
+        for (uint32_t i = range.firstSubmesh; i < range.firstSubmesh + range.submeshCount; ++i) {
+            const Submesh &submesh = submeshes[i];
+            if (meshletCulling) {
+                MeshletBuilder::build(vertexData + submesh.vertexOffset, indexData, submesh.firstIndex,
+                                      submesh.indexCount, submesh.vertexOffset, clusters);
+            } else {
+                clusters.push_back(MeshletBuilder::computeBounds(vertexData + submesh.vertexOffset, indexData,
+                                                                 submesh.firstIndex, submesh.indexCount));
+                clusters.back().vertexOffset = submesh.vertexOffset;
+                clusters.back().lod = lod;
+            }
+        }
+    }
+    if (compactVertices) {
+        // the bounds are of the float positions, the decoded ones are up to half a unorm16 step away
+        float quantizationError = glm::length(glm::vec3(positionScale)) / 65535.0f;
+        for (Meshlet &cluster: clusters) {
+            cluster.radius += quantizationError;
+        }
+    }
+    clusterCount = static_cast<uint32_t>(clusters.size());
+    maxDrawCount = clusterCount * (meshletCulling ? 1 : instanceCount);
+    if (meshletCulling) {
+        std::cout << "Meshlets: " << clusterCount << ", " << (clusterCount > 0 ? indexCount / 3 / clusterCount : 0)
+                  << " triangles each on average\n";
+    }
+
+    VkDeviceSize bufferSize = sizeof(Meshlet) * std::max(clusterCount, 1u);
+    StagingAllocation staging = app->allocateStaging(bufferSize);
+    memcpy(staging.data, clusters.data(), sizeof(Meshlet) * clusterCount);
+
+    app->createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      clusterBuffer, clusterBufferMemory);
+
+    app->copyBuffer(app->beginUpload(), staging.buffer, staging.offset, clusterBuffer, bufferSize);
+    app->transferOwnership(clusterBuffer);
+
+    if (occlusionCulling) {
+        // nothing was visible before the first frame, its late pass draws whatever is in the frustum
+        app->createBuffer(sizeof(uint32_t) * std::max(maxDrawCount, 1u),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, visibilityBuffer, visibilityBufferMemory);
+        vkCmdFillBuffer(app->beginUpload(), visibilityBuffer, 0, VK_WHOLE_SIZE, 0);
+        app->transferOwnership(visibilityBuffer);
+    }
+}
+
+void MeshRenderer::chooseIndexType() {
+    submeshes.clear();
+    lodRanges.clear();
+    bool split = vertexCount > MAX_UINT16_VERTICES && app->splitSubmeshes;
+    indexType = vertexCount <= MAX_UINT16_VERTICES || split ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    if (split) {
+        splitSubmeshes();
+    } else {
+        for (const MeshLod &lod: lods) {
+            lodRanges.push_back({static_cast<uint32_t>(submeshes.size()), 1, lod.error});
+            submeshes.push_back({lod.firstIndex, lod.indexCount, 0});
+        }
+    }
+    std::cout << "Index buffer: " << (indexType == VK_INDEX_TYPE_UINT16 ? 16 : 32) << "-bit, " << submeshes.size()
+              << (submeshes.size() == 1 ? " draw" : " draws");
+    if (lodRanges.size() > 1) {
+        std::cout << " across " << lodRanges.size() << " levels of detail";
+    }
+    std::cout << "\n";
+}
+
+void MeshRenderer::splitSubmeshes() {
+    // Triangles stay in order and are cut into runs that use at most MAX_UINT16_VERTICES distinct vertices. Every
+    // run gets its own copy of the vertices it uses, so indices are local and vertexOffset finds them. Only the
+    // vertices shared across a cut are duplicated, after optimizeVertexFetch neighbouring triangles share most.
+    std::vector<Vertex> submeshVertices;
+    std::vector<uint32_t> submeshIndices;
+    submeshVertices.reserve(vertexCount);
+    submeshIndices.reserve(indexCount);
+
+    std::vector<uint32_t> localIndices(vertexCount, UINT32_MAX);
+    std::vector<uint32_t> usedVertices;
+    auto startSubmesh = [&](uint32_t firstIndex) {
+        for (uint32_t vertex: usedVertices) {
+            localIndices[vertex] = UINT32_MAX;
+        }
+        usedVertices.clear();
+        submeshes.push_back({firstIndex, 0, static_cast<int32_t>(submeshVertices.size())});
+    };
+    // the levels of detail are contiguous from index 0, so every triangle keeps its place in the index array
+    for (const MeshLod &lod: lods) {
+        lodRanges.push_back({static_cast<uint32_t>(submeshes.size()), 0, lod.error});
+        startSubmesh(lod.firstIndex);
+        for (uint32_t i = lod.firstIndex; i + 2 < lod.firstIndex + lod.indexCount; i += 3) {
+            uint32_t newVertices = 0;
+            for (uint32_t k = 0; k < 3; ++k) {
+                newVertices += localIndices[indexData[i + k]] == UINT32_MAX;
+            }
+            if (usedVertices.size() + newVertices > MAX_UINT16_VERTICES) {
+                startSubmesh(i);
+            }
+
+            for (uint32_t k = 0; k < 3; ++k) {
+                uint32_t vertex = indexData[i + k];
+                if (localIndices[vertex] == UINT32_MAX) {
+                    localIndices[vertex] = static_cast<uint32_t>(usedVertices.size());
+                    usedVertices.push_back(vertex);
+                    submeshVertices.push_back(vertexData[vertex]);
+                }
+                submeshIndices.push_back(localIndices[vertex]);
+            }
+            submeshes.back().indexCount += 3;
+        }
+        lodRanges.back().submeshCount = static_cast<uint32_t>(submeshes.size()) - lodRanges.back().firstSubmesh;
+    }
+
+    // vertexData may point into vertices, so only now
+    vertices = std::move(submeshVertices);
+    indices = std::move(submeshIndices);
+    vertexData = vertices.data();
+    vertexCount = static_cast<uint32_t>(vertices.size());
+    indexData = indices.data();
+    indexCount = static_cast<uint32_t>(indices.size());
+}
+
+void MeshRenderer::createIndexBuffer() {
+    VkDeviceSize indexSize = indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    VkDeviceSize bufferSize = indexSize * indexCount;
+
+    StagingAllocation staging = app->allocateStaging(bufferSize);
+    if (indexType == VK_INDEX_TYPE_UINT16) {
+        // local to their submesh after chooseIndexType, so they all fit
+        auto *indices16 = static_cast<uint16_t *>(staging.data);
+        for (uint32_t i = 0; i < indexCount; ++i) {
+            indices16[i] = static_cast<uint16_t>(indexData[i]);
+        }
+    } else {
+        memcpy(staging.data, indexData, bufferSize);
+    }
 
     app->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                       indexBuffer, indexBufferMemory);
 
-    app->copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-
-    vkDestroyBuffer(app->device, stagingBuffer, nullptr);
-    vkFreeMemory(app->device, stagingBufferMemory, nullptr);
+    app->copyBuffer(app->beginUpload(), staging.buffer, staging.offset, indexBuffer, bufferSize);
+    app->transferOwnership(indexBuffer);
 }
 
 void MeshRenderer::update(float deltaTime, uint32_t frameNum) {
@@ -479,25 +1338,235 @@ void MeshRenderer::update(float deltaTime, uint32_t frameNum) {
     accTime += deltaTime;
 
     UniformBufferObject ubo;
+    float farPlane = 10.0f;
+    if (instanceCount == 1) {
 //        ubo.model = glm::mat4(1.0f);
-    ubo.model = glm::rotate(glm::mat4(1.0f), accTime * glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    ubo.model *= glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
-                 glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    ubo.view = glm::lookAt(glm::vec3(0.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        ubo.model = glm::rotate(glm::mat4(1.0f), accTime * glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        ubo.model *= glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
+                     glm::rotate(glm::mat4(1.0f), glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+        ubo.view = glm::lookAt(glm::vec3(0.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f),
+                               glm::vec3(0.0f, 1.0f, 0.0f));
+    } else {
+        // circling halfway out over the grid, so part of it is always behind the camera
+        float orbit = std::max(sceneRadius * 0.5f, 2.0f);
+        float angle = accTime * glm::radians(10.0f);
+        ubo.model = glm::mat4(1.0f);
+        ubo.view = glm::lookAt(glm::vec3(std::sin(angle) * orbit, 2.0f + orbit * 0.25f, std::cos(angle) * orbit),
+                               glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        farPlane = orbit + sceneRadius + 10.0f;
+    }
     ubo.projection = glm::perspective(glm::radians(45.0f),
                                       app->swapChainExtent.width / (float) app->swapChainExtent.height,
-                                      0.1f, 10.0f);
+                                      0.1f, farPlane);
 
     // GLM was originally designed for OpenGL, where the Y coordinate of the clip coordinates is inverted.
     // The easiest way to compensate for that is to flip the sign on the scaling factor of the Y axis in the projection matrix.
     ubo.projection[1][1] *= -1;
+    ubo.positionScale = positionScale;
+    ubo.positionOffset = positionOffset;
 
     memcpy(uniformBufferMemoriesMapped[frameNum], &ubo, sizeof(ubo));
+
+    // an error of e at distance d covers e * lodScale / d pixels
+    float lodScale = std::abs(ubo.projection[1][1]) * static_cast<float>(app->swapChainExtent.height) * 0.5f /
+                     app->lodPixelError;
+    // without a cull shader all instances share one level, only the single model gets to pick
+    currentLod = 0;
+    if (!indirectDraws && instanceCount == 1) {
+        currentLod = selectLod(ubo.model, glm::vec3(glm::inverse(ubo.view)[3]), lodScale);
+    }
+
+    if (indirectDraws) {
+        // the frame that last used this slot has completed
+        memcpy(cullStats.data(), cullStatsBufferMemories[frameNum].mapped, sizeof(cullStats));
+
+        // Gribb-Hartmann: the frustum planes of the whole transform are in object space, rows of the transposed
+        glm::mat4 viewProjection = ubo.projection * ubo.view * ubo.model;
+        glm::mat4 rows = glm::transpose(viewProjection);
+        CullUniforms cull{};
+        cull.frustumPlanes[0] = rows[3] + rows[0];
+        cull.frustumPlanes[1] = rows[3] - rows[0];
+        cull.frustumPlanes[2] = rows[3] + rows[1];
+        cull.frustumPlanes[3] = rows[3] - rows[1];
+        // depth is 0 to 1
+        cull.frustumPlanes[4] = rows[2];
+        cull.frustumPlanes[5] = rows[3] - rows[2];
+        for (glm::vec4 &plane: cull.frustumPlanes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+        cull.cameraPosition = glm::inverse(ubo.view * ubo.model)[3];
+        cull.clusterCount = clusterCount;
+        cull.instanceCount = instanceCount;
+        cull.lodCount = static_cast<uint32_t>(lodRanges.size());
+        cull.lodScale = lodScale;
+        cull.meshSphere = meshSphere;
+        for (uint32_t lod = 0; lod < lodRanges.size(); ++lod) {
+            cull.lodErrors[lod] = lodRanges[lod].error;
+        }
+        cull.viewProjection = viewProjection;
+        // prepareRender rebuilds the pyramid for the current swapchain before it is used
+        cull.pyramidSize = glm::vec2(app->swapChainExtent.width, app->swapChainExtent.height);
+        cull.pyramidLevelCount = getPyramidLevelCount(app->swapChainExtent);
+
+        memcpy(cullUniformBufferMemories[frameNum].mapped, &cull, sizeof(cull));
+    }
+}
+
+void MeshRenderer::prepareRender(VkCommandBuffer commandBuffer, uint32_t frameNum) {
+    if (!indirectDraws) {
+        return;
+    }
+    if (occlusionCulling && (pyramidImage == VK_NULL_HANDLE || pyramidGeneration != app->swapChainGeneration)) {
+        createDepthPyramid(commandBuffer);
+    }
+
+    // the counts start over every frame, and without drawIndirectCount the commands past them have to draw nothing
+    vkCmdFillBuffer(commandBuffer, drawCountBuffers[frameNum], 0, VK_WHOLE_SIZE, 0);
+    if (!app->drawIndirectCountSupported) {
+        vkCmdFillBuffer(commandBuffer, drawCommandBuffers[frameNum], 0, VK_WHOLE_SIZE, 0);
+    }
+
+    // also orders last frame's visibility writes and depth pyramid reads before this frame's
+    VkMemoryBarrier clearBarrier{};
+    clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &clearBarrier, 0, nullptr, 0, nullptr);
+
+    // the depth pyramid only for occlusion_cull.comp
+    std::array<VkDescriptorSet, 2> cullSets{cullDescriptorSets[frameNum], pyramidSet};
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout,
+                            0, occlusionCulling ? 2 : 1, cullSets.data(), 0, nullptr);
+    dispatchPerDraw(commandBuffer);
+
+    VkMemoryBarrier drawBarrier{};
+    drawBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    drawBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    drawBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &drawBarrier, 0, nullptr, 0, nullptr);
+
+    if (!occlusionCulling) {
+        copyCullStats(commandBuffer, frameNum);
+    }
+}
+
+void MeshRenderer::betweenRenderPasses(VkCommandBuffer commandBuffer, uint32_t frameNum) {
+    // the depth pyramid of what the early pass drew, level by level
+    VkMemoryBarrier levelBarrier{};
+    levelBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    for (uint32_t level = 0; level < pyramidBuildSets.size(); ++level) {
+        if (level <= 1) {
+            // level 0 straight from a multisampled depth buffer
+            bool ms = level == 0 && pyramidMsPipeline != VK_NULL_HANDLE;
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ms ? pyramidMsPipeline : pyramidPipeline);
+        }
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pyramidPipelineLayout,
+                                0, 1, &pyramidBuildSets[level], 0, nullptr);
+        // Vulkan's mip sizes, halved and rounded down, local_size of both pyramid shaders
+        uint32_t width = std::max(pyramidExtent.width >> level, 1u);
+        uint32_t height = std::max(pyramidExtent.height >> level, 1u);
+        vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8, 1);
+
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &levelBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    std::array<VkDescriptorSet, 2> cullSets{cullDescriptorSets[frameNum], pyramidSet};
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lateCullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout,
+                            0, static_cast<uint32_t>(cullSets.size()), cullSets.data(), 0, nullptr);
+    dispatchPerDraw(commandBuffer);
+
+    VkMemoryBarrier drawBarrier{};
+    drawBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    drawBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    drawBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &drawBarrier, 0, nullptr, 0, nullptr);
+
+    copyCullStats(commandBuffer, frameNum);
+}
+
+void MeshRenderer::dispatchPerDraw(VkCommandBuffer commandBuffer) {
+    // local_size_x of the cull shaders, which wrap past the device's limit on groups per row
+    uint32_t groupCount = (maxDrawCount + 63) / 64;
+    uint32_t rowGroups = std::min(groupCount, app->maxComputeWorkGroupCountX);
+    vkCmdDispatch(commandBuffer, rowGroups, (groupCount + rowGroups - 1) / std::max(rowGroups, 1u), 1);
+}
+
+void MeshRenderer::copyCullStats(VkCommandBuffer commandBuffer, uint32_t frameNum) {
+    VkBufferCopy copyRegion{0, 0, sizeof(cullStats)};
+    vkCmdCopyBuffer(commandBuffer, drawCountBuffers[frameNum], cullStatsBuffers[frameNum], 1, &copyRegion);
+
+    VkMemoryBarrier hostBarrier{};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &hostBarrier, 0, nullptr, 0, nullptr);
+}
+
+std::vector<RendererCounter> MeshRenderer::getCounters() {
+    if (!indirectDraws && lodRanges.size() <= 1) {
+        return {};
+    }
+    if (!indirectDraws) {
+        const LodRange &range = lodRanges[currentLod];
+        uint64_t triangles = 0;
+        for (uint32_t i = range.firstSubmesh; i < range.firstSubmesh + range.submeshCount; ++i) {
+            triangles += static_cast<uint64_t>(submeshes[i].indexCount / 3) * instanceCount;
+        }
+        return {{"Level of detail", currentLod}, {"Triangles drawn", triangles}};
+    }
+
+    // counts of the frame that last completed in the slot update ran for, the cull shaders count the submeshes of
+    // the level every instance picked
+    uint32_t draws = meshletCulling ? maxDrawCount : cullStats[5];
+    std::vector<RendererCounter> counters{
+            {meshletCulling ? "Meshlets" : "Instance draws", draws},
+            {"Drawn", cullStats[0] + cullStats[1]},
+            {meshletCulling ? "Frustum or cone culled" : "Frustum culled", cullStats[3]},
+    };
+    if (occlusionCulling) {
+        counters.push_back({"Drawn after the pyramid", cullStats[1]});
+        counters.push_back({"Occlusion culled", cullStats[2]});
+    }
+    counters.push_back({"Triangles drawn", cullStats[4]});
+    return counters;
+}
+
+void MeshRenderer::drawSubmeshes(VkCommandBuffer commandBuffer, uint32_t frameNum, bool late) {
+    if (indirectDraws) {
+        // the late pass's commands and count follow the early pass's
+        app->drawIndexedIndirect(commandBuffer, drawCommandBuffers[frameNum], drawCountBuffers[frameNum],
+                                 maxDrawCount, late ? sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount : 0,
+                                 late ? sizeof(uint32_t) : 0);
+        return;
+    }
+    const LodRange &range = lodRanges[currentLod];
+    for (uint32_t i = range.firstSubmesh; i < range.firstSubmesh + range.submeshCount; ++i) {
+        const Submesh &submesh = submeshes[i];
+        vkCmdDrawIndexed(commandBuffer, submesh.indexCount, instanceCount, submesh.firstIndex, submesh.vertexOffset,
+                         0);
+    }
 }
 
 void MeshRenderer::render(VkCommandBuffer commandBuffer, uint32_t frameNum) {
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+    recordDraws(commandBuffer, frameNum, false);
+}
+
+void MeshRenderer::renderLate(VkCommandBuffer commandBuffer, uint32_t frameNum) {
+    recordDraws(commandBuffer, frameNum, true);
+}
 
+void MeshRenderer::recordDraws(VkCommandBuffer commandBuffer, uint32_t frameNum, bool late) {
     VkViewport viewport{};
     viewport.x = 0;
     viewport.y = 0;
@@ -512,33 +1581,89 @@ void MeshRenderer::render(VkCommandBuffer commandBuffer, uint32_t frameNum) {
     scissor.extent = app->swapChainExtent;
     vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-    VkBuffer vertexBuffers[] = {vertexBuffer};
-    VkDeviceSize vertexBufferOffsets[] = {0};
-    vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, vertexBufferOffsets);
-    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+    std::vector<VkDeviceSize> vertexBufferOffsets(vertexStreams.size(), 0);
+    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
                             0, 1, &descriptorSets[frameNum], 0, nullptr);
+
+    if (depthPrepass) {
+        // positions are always the first stream
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, depthPipeline);
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexStreams.data(), vertexBufferOffsets.data());
+        drawSubmeshes(commandBuffer, frameNum, late);
+    }
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+    vkCmdBindVertexBuffers(commandBuffer, 0, static_cast<uint32_t>(vertexStreams.size()), vertexStreams.data(),
+                           vertexBufferOffsets.data());
 //        vkCmdDraw(commandBuffer, static_cast<uint32_t>(vertices.size()), 1, 0, 0);
-    vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+    drawSubmeshes(commandBuffer, frameNum, late);
 }
 
 void MeshRenderer::cleanup() {
-    for (int i = 0; i < uniformBuffers.size(); ++i) {
-        vkDestroyBuffer(app->device, uniformBuffers[i], nullptr);
-        vkFreeMemory(app->device, uniformBufferMemories[i], nullptr);
-    }
+    cleanupFrameResources();
 
     vkDestroyBuffer(app->device, indexBuffer, nullptr);
-    vkFreeMemory(app->device, indexBufferMemory, nullptr);
-    vkDestroyBuffer(app->device, vertexBuffer, nullptr);
-    vkFreeMemory(app->device, vertexBufferMemory, nullptr);
+    app->allocator.free(indexBufferMemory);
+    vkDestroyBuffer(app->device, instanceBuffer, nullptr);
+    app->allocator.free(instanceBufferMemory);
+    for (size_t i = 0; i < vertexStreams.size(); ++i) {
+        vkDestroyBuffer(app->device, vertexStreams[i], nullptr);
+        app->allocator.free(vertexStreamMemories[i]);
+    }
+    vertexStreams.clear();
+    vertexStreamMemories.clear();
+    if (clusterBuffer != VK_NULL_HANDLE) {
+        vkDestroyBuffer(app->device, clusterBuffer, nullptr);
+        app->allocator.free(clusterBufferMemory);
+        clusterBuffer = VK_NULL_HANDLE;
+    }
+    if (visibilityBuffer != VK_NULL_HANDLE) {
+        vkDestroyBuffer(app->device, visibilityBuffer, nullptr);
+        app->allocator.free(visibilityBufferMemory);
+        visibilityBuffer = VK_NULL_HANDLE;
+    }
+    cleanupDepthPyramid(false);
+    if (pyramidSampler != VK_NULL_HANDLE) {
+        vkDestroySampler(app->device, pyramidSampler, nullptr);
+        pyramidSampler = VK_NULL_HANDLE;
+    }
 
     vkDestroySampler(app->device, textureImageSampler, nullptr);
     vkDestroyImageView(app->device, textureImageView, nullptr);
     vkDestroyImage(app->device, textureImage, nullptr);
-    vkFreeMemory(app->device, textureImageMemory, nullptr);
+    app->allocator.free(textureImageMemory);
 
     vkDestroyPipeline(app->device, graphicsPipeline, nullptr);
+    if (depthPipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(app->device, depthPipeline, nullptr);
+        depthPipeline = VK_NULL_HANDLE;
+    }
     vkDestroyPipelineLayout(app->device, pipelineLayout, nullptr);
     vkDestroyDescriptorSetLayout(app->device, descriptorSetLayout, nullptr);
+    if (cullPipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(app->device, cullPipeline, nullptr);
+        vkDestroyPipelineLayout(app->device, cullPipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(app->device, cullDescriptorSetLayout, nullptr);
+        cullPipeline = VK_NULL_HANDLE;
+        cullPipelineLayout = VK_NULL_HANDLE;
+        cullDescriptorSetLayout = VK_NULL_HANDLE;
+    }
+    if (lateCullPipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(app->device, lateCullPipeline, nullptr);
+        vkDestroyPipeline(app->device, pyramidPipeline, nullptr);
+        if (pyramidMsPipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(app->device, pyramidMsPipeline, nullptr);
+        }
+        vkDestroyPipelineLayout(app->device, pyramidPipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(app->device, pyramidBuildSetLayout, nullptr);
+        vkDestroyDescriptorSetLayout(app->device, pyramidSetLayout, nullptr);
+        lateCullPipeline = VK_NULL_HANDLE;
+        pyramidPipeline = VK_NULL_HANDLE;
+        pyramidMsPipeline = VK_NULL_HANDLE;
+        pyramidPipelineLayout = VK_NULL_HANDLE;
+        pyramidBuildSetLayout = VK_NULL_HANDLE;
+        pyramidSetLayout = VK_NULL_HANDLE;
+    }
+    splitRenderPass = false;
 }
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include <glm/gtx/hash.hpp>
 
 #include "Renderer.h"
+#include "MemoryAllocator.h"
+#include "MeshCache.h"
 
 class Application;
 
@@ -55,6 +57,19 @@ struct Vertex {
     }
 };
 
+// MeshRenderer's vertex layout with Application::compactVertices, 12 bytes instead of 32: the position as unorm16
+// within the mesh bounds (UniformBufferObject::positionScale/positionOffset decode it) and the uv as half floats.
+// Colors are a separate stream, see MeshRenderer::getVertexInput.
+struct CompactVertex {
+    uint16_t position[4];
+    uint16_t uv[2];
+};
+
+// everything but the position, the second stream with Application::splitVertexStreams
+struct VertexAttributes {
+    glm::vec3 color;
+    glm::vec2 uv;
+};
 
 namespace std {
     template<>
@@ -66,54 +81,181 @@ namespace std {
     };
 }
 
+// shared by every instance, each one has its own transform in MeshRenderer's instance buffer on top of model
 struct UniformBufferObject {
+    // the whole scene, the turning of the single model or identity for the grid of instances
     alignas(16) glm::mat4 model;
     alignas(16) glm::mat4 view;
     alignas(16) glm::mat4 projection;
+    // object space position = vertex position * scale + offset, identity for float vertices
+    alignas(16) glm::vec4 positionScale;
+    alignas(16) glm::vec4 positionOffset;
+};
+
+// meshlet_cull.comp's, instance_cull.comp's and occlusion_cull.comp's view of the frame, in the space
+// UniformBufferObject::model maps from, where the meshlets and the instance transforms are
+struct CullUniforms {
+    // inside where dot(plane.xyz, p) + plane.w >= 0, xyz normalized
+    alignas(16) glm::vec4 frustumPlanes[6];
+    alignas(16) glm::vec4 cameraPosition;
+    uint32_t clusterCount;
+    uint32_t instanceCount;
+    // level of detail selection, see MeshRenderer::selectLod
+    uint32_t lodCount;
+    float lodScale;
+    alignas(16) glm::vec4 meshSphere;
+    alignas(16) glm::vec4 lodErrors;
+    // the rest for occlusion_cull.comp only
+    alignas(16) glm::mat4 viewProjection;
+    glm::vec2 pyramidSize;
+    uint32_t pyramidLevelCount;
 };
 
+// one lodErrors component per level
+static_assert(MeshCache::MAX_LODS == 4, "CullUniforms::lodErrors and the cull shaders hold MeshCache::MAX_LODS");
+
 class MeshRenderer : public Renderer {
 public:
+    // depth pyramid levels there are descriptors for, enough for a 16K depth buffer
+    static const uint32_t MAX_PYRAMID_LEVELS = 15;
+    // early and late draws, then the draws the depth pyramid culled, those outside the frustum (or facing away), the
+    // triangles drawn and the submesh draws at the levels of detail the instances selected, before any culling
+    static const uint32_t DRAW_COUNTS = 6;
+
+    void load(Application *application) override;
+
     void init(Application *application) override;
 
+    void createFrameResources() override;
+
+    void cleanupFrameResources() override;
+
     void update(float deltaTime, uint32_t frameNum) override;
 
+    void prepareRender(VkCommandBuffer commandBuffer, uint32_t frameNum) override;
+
     void render(VkCommandBuffer commandBuffer, uint32_t frameNum) override;
 
+    void betweenRenderPasses(VkCommandBuffer commandBuffer, uint32_t frameNum) override;
+
+    void renderLate(VkCommandBuffer commandBuffer, uint32_t frameNum) override;
+
+    std::vector<RendererCounter> getCounters() override;
+
     void cleanup() override;
 
-    void createPipeline() override;
+    std::vector<std::function<void()>> getPipelineJobs() override;
 
     const DescriptorPoolRequirement getDescriptorPoolRequirement() override;
 
 private:
     void createDescriptorSetLayout();
 
+    void createPipelineLayout();
+
+    struct VertexInput {
+        std::vector<VkVertexInputBindingDescription> bindings;
+        std::vector<VkVertexInputAttributeDescription> attributes;
+    };
+
+    // for the layout chosen at init, binding 0 is always the one with the positions
+    VertexInput getVertexInput(bool positionOnly) const;
+
+    // depthOnly: the prepass pipeline, positions only and no fragment shader
+    void createGraphicsPipeline(bool depthOnly);
+
+    // late: occlusion_cull.comp's second pass
+    void createCullPipeline(bool late);
+
+    void createComputePipeline(const std::string &path, VkPipelineLayout layout,
+                               const VkSpecializationInfo *specializationInfo, VkPipeline &pipeline);
+
     void createUniformBuffers();
 
     void createDescriptorSets();
 
+    // per frame uniforms, indirect draws and descriptor sets of meshlet_cull.comp
+    void createCullResources();
+
+    void cleanupCullResources();
+
+    // for the current depth buffer, replacing the one of an older swapchain
+    void createDepthPyramid(VkCommandBuffer commandBuffer);
+
+    // deferred: frames in flight may still be using it
+    void cleanupDepthPyramid(bool deferred);
+
+    // every instance of every submesh, straight or as the indirect draws the cull shader wrote, late: those of
+    // occlusion_cull.comp's second pass
+    void drawSubmeshes(VkCommandBuffer commandBuffer, uint32_t frameNum, bool late);
+
+    void recordDraws(VkCommandBuffer commandBuffer, uint32_t frameNum, bool late);
+
+    // an invocation of the bound cull shader per draw command slot
+    void dispatchPerDraw(VkCommandBuffer commandBuffer);
+
+    // makes the draw counts of the frame readable by update once it completed
+    void copyCullStats(VkCommandBuffer commandBuffer, uint32_t frameNum);
+
+    void loadTexture();
+
     void createTextureImage();
 
     void createTextureImageView();
 
     void createTextureImageSampler();
 
+    // from the mesh cache, parsing the OBJ (and writing the cache) only when it is missing or stale
     void loadModel();
 
-    void createVertexBuffer();
+    void parseModel();
+
+    // MeshOptimizer passes on the parsed model, printing the vertex cache stats before and after
+    void optimizeModel();
+
+    // Application::meshLods unless meshlet culling takes over, the single model has no instances to pick levels for.
+    // Read from app, load can run before init.
+    bool lodsEnabled() const;
+
+    // the levels of detail init settled on, and the bounds selectLod measures the distance to
+    void prepareLods();
+
+    // The coarsest level whose error is at most lodScale / distance pixels on screen, from a camera at
+    // cameraPosition to the mesh transformed by model. instance_cull.comp and occlusion_cull.comp's selectLod.
+    uint32_t selectLod(const glm::mat4 &model, const glm::vec3 &cameraPosition, float lodScale) const;
+
+    void releaseModelData();
+
+    // 16-bit when the model fits (or is split into submeshes that do), decided before anything is uploaded
+    void chooseIndexType();
+
+    // rewrites the model into submeshes of at most MAX_UINT16_VERTICES vertices each, none across levels of detail
+    void splitSubmeshes();
+
+    // one stream per binding of getVertexInput, encoded from vertexData straight into staging memory
+    void createVertexBuffers();
+
+    void createVertexStream(VkDeviceSize size, const std::function<void(void *)> &fill);
 
     void createIndexBuffer();
 
+    // the instance transforms, a grid with randomly turned copies of the model or a single identity
+    void createInstanceBuffer();
+
+    // The Meshlets the cull shader tests: MeshletBuilder's with meshletCulling, one around each submesh for
+    // instance_cull.comp to place with every instance transform otherwise.
+    void createClusterBuffer();
+
     Application *app;
     VkDescriptorSetLayout descriptorSetLayout;
     VkPipelineLayout pipelineLayout;
     VkPipeline graphicsPipeline;
+    VkPipeline depthPipeline = VK_NULL_HANDLE;
 
     std::vector<VkDescriptorSet> descriptorSets;
 
     std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBufferMemories;
+    std::vector<MemoryAllocation> uniformBufferMemories;
     std::vector<void *> uniformBufferMemoriesMapped;
 
 //    std::vector<Vertex> vertices = {
@@ -132,18 +274,116 @@ private:
 //            4, 5, 6, 4, 6, 7,
 //    };
 
+    // filled by parseModel, empty when the model came from meshCache
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
-
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    MeshCache meshCache;
+    // into meshCache or the vectors above, until releaseModelData after the upload
+    const Vertex *vertexData = nullptr;
+    uint32_t vertexCount = 0;
+    const uint32_t *indexData = nullptr;
+    uint32_t indexCount = 0;
+    // the full detail mesh first, the only one without Application::meshLods
+    std::vector<MeshLod> lods;
+
+    // the Application options when init started, the pipelines and the buffers are built for them
+    bool compactVertices = false;
+    bool splitVertexStreams = false;
+    bool depthPrepass = false;
+    bool meshletCulling = false;
+    bool gpuCulling = false;
+    bool occlusionCulling = false;
+    bool useLods = false;
+    // either of the two, render draws what the cull shader wrote
+    bool indirectDraws = false;
+    uint32_t instanceCount = 1;
+    // distance from the origin to the farthest instance's center
+    float sceneRadius = 0;
+    glm::vec4 positionScale{1.0f};
+    glm::vec4 positionOffset{0.0f};
+
+    std::vector<VkBuffer> vertexStreams;
+    std::vector<MemoryAllocation> vertexStreamMemories;
+    VkDeviceSize vertexStreamBytes = 0;
     VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    MemoryAllocation indexBufferMemory;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+    VkBuffer instanceBuffer;
+    MemoryAllocation instanceBufferMemory;
+
+    struct Submesh {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        int32_t vertexOffset;
+    };
+    // one draw each, a single one per level of detail unless splitSubmeshes ran
+    std::vector<Submesh> submeshes;
+
+    struct LodRange {
+        uint32_t firstSubmesh;
+        uint32_t submeshCount;
+        float error;
+    };
+    std::vector<LodRange> lodRanges;
+    // bounding sphere of the full detail mesh
+    glm::vec4 meshSphere{0.0f};
+    // the level drawn without a cull shader to pick one per instance, chosen by update
+    uint32_t currentLod = 0;
+
+    uint32_t clusterCount = 0;
+    VkBuffer clusterBuffer = VK_NULL_HANDLE;
+    MemoryAllocation clusterBufferMemory;
+    // draw commands the cull shader may write, one per cluster and instance
+    uint32_t maxDrawCount = 0;
+    VkDescriptorSetLayout cullDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline cullPipeline = VK_NULL_HANDLE;
+    VkPipeline lateCullPipeline = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> cullDescriptorSets;
+    std::vector<VkBuffer> cullUniformBuffers;
+    std::vector<MemoryAllocation> cullUniformBufferMemories;
+    // maxDrawCount VkDrawIndexedIndirectCommands and the number of them written this frame, with occlusionCulling
+    // twice that many for the early and the late pass and three counts, the third the draws the pyramid culled
+    std::vector<VkBuffer> drawCommandBuffers;
+    std::vector<MemoryAllocation> drawCommandBufferMemories;
+    std::vector<VkBuffer> drawCountBuffers;
+    std::vector<MemoryAllocation> drawCountBufferMemories;
+    // host visible copies of the counts, read back a frame in flight later
+    std::vector<VkBuffer> cullStatsBuffers;
+    std::vector<MemoryAllocation> cullStatsBufferMemories;
+    std::array<uint32_t, DRAW_COUNTS> cullStats{};
+
+    // occlusionCulling: whether each draw slot was visible at the end of the last frame
+    VkBuffer visibilityBuffer = VK_NULL_HANDLE;
+    MemoryAllocation visibilityBufferMemory;
+    // The farthest depth of the early pass in a mip chain, level 0 at the size of the depth buffer. Shared by the
+    // frames in flight, which run its build and reads one after the other on the graphics queue.
+    VkImage pyramidImage = VK_NULL_HANDLE;
+    MemoryAllocation pyramidImageMemory;
+    VkImageView pyramidImageView;
+    std::vector<VkImageView> pyramidLevelViews;
+    VkSampler pyramidSampler = VK_NULL_HANDLE;
+    VkExtent2D pyramidExtent{};
+    // Application::swapChainGeneration of the depth buffer it was built for
+    uint32_t pyramidGeneration = 0;
+    // a level and the one above it (or the depth buffer) for depth_pyramid.comp, then the whole chain to cull with
+    VkDescriptorSetLayout pyramidBuildSetLayout = VK_NULL_HANDLE;
+    VkDescriptorSetLayout pyramidSetLayout = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> pyramidBuildSets;
+    VkDescriptorSet pyramidSet = VK_NULL_HANDLE;
+    VkPipelineLayout pyramidPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline pyramidPipeline = VK_NULL_HANDLE;
+    VkPipeline pyramidMsPipeline = VK_NULL_HANDLE;
+
+    // decoded by loadTexture, freed once uploaded
+    std::vector<unsigned char> texturePixels;
+    int textureWidth = 0;
+    int textureHeight = 0;
 
     uint32_t mipLevels;
     VkImage textureImage;
     VkImageView textureImageView;
-    VkDeviceMemory textureImageMemory;
+    MemoryAllocation textureImageMemory;
     VkSampler textureImageSampler;
 };
 
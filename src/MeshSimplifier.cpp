@@ -0,0 +1,465 @@
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "MeshOptimizer.h"
+#include "VertexWeldMap.h"
+
+namespace {
+    // Sum of squared distances to planes, p^T A p + 2 b^T p + c, each plane weighted by the area it stands for.
+    // evaluate divides by the total weight, a mean squared distance that doesn't grow with the tessellation.
+    struct Quadric {
+        double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+        double b0 = 0, b1 = 0, b2 = 0;
+        double c = 0;
+        double weight = 0;
+
+        // the plane of points p with dot(normal, p) + distance = 0, normal unit length
+        void addPlane(const glm::vec3 &normal, float distance, double planeWeight) {
+            double x = normal.x, y = normal.y, z = normal.z, d = distance;
+            a00 += planeWeight * x * x;
+            a01 += planeWeight * x * y;
+            a02 += planeWeight * x * z;
+            a11 += planeWeight * y * y;
+            a12 += planeWeight * y * z;
+            a22 += planeWeight * z * z;
+            b0 += planeWeight * x * d;
+            b1 += planeWeight * y * d;
+            b2 += planeWeight * z * d;
+            c += planeWeight * d * d;
+            weight += planeWeight;
+        }
+
+        void add(const Quadric &other) {
+            a00 += other.a00;
+            a01 += other.a01;
+            a02 += other.a02;
+            a11 += other.a11;
+            a12 += other.a12;
+            a22 += other.a22;
+            b0 += other.b0;
+            b1 += other.b1;
+            b2 += other.b2;
+            c += other.c;
+            weight += other.weight;
+        }
+
+        double evaluate(const glm::vec3 &p) const {
+            double x = p.x, y = p.y, z = p.z;
+            double value = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z) +
+                           2 * (b0 * x + b1 * y + b2 * z) + c;
+            return weight > 0 ? std::max(value, 0.0) / weight : 0.0;
+        }
+    };
+
+    // open borders and seams keep this much more of their shape than the surface around them
+    const double BORDER_WEIGHT = 10.0;
+
+    // The collapses shared by all levels: each one continues from where the one before stopped, so the error only
+    // grows along the chain. Vertices are tracked by position (wedges: the Vertex copies of one position that
+    // differ in uv or color), a collapse moves every wedge of a position onto the matching one of its neighbour.
+    class Simplification {
+    public:
+        Simplification(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices)
+                : indices(indices), removed(indices.size() / 3, false),
+                  liveTriangles(static_cast<uint32_t>(indices.size() / 3)) {
+            VertexWeldMap positionMap;
+            positionMap.reserve(vertices.size());
+            wedgePositions.resize(vertices.size());
+            for (uint32_t i = 0; i < vertices.size(); ++i) {
+                Vertex key{};
+                key.position = vertices[i].position;
+                auto [position, inserted] = positionMap.insert(key, static_cast<uint32_t>(positions.size()));
+                if (inserted) {
+                    positions.push_back(vertices[i].position);
+                }
+                wedgePositions[i] = position;
+            }
+
+            quadrics.resize(positions.size());
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                const uint32_t *triangle = &this->indices[t * 3];
+                uint32_t p0 = wedgePositions[triangle[0]], p1 = wedgePositions[triangle[1]];
+                uint32_t p2 = wedgePositions[triangle[2]];
+                glm::vec3 normal = glm::cross(positions[p1] - positions[p0], positions[p2] - positions[p0]);
+                float length = glm::length(normal);
+                if (p0 == p1 || p1 == p2 || p0 == p2 || length == 0) {
+                    removeTriangle(t);
+                    continue;
+                }
+                normal /= length;
+                float distance = -glm::dot(normal, positions[p0]);
+                for (uint32_t position: {p0, p1, p2}) {
+                    quadrics[position].addPlane(normal, distance, length * 0.5);
+                }
+            }
+            addBorderQuadrics();
+        }
+
+        uint32_t getLiveTriangles() const { return liveTriangles; }
+
+        // of the costliest collapse so far, a root mean square distance to the original surface in model units
+        float getError() const { return static_cast<float>(std::sqrt(error)); }
+
+        // One round of the cheapest collapses that don't touch each other, at most half of those still needed so
+        // the later ones see the quadrics of the earlier. False once nothing could collapse.
+        bool pass(uint32_t targetTriangles) {
+            buildAdjacency();
+            std::vector<Collapse> collapses = findCollapses();
+            std::sort(collapses.begin(), collapses.end(),
+                      [](const Collapse &a, const Collapse &b) { return a.error < b.error; });
+
+            // each collapse removes the two triangles along its edge
+            uint32_t maxCollapses = std::max((liveTriangles - targetTriangles) / 4, 1u);
+            uint32_t collapseCount = 0;
+            std::vector<bool> touched(positions.size(), false);
+            for (const Collapse &collapse: collapses) {
+                if (collapseCount == maxCollapses || liveTriangles <= targetTriangles) {
+                    break;
+                }
+                if (touched[collapse.from] || touched[collapse.to] || !tryCollapse(collapse, touched)) {
+                    continue;
+                }
+                ++collapseCount;
+            }
+            return collapseCount > 0;
+        }
+
+        void appendTriangles(std::vector<uint32_t> &out) const {
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (!removed[t]) {
+                    out.insert(out.end(), indices.begin() + t * 3, indices.begin() + t * 3 + 3);
+                }
+            }
+        }
+
+    private:
+        struct Collapse {
+            uint32_t from;
+            uint32_t to;
+            double error;
+        };
+
+        std::vector<uint32_t> indices;
+        std::vector<bool> removed;
+        uint32_t liveTriangles;
+        std::vector<glm::vec3> positions;
+        std::vector<uint32_t> wedgePositions;
+        std::vector<Quadric> quadrics;
+        // squared, like the quadrics
+        double error = 0;
+
+        // the live triangles around each position, rebuilt every pass
+        std::vector<uint32_t> adjacencyOffsets;
+        std::vector<uint32_t> adjacency;
+        // per pass: on an open border, or on a non-manifold edge and never collapsed
+        std::vector<bool> border;
+        std::vector<bool> locked;
+
+        void removeTriangle(uint32_t t) {
+            removed[t] = true;
+            --liveTriangles;
+        }
+
+        uint32_t cornerPosition(uint32_t t, uint32_t corner) const {
+            return wedgePositions[indices[t * 3 + corner]];
+        }
+
+        // Planes through the wedge edges only one triangle has (open borders and seams), perpendicular to that
+        // triangle, so moving along the border costs nothing but moving off it does.
+        void addBorderQuadrics() {
+            std::vector<uint64_t> edges;
+            edges.reserve(liveTriangles * 3);
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (removed[t]) {
+                    continue;
+                }
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t a = indices[t * 3 + corner], b = indices[t * 3 + (corner + 1) % 3];
+                    edges.push_back(static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b));
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (removed[t]) {
+                    continue;
+                }
+                glm::vec3 p0 = positions[cornerPosition(t, 0)];
+                glm::vec3 normal = glm::normalize(glm::cross(positions[cornerPosition(t, 1)] - p0,
+                                                             positions[cornerPosition(t, 2)] - p0));
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t a = indices[t * 3 + corner], b = indices[t * 3 + (corner + 1) % 3];
+                    uint64_t key = static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b);
+                    auto range = std::equal_range(edges.begin(), edges.end(), key);
+                    if (range.second - range.first != 1) {
+                        continue;
+                    }
+                    glm::vec3 pa = positions[wedgePositions[a]], pb = positions[wedgePositions[b]];
+                    glm::vec3 edge = pb - pa;
+                    glm::vec3 borderNormal = glm::cross(edge, normal);
+                    float length = glm::length(borderNormal);
+                    if (length == 0) {
+                        continue;
+                    }
+                    borderNormal /= length;
+                    double weight = glm::dot(edge, edge) * BORDER_WEIGHT;
+                    float distance = -glm::dot(borderNormal, pa);
+                    quadrics[wedgePositions[a]].addPlane(borderNormal, distance, weight);
+                    quadrics[wedgePositions[b]].addPlane(borderNormal, distance, weight);
+                }
+            }
+        }
+
+        void buildAdjacency() {
+            adjacencyOffsets.assign(positions.size() + 1, 0);
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (removed[t]) {
+                    continue;
+                }
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    ++adjacencyOffsets[cornerPosition(t, corner) + 1];
+                }
+            }
+            for (size_t i = 1; i < adjacencyOffsets.size(); ++i) {
+                adjacencyOffsets[i] += adjacencyOffsets[i - 1];
+            }
+            adjacency.resize(adjacencyOffsets.back());
+            std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (removed[t]) {
+                    continue;
+                }
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    adjacency[fill[cornerPosition(t, corner)]++] = t;
+                }
+            }
+        }
+
+        // the cheaper allowed direction of every edge between positions
+        std::vector<Collapse> findCollapses() {
+            std::vector<uint64_t> edges;
+            edges.reserve(liveTriangles * 3);
+            for (uint32_t t = 0; t < removed.size(); ++t) {
+                if (removed[t]) {
+                    continue;
+                }
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t a = cornerPosition(t, corner), b = cornerPosition(t, (corner + 1) % 3);
+                    edges.push_back(static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b));
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+
+            border.assign(positions.size(), false);
+            locked.assign(positions.size(), false);
+            for (size_t i = 0; i < edges.size();) {
+                size_t end = i;
+                while (end < edges.size() && edges[end] == edges[i]) {
+                    ++end;
+                }
+                auto a = static_cast<uint32_t>(edges[i] >> 32), b = static_cast<uint32_t>(edges[i]);
+                if (end - i == 1) {
+                    border[a] = border[b] = true;
+                } else if (end - i > 2) {
+                    locked[a] = locked[b] = true;
+                }
+                i = end;
+            }
+
+            std::vector<Collapse> collapses;
+            for (size_t i = 0; i < edges.size();) {
+                size_t end = i;
+                while (end < edges.size() && edges[end] == edges[i]) {
+                    ++end;
+                }
+                auto a = static_cast<uint32_t>(edges[i] >> 32), b = static_cast<uint32_t>(edges[i]);
+                i = end;
+
+                Collapse best{0, 0, INFINITY};
+                for (auto [from, to]: {std::pair{a, b}, std::pair{b, a}}) {
+                    // a border vertex moving inwards would open a hole, and even along the border it would cut the
+                    // corners off the outline, so open borders keep every vertex
+                    if (locked[from] || border[from]) {
+                        continue;
+                    }
+                    Quadric quadric = quadrics[from];
+                    quadric.add(quadrics[to]);
+                    double cost = quadric.evaluate(positions[to]);
+                    if (cost < best.error) {
+                        best = {from, to, cost};
+                    }
+                }
+                if (best.error < INFINITY) {
+                    collapses.push_back(best);
+                }
+            }
+            return collapses;
+        }
+
+        // the other positions of the triangles around position, sorted
+        std::vector<uint32_t> getRing(uint32_t position) const {
+            std::vector<uint32_t> ring;
+            for (uint32_t i = adjacencyOffsets[position]; i < adjacencyOffsets[position + 1]; ++i) {
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t neighbour = cornerPosition(adjacency[i], corner);
+                    if (neighbour != position) {
+                        ring.push_back(neighbour);
+                    }
+                }
+            }
+            std::sort(ring.begin(), ring.end());
+            ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+            return ring;
+        }
+
+        // The link condition: the only neighbours both ends share are the third corners of the triangles along the
+        // edge (one on a border). Any other would end up with two triangles or a non-manifold edge to the target.
+        bool keepsManifold(const Collapse &collapse) const {
+            std::vector<uint32_t> fromRing = getRing(collapse.from);
+            std::vector<uint32_t> toRing = getRing(collapse.to);
+            std::vector<uint32_t> shared;
+            std::set_intersection(fromRing.begin(), fromRing.end(), toRing.begin(), toRing.end(),
+                                  std::back_inserter(shared));
+
+            std::vector<uint32_t> opposite;
+            for (uint32_t i = adjacencyOffsets[collapse.from]; i < adjacencyOffsets[collapse.from + 1]; ++i) {
+                uint32_t positions[3] = {cornerPosition(adjacency[i], 0), cornerPosition(adjacency[i], 1),
+                                         cornerPosition(adjacency[i], 2)};
+                if (std::find(positions, positions + 3, collapse.to) == positions + 3) {
+                    continue;
+                }
+                for (uint32_t position: positions) {
+                    if (position != collapse.from && position != collapse.to) {
+                        opposite.push_back(position);
+                    }
+                }
+            }
+            std::sort(opposite.begin(), opposite.end());
+            opposite.erase(std::unique(opposite.begin(), opposite.end()), opposite.end());
+            return shared == opposite;
+        }
+
+        bool tryCollapse(const Collapse &collapse, std::vector<bool> &touched) {
+            if (!keepsManifold(collapse)) {
+                return false;
+            }
+            const uint32_t *first = adjacency.data() + adjacencyOffsets[collapse.from];
+            const uint32_t *last = adjacency.data() + adjacencyOffsets[collapse.from + 1];
+
+            // the wedge of the target each wedge of the source becomes, from the triangles along the edge
+            std::vector<std::pair<uint32_t, uint32_t>> wedgeMap;
+            for (const uint32_t *t = first; t != last; ++t) {
+                uint32_t fromWedge = UINT32_MAX, toWedge = UINT32_MAX;
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t position = cornerPosition(*t, corner);
+                    if (position == collapse.from) fromWedge = indices[*t * 3 + corner];
+                    if (position == collapse.to) toWedge = indices[*t * 3 + corner];
+                }
+                if (toWedge == UINT32_MAX) {
+                    continue;
+                }
+                auto mapped = std::find_if(wedgeMap.begin(), wedgeMap.end(),
+                                           [&](const auto &entry) { return entry.first == fromWedge; });
+                if (mapped == wedgeMap.end()) {
+                    wedgeMap.emplace_back(fromWedge, toWedge);
+                } else if (mapped->second != toWedge) {
+                    // the target is on a seam the source isn't, one side would get the other's uv
+                    return false;
+                }
+            }
+
+            for (const uint32_t *t = first; t != last; ++t) {
+                bool hasTarget = false;
+                uint32_t fromCorner = 0;
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t position = cornerPosition(*t, corner);
+                    hasTarget = hasTarget || position == collapse.to;
+                    fromCorner = position == collapse.from ? corner : fromCorner;
+                }
+                if (hasTarget) {
+                    continue;
+                }
+                // a seam crossed sideways: this wedge has no counterpart along the edge
+                uint32_t fromWedge = indices[*t * 3 + fromCorner];
+                if (std::none_of(wedgeMap.begin(), wedgeMap.end(),
+                                 [&](const auto &entry) { return entry.first == fromWedge; })) {
+                    return false;
+                }
+                // nor may any triangle fold over, or turn so far that it nearly does
+                glm::vec3 corners[3];
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    corners[corner] = positions[cornerPosition(*t, corner)];
+                }
+                glm::vec3 oldNormal = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                corners[fromCorner] = positions[collapse.to];
+                glm::vec3 newNormal = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+                if (glm::dot(oldNormal, newNormal) <= 0.25f * glm::length(oldNormal) * glm::length(newNormal)) {
+                    return false;
+                }
+            }
+
+            for (const uint32_t *t = first; t != last; ++t) {
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    touched[cornerPosition(*t, corner)] = true;
+                }
+            }
+            for (const uint32_t *t = first; t != last; ++t) {
+                bool hasTarget = false;
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    hasTarget = hasTarget || cornerPosition(*t, corner) == collapse.to;
+                }
+                if (hasTarget) {
+                    removeTriangle(*t);
+                    continue;
+                }
+                for (uint32_t corner = 0; corner < 3; ++corner) {
+                    uint32_t &wedge = indices[*t * 3 + corner];
+                    for (const auto &entry: wedgeMap) {
+                        if (entry.first == wedge) {
+                            wedge = entry.second;
+                            break;
+                        }
+                    }
+                }
+            }
+            quadrics[collapse.to].add(quadrics[collapse.from]);
+            error = std::max(error, collapse.error);
+            return true;
+        }
+    };
+}
+
+std::vector<MeshLod> MeshSimplifier::buildLods(const std::vector<Vertex> &vertices, std::vector<uint32_t> &indices,
+                                               uint32_t maxLods) {
+    std::vector<MeshLod> lods{{0, static_cast<uint32_t>(indices.size()), 0.0f}};
+    if (maxLods <= 1 || indices.empty()) {
+        return lods;
+    }
+
+    Simplification simplification(vertices, indices);
+    auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    while (lods.size() < maxLods) {
+        auto targetTriangles = static_cast<uint32_t>(triangleCount * LOD_TRIANGLE_RATIO);
+        while (simplification.getLiveTriangles() > targetTriangles && simplification.pass(targetTriangles)) {
+        }
+        // not even halfway to the target, a level that saves this little isn't worth its indices
+        uint32_t liveTriangles = simplification.getLiveTriangles();
+        if (liveTriangles > (triangleCount + targetTriangles) / 2) {
+            break;
+        }
+
+        std::vector<uint32_t> lodIndices;
+        lodIndices.reserve(liveTriangles * 3);
+        simplification.appendTriangles(lodIndices);
+        MeshOptimizer::optimizeVertexCache(lodIndices, static_cast<uint32_t>(vertices.size()));
+
+        lods.push_back({static_cast<uint32_t>(indices.size()), static_cast<uint32_t>(lodIndices.size()),
+                        simplification.getError()});
+        indices.insert(indices.end(), lodIndices.begin(), lodIndices.end());
+        triangleCount = liveTriangles;
+    }
+    return lods;
+}
@@ -0,0 +1,26 @@
+#ifndef RENDERER_MESHSIMPLIFIER_H
+#define RENDERER_MESHSIMPLIFIER_H
+
+#include <vector>
+#include <cstdint>
+
+#include "MeshRenderer.h"
+#include "MeshCache.h"
+
+// Quadric error edge collapse (Garland-Heckbert) for levels of detail. Vertices only ever collapse onto a
+// neighbour, never to a new position, so every level indexes the same vertex array and only needs indices of its
+// own. Vertices on open borders stay, so outlines don't shrink, UV and color seams only collapse where both sides
+// of the seam move together, so the coarser levels neither tear nor smear the texture.
+class MeshSimplifier {
+public:
+    // each level aims for this fraction of the triangles of the one before
+    static constexpr float LOD_TRIANGLE_RATIO = 0.5f;
+
+    // Appends up to maxLods - 1 coarser copies of the triangles in indices (after the full detail one, which
+    // stays as it is) and returns the ranges of all of them. Stops early once collapsing gets nowhere near the
+    // next target, e.g. on a mesh that is mostly borders.
+    static std::vector<MeshLod> buildLods(const std::vector<Vertex> &vertices, std::vector<uint32_t> &indices,
+                                          uint32_t maxLods);
+};
+
+#endif //RENDERER_MESHSIMPLIFIER_H
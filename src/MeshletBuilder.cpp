@@ -0,0 +1,99 @@
+#include "MeshletBuilder.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+void MeshletBuilder::build(const Vertex *vertices, const uint32_t *indices, uint32_t firstIndex, uint32_t indexCount,
+                           int32_t vertexOffset, std::vector<Meshlet> &meshlets) {
+    std::array<uint32_t, MAX_VERTICES> meshletVertices;
+    uint32_t meshletVertexCount = 0;
+    uint32_t meshletFirstIndex = firstIndex;
+
+    auto finish = [&](uint32_t end) {
+        Meshlet meshlet = computeBounds(vertices, indices, meshletFirstIndex, end - meshletFirstIndex);
+        meshlet.vertexOffset = vertexOffset;
+        meshlets.push_back(meshlet);
+        meshletVertexCount = 0;
+        meshletFirstIndex = end;
+    };
+
+    uint32_t end = firstIndex + indexCount;
+    for (uint32_t i = firstIndex; i + 2 < end; i += 3) {
+        const uint32_t *triangle = indices + i;
+        auto *meshletEnd = meshletVertices.begin() + meshletVertexCount;
+        uint32_t newVertices = 0;
+        for (int corner = 0; corner < 3; ++corner) {
+            // a triangle may repeat a vertex, count it once
+            bool seen = std::find(meshletVertices.begin(), meshletEnd, triangle[corner]) != meshletEnd ||
+                        (corner > 0 && triangle[corner] == triangle[0]) ||
+                        (corner > 1 && triangle[corner] == triangle[1]);
+            newVertices += seen ? 0 : 1;
+        }
+
+        if (meshletVertexCount + newVertices > MAX_VERTICES || (i - meshletFirstIndex) / 3 == MAX_TRIANGLES) {
+            finish(i);
+        }
+
+        for (int corner = 0; corner < 3; ++corner) {
+            meshletEnd = meshletVertices.begin() + meshletVertexCount;
+            if (std::find(meshletVertices.begin(), meshletEnd, triangle[corner]) == meshletEnd) {
+                meshletVertices[meshletVertexCount++] = triangle[corner];
+            }
+        }
+    }
+    if (meshletFirstIndex < end) {
+        finish(end);
+    }
+}
+
+Meshlet MeshletBuilder::computeBounds(const Vertex *vertices, const uint32_t *indices, uint32_t firstIndex,
+                                      uint32_t indexCount) {
+    glm::vec3 boundsMin(INFINITY);
+    glm::vec3 boundsMax(-INFINITY);
+    for (uint32_t i = firstIndex; i < firstIndex + indexCount; ++i) {
+        boundsMin = glm::min(boundsMin, vertices[indices[i]].position);
+        boundsMax = glm::max(boundsMax, vertices[indices[i]].position);
+    }
+
+    Meshlet meshlet{};
+    meshlet.firstIndex = firstIndex;
+    meshlet.indexCount = indexCount;
+    meshlet.center = (boundsMin + boundsMax) * 0.5f;
+    for (uint32_t i = firstIndex; i < firstIndex + indexCount; ++i) {
+        meshlet.radius = std::max(meshlet.radius, glm::length(vertices[indices[i]].position - meshlet.center));
+    }
+
+    // counter-clockwise triangles are the front faces, like the pipelines' frontFace
+    std::vector<glm::vec3> normals;
+    normals.reserve(indexCount / 3);
+    glm::vec3 normalSum(0.0f);
+    for (uint32_t i = firstIndex; i + 2 < firstIndex + indexCount; i += 3) {
+        const glm::vec3 &p0 = vertices[indices[i]].position;
+        glm::vec3 normal = glm::cross(vertices[indices[i + 1]].position - p0, vertices[indices[i + 2]].position - p0);
+        float area = glm::length(normal);
+        // degenerate triangles are never drawn, they don't constrain the cone
+        if (area > 0) {
+            normals.push_back(normal / area);
+            normalSum += normal / area;
+        }
+    }
+
+    meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneCutoff = 1.0f;
+    float sumLength = glm::length(normalSum);
+    if (normals.empty() || sumLength < 1e-6f) {
+        return meshlet;
+    }
+    meshlet.coneAxis = normalSum / sumLength;
+
+    float minDot = 1.0f;
+    for (const glm::vec3 &normal: normals) {
+        minDot = std::min(minDot, glm::dot(normal, meshlet.coneAxis));
+    }
+    // the cone gets too wide to ever cull anything from a camera outside the sphere
+    if (minDot > 0.1f) {
+        meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+    }
+    return meshlet;
+}
@@ -0,0 +1,44 @@
+#ifndef RENDERER_MESHLETBUILDER_H
+#define RENDERER_MESHLETBUILDER_H
+
+#include <vector>
+#include <cstdint>
+
+#include "MeshRenderer.h"
+
+// A run of consecutive triangles of the index buffer, small enough to be culled as a whole. Matches the std430
+// layout of meshlet_cull.comp.
+struct Meshlet {
+    // bounding sphere in object space
+    alignas(16) glm::vec3 center;
+    float radius;
+    // Every triangle faces away from a camera at p when dot(center - p, coneAxis) >= coneCutoff * |center - p| +
+    // radius. A cutoff of 1 never culls.
+    alignas(16) glm::vec3 coneAxis;
+    float coneCutoff;
+    // arguments of its vkCmdDrawIndexed
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    // the level of detail of the triangles, MeshRenderer's cull shaders draw one level per instance
+    uint32_t lod;
+};
+
+class MeshletBuilder {
+public:
+    // 124 rather than 128 triangles: 64 vertices + 124 * 3 bytes of local indices fit a mesh shader's 512 byte
+    // budget, the sizes the vendors recommend carry over to drawing them as index ranges
+    static const uint32_t MAX_VERTICES = 64;
+    static const uint32_t MAX_TRIANGLES = 124;
+
+    // Cuts the triangles of one draw into meshlets in index buffer order, which after MeshOptimizer keeps them
+    // compact. indices are relative to vertices, vertexOffset is only copied to the meshlets.
+    static void build(const Vertex *vertices, const uint32_t *indices, uint32_t firstIndex, uint32_t indexCount,
+                      int32_t vertexOffset, std::vector<Meshlet> &meshlets);
+
+    // sphere and cone around any range of triangles, vertexOffset left at 0
+    static Meshlet computeBounds(const Vertex *vertices, const uint32_t *indices, uint32_t firstIndex,
+                                 uint32_t indexCount);
+};
+
+#endif //RENDERER_MESHLETBUILDER_H
@@ -0,0 +1,317 @@
+#include "ObjLoader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+
+#include "ThreadPool.h"
+#include "VertexWeldMap.h"
+#include "utils.h"
+
+// Too small and the per chunk vectors cost more than they save, too large and the last chunk holds up the rest.
+static const size_t MIN_CHUNK_SIZE = 256 * 1024;
+static const uint32_t SHARD_COUNT = 64;
+
+static void runParallel(ThreadPool *pool, uint32_t count, const std::function<void(uint32_t)> &body) {
+    if (pool) {
+        pool->parallelFor(count, body);
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        body(i);
+    }
+}
+
+static const char *skipSpaces(const char *p) {
+    while (*p == ' ' || *p == '\t') ++p;
+    return p;
+}
+
+static const char *skipLine(const char *p, const char *end) {
+    const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+    return newline ? newline + 1 : end;
+}
+
+static bool isTokenEnd(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#' || c == '\0';
+}
+
+// std::from_chars rather than strtof, whose decimal separator follows the locale. nullptr if there is no number.
+static const char *parseFloat(const char *p, const char *end, float &value) {
+    p = skipSpaces(p);
+    if (p < end && *p == '+') ++p;
+    auto [next, error] = std::from_chars(p, end, value);
+    return error == std::errc() && isTokenEnd(*next) ? next : nullptr;
+}
+
+static const char *parseIndex(const char *p, const char *end, long &value) {
+    auto [next, error] = std::from_chars(p, end, value);
+    return error == std::errc() && value != 0 ? next : nullptr;
+}
+
+// statements that don't change the triangles the renderers draw: normals (Vertex has none), grouping, smoothing
+// groups, materials and display attributes
+static bool isIgnoredStatement(const std::string_view &keyword) {
+    static const std::string_view ignored[] = {"vn", "o", "g", "s", "mg", "usemtl", "mtllib", "lod", "bevel",
+                                               "c_interp", "d_interp", "maplib", "usemap", "shadow_obj",
+                                               "trace_obj"};
+    return std::find(std::begin(ignored), std::end(ignored), keyword) != std::end(ignored);
+}
+
+void ObjLoader::parseChunk(Chunk &chunk) {
+    const char *p = chunk.begin;
+    struct PolygonCorner {
+        Corner corner;
+        bool relativePosition;
+        bool relativeTexcoord;
+    };
+    std::vector<PolygonCorner> polygon;
+
+    while (p < chunk.end) {
+        const char *line = skipSpaces(p);
+        const char *next = skipLine(line, chunk.end);
+        const char *keywordEnd = line;
+        while (!isTokenEnd(*keywordEnd)) ++keywordEnd;
+        std::string_view keyword(line, keywordEnd - line);
+        auto fail = [&](const char *what) {
+            throw std::runtime_error(std::string(what) + std::string(line, next));
+        };
+
+        if (keyword == "v") {
+            // x y z, an optional w or vertex color after them is ignored
+            const char *value = keywordEnd;
+            for (int i = 0; i < 3; ++i) {
+                float coordinate;
+                value = parseFloat(value, next, coordinate);
+                if (!value) fail("failed to parse OBJ vertex! ");
+                chunk.positions.push_back(coordinate);
+            }
+        } else if (keyword == "vt") {
+            // u and an optional v, w is ignored
+            float u, v = 0;
+            const char *value = parseFloat(keywordEnd, next, u);
+            if (!value) fail("failed to parse OBJ texture coordinate! ");
+            const char *rest = skipSpaces(value);
+            if (!isTokenEnd(*rest) && !parseFloat(rest, next, v)) fail("failed to parse OBJ texture coordinate! ");
+            chunk.texcoords.push_back(u);
+            chunk.texcoords.push_back(v);
+        } else if (keyword == "f") {
+            auto localPositions = static_cast<int32_t>(chunk.positions.size() / 3);
+            auto localTexcoords = static_cast<int32_t>(chunk.texcoords.size() / 2);
+
+            polygon.clear();
+            const char *token = skipSpaces(keywordEnd);
+            while (token < next && *token != '\n' && *token != '\r' && *token != '#' && *token != '\0') {
+                PolygonCorner polygonCorner{{0, NO_TEXCOORD}, false, false};
+                Corner &corner = polygonCorner.corner;
+
+                long position;
+                const char *end = parseIndex(token, next, position);
+                if (!end) fail("failed to parse OBJ face! ");
+                // 1 based, negative counts back from the last vertex defined so far
+                corner.position = static_cast<int32_t>(position > 0 ? position - 1 : localPositions + position);
+                polygonCorner.relativePosition = position < 0;
+
+                if (*end == '/') {
+                    // v/vt, v//vn or v/vt/vn
+                    ++end;
+                    if (*end != '/') {
+                        long texcoord;
+                        end = parseIndex(end, next, texcoord);
+                        if (!end) fail("failed to parse OBJ face! ");
+                        corner.texcoord = static_cast<int32_t>(texcoord > 0 ? texcoord - 1 : localTexcoords + texcoord);
+                        polygonCorner.relativeTexcoord = texcoord < 0;
+                    }
+                    // normals aren't used, only checked for syntax
+                    if (*end == '/') {
+                        long normal;
+                        end = parseIndex(end + 1, next, normal);
+                        if (!end) fail("failed to parse OBJ face! ");
+                    }
+                }
+                if (!isTokenEnd(*end)) fail("failed to parse OBJ face! ");
+
+                polygon.push_back(polygonCorner);
+                token = skipSpaces(end);
+            }
+            if (polygon.size() < 3) fail("OBJ face with fewer than 3 vertices! ");
+
+            for (size_t i = 2; i < polygon.size(); ++i) {
+                for (const PolygonCorner &polygonCorner: {polygon[0], polygon[i - 1], polygon[i]}) {
+                    auto cornerIndex = static_cast<uint32_t>(chunk.corners.size());
+                    if (polygonCorner.relativePosition) chunk.relativePositions.push_back(cornerIndex);
+                    if (polygonCorner.relativeTexcoord) chunk.relativeTexcoords.push_back(cornerIndex);
+                    chunk.corners.push_back(polygonCorner.corner);
+                }
+            }
+        } else if (!keyword.empty() && !isIgnoredStatement(keyword)) {
+            // points, lines, free-form geometry and anything unknown would go missing without a word
+            fail("unsupported OBJ statement! ");
+        }
+
+        p = next;
+    }
+}
+
+void ObjLoader::load(const std::string &path, ThreadPool *pool, std::vector<Vertex> &vertices,
+                     std::vector<uint32_t> &indices) {
+    std::vector<char> file = readFile(path);
+    // the parsers stop at the terminator instead of running off the end of the last line
+    file.push_back('\0');
+    const char *data = file.data();
+    size_t size = file.size() - 1;
+
+    uint32_t threadCount = pool ? pool->getThreadCount() + 1 : 1;
+    // a few chunks per thread evens out chunks that are mostly faces against ones that are mostly vertices
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threadCount * 4, size / MIN_CHUNK_SIZE));
+
+    std::vector<Chunk> chunks(chunkCount);
+    const char *chunkBegin = data;
+    for (size_t i = 0; i < chunkCount; ++i) {
+        const char *chunkEnd = i + 1 == chunkCount ? data + size : data + size * (i + 1) / chunkCount;
+        if (chunkEnd < chunkBegin) chunkEnd = chunkBegin;
+        chunkEnd = i + 1 == chunkCount ? chunkEnd : skipLine(chunkEnd, data + size);
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    runParallel(pool, static_cast<uint32_t>(chunkCount), [&](uint32_t i) { parseChunk(chunks[i]); });
+
+    uint32_t positionCount = 0, texcoordCount = 0, cornerCount = 0;
+    for (auto &chunk: chunks) {
+        chunk.positionOffset = positionCount;
+        chunk.texcoordOffset = texcoordCount;
+        chunk.cornerOffset = cornerCount;
+        positionCount += static_cast<uint32_t>(chunk.positions.size() / 3);
+        texcoordCount += static_cast<uint32_t>(chunk.texcoords.size() / 2);
+        cornerCount += static_cast<uint32_t>(chunk.corners.size());
+    }
+
+    std::vector<float> positions(static_cast<size_t>(positionCount) * 3);
+    std::vector<float> texcoords(static_cast<size_t>(texcoordCount) * 2);
+    std::vector<Corner> corners(cornerCount);
+    runParallel(pool, static_cast<uint32_t>(chunkCount), [&](uint32_t i) {
+        Chunk &chunk = chunks[i];
+        for (uint32_t corner: chunk.relativePositions) {
+            chunk.corners[corner].position += static_cast<int32_t>(chunk.positionOffset);
+        }
+        for (uint32_t corner: chunk.relativeTexcoords) {
+            chunk.corners[corner].texcoord += static_cast<int32_t>(chunk.texcoordOffset);
+        }
+        for (const Corner &corner: chunk.corners) {
+            if (corner.position < 0 || static_cast<uint32_t>(corner.position) >= positionCount ||
+                (corner.texcoord != NO_TEXCOORD &&
+                 (corner.texcoord < 0 || static_cast<uint32_t>(corner.texcoord) >= texcoordCount))) {
+                throw std::runtime_error("OBJ face references a missing vertex! " + path);
+            }
+        }
+
+        std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + chunk.positionOffset * 3);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + chunk.texcoordOffset * 2);
+        std::copy(chunk.corners.begin(), chunk.corners.end(), corners.begin() + chunk.cornerOffset);
+        chunk = Chunk{};
+    });
+
+    auto makeVertex = [&](uint32_t cornerIndex) {
+        const Corner &corner = corners[cornerIndex];
+        Vertex vertex{};
+        vertex.position = {
+                positions[3 * corner.position + 0],
+                positions[3 * corner.position + 1],
+                positions[3 * corner.position + 2],
+        };
+        if (corner.texcoord != NO_TEXCOORD) {
+            vertex.uv = {
+                    texcoords[2 * corner.texcoord + 0],
+                    1.0f - texcoords[2 * corner.texcoord + 1],
+            };
+        }
+        vertex.color = {1.0, 1.0, 1.0};
+        return vertex;
+    };
+    // only for makeKey, every shard welds with its own map
+    VertexWeldMap keyMap;
+    auto shardOf = [&](const Vertex &vertex) {
+        // the top bits, VertexWeldMap uses the low ones within a shard
+        return static_cast<uint32_t>(VertexWeldMap::hash(keyMap.makeKey(vertex)) >> 58) % SHARD_COUNT;
+    };
+
+    // Bucket the corners by shard, keeping each shard's corners in file order: count per (slice, shard), then
+    // every slice scatters its corners behind those of the slices before it.
+    auto sliceCount = static_cast<uint32_t>(chunkCount);
+    std::vector<uint32_t> shardCounts(static_cast<size_t>(sliceCount) * SHARD_COUNT);
+    auto sliceBegin = [&](uint32_t slice) {
+        return static_cast<uint32_t>(static_cast<uint64_t>(cornerCount) * slice / sliceCount);
+    };
+    runParallel(pool, sliceCount, [&](uint32_t slice) {
+        for (uint32_t c = sliceBegin(slice); c < sliceBegin(slice + 1); ++c) {
+            shardCounts[slice * SHARD_COUNT + shardOf(makeVertex(c))]++;
+        }
+    });
+
+    std::vector<uint32_t> shardBegin(SHARD_COUNT + 1);
+    std::vector<uint32_t> sliceOffsets(shardCounts.size());
+    uint32_t offset = 0;
+    for (uint32_t shard = 0; shard < SHARD_COUNT; ++shard) {
+        shardBegin[shard] = offset;
+        for (uint32_t slice = 0; slice < sliceCount; ++slice) {
+            sliceOffsets[slice * SHARD_COUNT + shard] = offset;
+            offset += shardCounts[slice * SHARD_COUNT + shard];
+        }
+    }
+    shardBegin[SHARD_COUNT] = offset;
+
+    std::vector<uint32_t> shardCorners(cornerCount);
+    runParallel(pool, sliceCount, [&](uint32_t slice) {
+        uint32_t *sliceOffset = &sliceOffsets[slice * SHARD_COUNT];
+        for (uint32_t c = sliceBegin(slice); c < sliceBegin(slice + 1); ++c) {
+            shardCorners[sliceOffset[shardOf(makeVertex(c))]++] = c;
+        }
+    });
+
+    // Weld each shard on its own. localIds reuses the slot of the corner it belongs to, firstCorners holds the
+    // corner every unique vertex was first seen at, which decides its final index below.
+    indices.assign(cornerCount, 0);
+    std::vector<uint32_t> localIds(cornerCount);
+    std::vector<std::vector<uint32_t>> firstCorners(SHARD_COUNT);
+    std::vector<uint8_t> isFirst(cornerCount);
+    runParallel(pool, SHARD_COUNT, [&](uint32_t shard) {
+        // from the index count: a closed mesh has about one vertex per six corners, seams add some, more grows
+        VertexWeldMap uniqueVertices;
+        uniqueVertices.reserve((shardBegin[shard + 1] - shardBegin[shard]) / 4);
+        for (uint32_t k = shardBegin[shard]; k < shardBegin[shard + 1]; ++k) {
+            uint32_t c = shardCorners[k];
+            auto [localId, inserted] = uniqueVertices.insert(makeVertex(c),
+                                                             static_cast<uint32_t>(firstCorners[shard].size()));
+            if (inserted) {
+                firstCorners[shard].push_back(c);
+                isFirst[c] = 1;
+            }
+            localIds[k] = localId;
+        }
+    });
+
+    // numbering in order of first use, the same order a serial loop would produce
+    vertices.clear();
+    for (uint32_t c = 0; c < cornerCount; ++c) {
+        if (isFirst[c]) {
+            indices[c] = static_cast<uint32_t>(vertices.size());
+            vertices.push_back(makeVertex(c));
+        }
+    }
+
+    runParallel(pool, SHARD_COUNT, [&](uint32_t shard) {
+        std::vector<uint32_t> finalIds(firstCorners[shard].size());
+        for (size_t i = 0; i < finalIds.size(); ++i) {
+            finalIds[i] = indices[firstCorners[shard][i]];
+        }
+        for (uint32_t k = shardBegin[shard]; k < shardBegin[shard + 1]; ++k) {
+            indices[shardCorners[k]] = finalIds[localIds[k]];
+        }
+    });
+}
@@ -0,0 +1,54 @@
+#ifndef RENDERER_OBJLOADER_H
+#define RENDERER_OBJLOADER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "MeshRenderer.h"
+
+class ThreadPool;
+
+// Loads the subset of OBJ the renderers use and welds identical vertices:
+// - v x y z and vt u [v], anything after those numbers (w, vertex colors) is ignored
+// - f with v, v/vt, v//vn or v/vt/vn corners, 1 based or negative (relative to the last one defined), polygons
+//   fan triangulated, so they have to be convex
+// - vn, o, g, s, usemtl, mtllib and the display attributes are skipped, every face ends up in one mesh
+// Anything else (points, lines, free-form geometry) and malformed numbers throw. Numbers are parsed with
+// std::from_chars, the locale doesn't matter.
+// The file is split into chunks at line boundaries that are parsed in parallel, welding is split into shards by
+// vertex hash so every shard's VertexWeldMap is only touched by one thread. Vertices come out in order of first
+// use, like the serial tinyobj loop did, so the result doesn't depend on the thread count.
+class ObjLoader {
+public:
+    // pool nullptr: everything on the calling thread
+    static void load(const std::string &path, ThreadPool *pool, std::vector<Vertex> &vertices,
+                     std::vector<uint32_t> &indices);
+
+private:
+    static const int32_t NO_TEXCOORD = INT32_MIN;
+
+    // 0 based into the positions/texcoords of the whole file once the chunk offsets are added
+    struct Corner {
+        int32_t position;
+        int32_t texcoord;
+    };
+
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        std::vector<float> positions;
+        std::vector<float> texcoords;
+        std::vector<Corner> corners;
+        // corners with negative (relative) indices, resolved against the chunk's local counts while parsing
+        std::vector<uint32_t> relativePositions;
+        std::vector<uint32_t> relativeTexcoords;
+        uint32_t positionOffset = 0;
+        uint32_t texcoordOffset = 0;
+        uint32_t cornerOffset = 0;
+    };
+
+    static void parseChunk(Chunk &chunk);
+};
+
+#endif //RENDERER_OBJLOADER_H
@@ -9,14 +9,39 @@ void ParticleRenderer::init(Application *application) {
     app = application;
 
     createDescriptorSetLayout();
-    createPipeline();
+    createPipelineLayouts();
+    app->compilePipelines(getPipelineJobs());
 
     createParticleData();
+    createFrameResources();
+}
+
+void ParticleRenderer::createFrameResources() {
+    // the storage buffers are refilled from particles, so changing framesInFlight restarts the simulation
     createUniformBuffers();
     createShaderStorageBuffers();
     createDescriptorSets();
 }
 
+void ParticleRenderer::cleanupFrameResources() {
+    vkFreeDescriptorSets(app->device, app->descriptorPool, static_cast<uint32_t>(computeDescriptorSets.size()),
+                         computeDescriptorSets.data());
+    computeDescriptorSets.clear();
+
+    for (int i = 0; i < uniformBuffers.size(); ++i) {
+        vkDestroyBuffer(app->device, uniformBuffers[i], nullptr);
+        app->allocator.free(uniformBufferMemories[i]);
+
+        vkDestroyBuffer(app->device, shaderStorageBuffers[i], nullptr);
+        app->allocator.free(shaderStorageBufferMemories[i]);
+    }
+    uniformBuffers.clear();
+    uniformBufferMemories.clear();
+    uniformBufferMemoriesMapped.clear();
+    shaderStorageBuffers.clear();
+    shaderStorageBufferMemories.clear();
+}
+
 const DescriptorPoolRequirement ParticleRenderer::getDescriptorPoolRequirement() {
     std::vector<VkDescriptorPoolSize> descriptorPoolSizes{2};
 
@@ -62,11 +87,7 @@ void ParticleRenderer::createDescriptorSetLayout() {
     // no graphicsDescriptorSets
 }
 
-void ParticleRenderer::createPipeline() {
-    auto computeShaderCode = readFile("shaders/particle.comp.spv");
-
-    VkShaderModule computeShaderModule = app->createShaderModule(computeShaderCode);
-
+void ParticleRenderer::createPipelineLayouts() {
     VkPipelineLayoutCreateInfo computePipelineLayoutCreateInfo{};
     computePipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     computePipelineLayoutCreateInfo.setLayoutCount = 1;
@@ -79,6 +100,30 @@ void ParticleRenderer::createPipeline() {
         throw std::runtime_error("failed to create compute pipeline layout!");
     }
 
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{};
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.setLayoutCount = 0;
+    pipelineLayoutCreateInfo.pSetLayouts = VK_NULL_HANDLE;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+    pipelineLayoutCreateInfo.pPushConstantRanges = VK_NULL_HANDLE;
+
+    if (vkCreatePipelineLayout(app->device, &pipelineLayoutCreateInfo, nullptr, &graphicsPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create graphics pipeline layout!");
+    }
+}
+
+std::vector<std::function<void()>> ParticleRenderer::getPipelineJobs() {
+    return {
+            [this] { createComputePipeline(); },
+            [this] { createGraphicsPipeline(); },
+    };
+}
+
+void ParticleRenderer::createComputePipeline() {
+    auto computeShaderCode = readFile("shaders/particle.comp.spv");
+
+    VkShaderModule computeShaderModule = app->createShaderModule(computeShaderCode);
+
     VkPipelineShaderStageCreateInfo computePipelineShaderStageCreateInfo{};
     computePipelineShaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     computePipelineShaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
@@ -93,14 +138,15 @@ void ParticleRenderer::createPipeline() {
     computePipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
     computePipelineCreateInfo.basePipelineIndex = -1;
 
-    if (vkCreateComputePipelines(app->device, VK_NULL_HANDLE, 1, &computePipelineCreateInfo,
+    if (vkCreateComputePipelines(app->device, app->pipelineCache.get(), 1, &computePipelineCreateInfo,
                                  nullptr, &computePipeline) != VK_SUCCESS) {
         throw std::runtime_error("failed to create compute pipeline!");
     }
 
     vkDestroyShaderModule(app->device, computeShaderModule, nullptr);
+}
 
-
+void ParticleRenderer::createGraphicsPipeline() {
     auto vertShaderCode = readFile("shaders/particle.vert.spv");
     auto fragShaderCode = readFile("shaders/particle.frag.spv");
 
@@ -234,17 +280,6 @@ void ParticleRenderer::createPipeline() {
     dynamicStateCreateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
     dynamicStateCreateInfo.pDynamicStates = dynamicStates.data();
 
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{};
-    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutCreateInfo.setLayoutCount = 0;
-    pipelineLayoutCreateInfo.pSetLayouts = VK_NULL_HANDLE;
-    pipelineLayoutCreateInfo.pushConstantRangeCount = 0;
-    pipelineLayoutCreateInfo.pPushConstantRanges = VK_NULL_HANDLE;
-
-    if (vkCreatePipelineLayout(app->device, &pipelineLayoutCreateInfo, nullptr, &graphicsPipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create graphics pipeline layout!");
-    }
-
     VkGraphicsPipelineCreateInfo graphicsPipelineCreateInfo{};
     graphicsPipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
 //    graphicsPipelineCreateInfo.flags
@@ -265,7 +300,7 @@ void ParticleRenderer::createPipeline() {
     graphicsPipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
     graphicsPipelineCreateInfo.basePipelineIndex = -1;
 
-    if (vkCreateGraphicsPipelines(app->device, nullptr, 1, &graphicsPipelineCreateInfo, nullptr,
+    if (vkCreateGraphicsPipelines(app->device, app->pipelineCache.get(), 1, &graphicsPipelineCreateInfo, nullptr,
                                   &graphicsPipeline) != VK_SUCCESS) {
         throw std::runtime_error("failed to create graphics pipeline!");
     }
@@ -275,11 +310,13 @@ void ParticleRenderer::createPipeline() {
 }
 
 void ParticleRenderer::createParticleData() {
-    std::default_random_engine randomEngine((unsigned) time(nullptr));
+    // mt19937 produces the same sequence everywhere, so a fixed seed gives the same particles on every platform
+    std::mt19937 randomEngine(app->randomSeed);
     std::uniform_real_distribution<float> randomDist(0.0, 1.0);
 
-    int width, height;
-    glfwGetWindowSize(app->window, &width, &height);
+    // the window size in windowed mode, and the only size there is when headless
+    float width = static_cast<float>(app->swapChainExtent.width);
+    float height = static_cast<float>(app->swapChainExtent.height);
 
     particles.resize(PARTICLE_COUNT);
     for (auto &particle: particles) {
@@ -294,51 +331,41 @@ void ParticleRenderer::createParticleData() {
 }
 
 void ParticleRenderer::createUniformBuffers() {
-    uniformBuffers.resize(app->MAX_FRAMES_IN_FLIGHT);
-    uniformBufferMemories.resize(app->MAX_FRAMES_IN_FLIGHT);
-    uniformBufferMemoriesMapped.resize(app->MAX_FRAMES_IN_FLIGHT);
+    uniformBuffers.resize(app->framesInFlight);
+    uniformBufferMemories.resize(app->framesInFlight);
+    uniformBufferMemoriesMapped.resize(app->framesInFlight);
 
     VkDeviceSize bufferSize = sizeof(ParticleUniformBufferObject);
-    for (int i = 0; i < app->MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (int i = 0; i < app->framesInFlight; ++i) {
         app->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                           uniformBuffers[i], uniformBufferMemories[i]);
-        vkMapMemory(app->device, uniformBufferMemories[i], 0, bufferSize, 0, &uniformBufferMemoriesMapped[i]);
+        uniformBufferMemoriesMapped[i] = uniformBufferMemories[i].mapped;
     }
 }
 
 void ParticleRenderer::createShaderStorageBuffers() {
-    shaderStorageBuffers.resize(app->MAX_FRAMES_IN_FLIGHT);
-    shaderStorageBufferMemories.resize(app->MAX_FRAMES_IN_FLIGHT);
+    shaderStorageBuffers.resize(app->framesInFlight);
+    shaderStorageBufferMemories.resize(app->framesInFlight);
 
     VkDeviceSize bufferSize = sizeof(Particle) * PARTICLE_COUNT;
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-
-    app->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      stagingBuffer, stagingBufferMemory);
-
-    void *data;
-    vkMapMemory(app->device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, particles.data(), bufferSize);
-    vkUnmapMemory(app->device, stagingBufferMemory);
+    StagingAllocation staging = app->allocateStaging(bufferSize);
+    memcpy(staging.data, particles.data(), bufferSize);
 
+    // Frame i's compute reads buffer i-1 while frame i-1's draw may still be reading it as a vertex buffer on
+    // the graphics queue. An exclusive buffer can't be owned by both queues at once, so share them concurrently.
     for (int i = 0; i < shaderStorageBuffers.size(); ++i) {
         app->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
                                       | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                          shaderStorageBuffers[i], shaderStorageBufferMemories[i]);
-        app->copyBuffer(stagingBuffer, shaderStorageBuffers[i], bufferSize);
+                          shaderStorageBuffers[i], shaderStorageBufferMemories[i], true);
+        app->copyBuffer(app->beginUpload(), staging.buffer, staging.offset, shaderStorageBuffers[i], bufferSize);
     }
-
-    vkDestroyBuffer(app->device, stagingBuffer, nullptr);
-    vkFreeMemory(app->device, stagingBufferMemory, nullptr);
 }
 
 void ParticleRenderer::createDescriptorSets() {
-    computeDescriptorSets.resize(app->MAX_FRAMES_IN_FLIGHT);
-    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(app->MAX_FRAMES_IN_FLIGHT, computeDescriptorSetLayout);
+    computeDescriptorSets.resize(app->framesInFlight);
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts(app->framesInFlight, computeDescriptorSetLayout);
 
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo{};
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -357,7 +384,7 @@ void ParticleRenderer::createDescriptorSets() {
                 sizeof(ParticleUniformBufferObject)
         };
         VkDescriptorBufferInfo ssboBufferInInfo{
-                shaderStorageBuffers[(i - 1 + computeDescriptorSets.size()) % app->MAX_FRAMES_IN_FLIGHT],
+                shaderStorageBuffers[(i - 1 + computeDescriptorSets.size()) % computeDescriptorSets.size()],
                 0,
                 sizeof(Particle) * PARTICLE_COUNT
         };
@@ -401,6 +428,20 @@ void ParticleRenderer::update(float deltaTime, uint32_t frameNum) {
 }
 
 void ParticleRenderer::compute(VkCommandBuffer commandBuffer, uint32_t frameNum) {
+    // the input was written by the previous frame's dispatch, an earlier submission on the same queue
+    VkBufferMemoryBarrier inputBarrier{};
+    inputBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    inputBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    inputBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    inputBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    inputBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    inputBarrier.buffer = shaderStorageBuffers[(frameNum + shaderStorageBuffers.size() - 1) %
+                                               shaderStorageBuffers.size()];
+    inputBarrier.offset = 0;
+    inputBarrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, nullptr, 1, &inputBarrier, 0, nullptr);
+
     vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,computePipelineLayout,0,
                             1, &computeDescriptorSets[frameNum],0, nullptr);
@@ -434,11 +475,5 @@ void ParticleRenderer::cleanup() {
     vkDestroyPipeline(app->device, graphicsPipeline, nullptr);
     vkDestroyPipelineLayout(app->device, graphicsPipelineLayout, nullptr);
 
-    for (int i = 0; i < app->MAX_FRAMES_IN_FLIGHT; ++i) {
-        vkDestroyBuffer(app->device, uniformBuffers[i], nullptr);
-        vkFreeMemory(app->device, uniformBufferMemories[i], nullptr);
-
-        vkDestroyBuffer(app->device, shaderStorageBuffers[i], nullptr);
-        vkFreeMemory(app->device, shaderStorageBufferMemories[i], nullptr);
-    }
+    cleanupFrameResources();
 }
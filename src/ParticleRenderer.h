@@ -4,6 +4,7 @@
 #include <vulkan/vulkan.h>
 #include <glm/glm.hpp>
 #include "Renderer.h"
+#include "MemoryAllocator.h"
 
 class Application;
 
@@ -54,6 +55,10 @@ public:
 
     void init(Application *application) override;
 
+    void createFrameResources() override;
+
+    void cleanupFrameResources() override;
+
     void update(float deltaTime, uint32_t frameNum) override;
 
     void compute(VkCommandBuffer commandBuffer, uint32_t frameNum) override;
@@ -62,7 +67,7 @@ public:
 
     void cleanup() override;
 
-    void createPipeline() override;
+    std::vector<std::function<void()>> getPipelineJobs() override;
 
     const DescriptorPoolRequirement getDescriptorPoolRequirement() override;
 
@@ -80,15 +85,21 @@ private:
     std::vector<Particle> particles;
 
     std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBufferMemories;
+    std::vector<MemoryAllocation> uniformBufferMemories;
     std::vector<void *> uniformBufferMemoriesMapped;
     std::vector<VkBuffer> shaderStorageBuffers;
-    std::vector<VkDeviceMemory> shaderStorageBufferMemories;
+    std::vector<MemoryAllocation> shaderStorageBufferMemories;
 
     void createParticleData();
 
     void createDescriptorSetLayout();
 
+    void createPipelineLayouts();
+
+    void createComputePipeline();
+
+    void createGraphicsPipeline();
+
     void createUniformBuffers();
 
     void createShaderStorageBuffers();
@@ -0,0 +1,137 @@
+#include "PipelineCache.h"
+
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+
+void PipelineCache::init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, const std::string &cachePath) {
+    device = logicalDevice;
+    path = cachePath;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    std::vector<char> data = load();
+    warm = !data.empty();
+    loadedSize = data.size();
+
+    VkPipelineCacheCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+    if (vkCreatePipelineCache(device, &createInfo, nullptr, &cache) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline cache!");
+    }
+}
+
+void PipelineCache::cleanup() {
+    vkDestroyPipelineCache(device, cache, nullptr);
+}
+
+PipelineCache::FileHeader PipelineCache::makeHeader(const std::vector<char> &data) const {
+    FileHeader header{};
+    header.magic = MAGIC;
+    header.fileVersion = FILE_VERSION;
+    header.vendorID = properties.vendorID;
+    header.deviceID = properties.deviceID;
+    header.driverVersion = properties.driverVersion;
+    memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.dataSize = data.size();
+    header.dataHash = hash(data.data(), data.size());
+    return header;
+}
+
+std::vector<char> PipelineCache::load() const {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return {};
+    }
+
+    FileHeader header{};
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return {};
+    }
+    if (header.magic != MAGIC || header.fileVersion != FILE_VERSION || header.vendorID != properties.vendorID ||
+        header.deviceID != properties.deviceID || header.driverVersion != properties.driverVersion ||
+        memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        std::cout << "pipeline cache " << path << " was written for another device or driver, ignoring it\n";
+        return {};
+    }
+
+    // dataSize is from the file too, a truncated or damaged one mustn't make us allocate whatever it says
+    std::error_code error;
+    uintmax_t fileSize = std::filesystem::file_size(path, error);
+    if (error || fileSize < sizeof(header) || header.dataSize != fileSize - sizeof(header)) {
+        std::cout << "pipeline cache " << path << " is damaged, ignoring it\n";
+        return {};
+    }
+
+    std::vector<char> data(header.dataSize);
+    if (!file.read(data.data(), static_cast<std::streamsize>(data.size())) ||
+        hash(data.data(), data.size()) != header.dataHash) {
+        std::cout << "pipeline cache " << path << " is damaged, ignoring it\n";
+        return {};
+    }
+
+    // the driver's own header (VkPipelineCacheHeaderVersionOne) has to agree as well
+    VkPipelineCacheHeaderVersionOne driverHeader{};
+    if (data.size() < sizeof(driverHeader)) {
+        return {};
+    }
+    memcpy(&driverHeader, data.data(), sizeof(driverHeader));
+    if (driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+        driverHeader.vendorID != properties.vendorID || driverHeader.deviceID != properties.deviceID ||
+        memcmp(driverHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        return {};
+    }
+
+    return data;
+}
+
+void PipelineCache::save() {
+    size_t size = 0;
+    if (vkGetPipelineCacheData(device, cache, &size, nullptr) != VK_SUCCESS || size == 0) {
+        return;
+    }
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS) {
+        return;
+    }
+    data.resize(size);
+
+    FileHeader header = makeHeader(data);
+
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "failed to write pipeline cache " << tempPath << "\n";
+            return;
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        file.flush();
+        if (!file) {
+            std::cout << "failed to write pipeline cache " << tempPath << "\n";
+            return;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        std::cout << "failed to replace pipeline cache " << path << ": " << error.message() << "\n";
+        std::filesystem::remove(tempPath, error);
+    }
+}
+
+uint64_t PipelineCache::hash(const char *data, size_t size) {
+    // FNV-1a, this only has to catch truncated or damaged files
+    uint64_t value = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        value ^= static_cast<uint8_t>(data[i]);
+        value *= 0x100000001b3ull;
+    }
+    return value;
+}
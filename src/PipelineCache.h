@@ -0,0 +1,58 @@
+#ifndef RENDERER_PIPELINECACHE_H
+#define RENDERER_PIPELINECACHE_H
+
+#include <vulkan/vulkan.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// A VkPipelineCache shared by every pipeline, loaded from a file at startup and written back at shutdown.
+// The file starts with its own header (vendor, device, driver version, cache UUID, size and hash of the data), so a
+// cache from another GPU or driver, or a truncated write, is dropped instead of being handed to the driver.
+class PipelineCache {
+public:
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, const std::string &path);
+
+    // writes the cache next to the file and renames it over, a crash mid write leaves the old file intact
+    void save();
+
+    void cleanup();
+
+    VkPipelineCache get() const { return cache; }
+
+    // whether init found a valid file, i.e. pipelines are created warm
+    bool isWarm() const { return warm; }
+
+    size_t getLoadedSize() const { return loadedSize; }
+
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t fileVersion;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+        uint64_t dataHash;
+    };
+
+    static const uint32_t MAGIC = 0x43504c52; // "RLPC"
+    static const uint32_t FILE_VERSION = 1;
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties properties{};
+    std::string path;
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    bool warm = false;
+    size_t loadedSize = 0;
+
+    FileHeader makeHeader(const std::vector<char> &data) const;
+
+    // the data if the file exists and was written for this device and driver, empty otherwise
+    std::vector<char> load() const;
+
+    static uint64_t hash(const char *data, size_t size);
+};
+
+#endif //RENDERER_PIPELINECACHE_H
@@ -4,27 +4,70 @@
 #include <vulkan/vulkan.h>
 #include <vector>
 #include <array>
+#include <functional>
 
 class Application;
 
 struct DescriptorPoolRequirement;
 
+// a per frame statistic for the options window, e.g. how many objects culling dropped
+struct RendererCounter {
+    const char *name;
+    uint64_t value;
+};
+
 class Renderer {
 public:
     bool needCompute = false;
     VkPipelineStageFlagBits graphicsWaitComputeStage = VK_PIPELINE_STAGE_NONE;
+    // Records render in Application::earlyRenderPass, betweenRenderPasses outside of any render pass, then
+    // renderLate and the UI in Application::lateRenderPass, instead of everything in one renderPass.
+    bool splitRenderPass = false;
+
+    // CPU side part of init (reading and decoding files), touching neither the device nor the upload batch so
+    // Application can run it on a worker thread ahead of init. init loads whatever is still missing itself.
+    virtual void load(Application *application) {}
 
+    // also called again after cleanup, when a released renderer is selected once more
     virtual void init(Application *application) = 0;
 
+    // Resources with one copy per frame in flight (uniform buffers, descriptor sets, ...), rebuilt when
+    // Application::framesInFlight changes. The device is idle during both calls.
+    virtual void createFrameResources() = 0;
+
+    virtual void cleanupFrameResources() = 0;
+
     virtual void update(float deltaTime, uint32_t frameNum) = 0;
 
     virtual void compute(VkCommandBuffer commandBuffer, uint32_t frameNum) {};
 
+    // Recorded into the graphics command buffer ahead of the render pass, for GPU work render depends on that
+    // can't run on the compute queue, e.g. culling that fills the indirect draws. Barriers are up to the renderer.
+    virtual void prepareRender(VkCommandBuffer commandBuffer, uint32_t frameNum) {};
+
     virtual void render(VkCommandBuffer commandBuffer, uint32_t frameNum) = 0;
 
+    // With splitRenderPass only. The depth render wrote is in DEPTH_STENCIL_READ_ONLY_OPTIMAL and visible to
+    // compute shaders, the color is kept for renderLate.
+    virtual void betweenRenderPasses(VkCommandBuffer commandBuffer, uint32_t frameNum) {};
+
+    virtual void renderLate(VkCommandBuffer commandBuffer, uint32_t frameNum) {};
+
+    // shown in the options window, read once per frame
+    virtual std::vector<RendererCounter> getCounters() { return {}; }
+
     virtual void cleanup() = 0;
 
-    virtual void createPipeline() = 0;
+    // One job per pipeline (SPIR-V load, shader modules, vkCreate*Pipelines), independent of each other so they can
+    // run on Application's thread pool. The pipeline layouts have to exist before the jobs are handed out.
+    virtual std::vector<std::function<void()>> getPipelineJobs() = 0;
+
+    // creates every pipeline on the calling thread, e.g. after the render pass was recreated
+    virtual void createPipeline() {
+        for (auto &job: getPipelineJobs()) {
+            job();
+        }
+    }
 
     virtual const DescriptorPoolRequirement getDescriptorPoolRequirement() = 0;
 
@@ -0,0 +1,59 @@
+#include "StagingRing.h"
+
+#include "Application.h"
+
+void StagingRing::init(Application *application, VkDeviceSize ringSize) {
+    app = application;
+    size = ringSize;
+
+    app->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                      buffer, memory);
+}
+
+void StagingRing::cleanup() {
+    vkDestroyBuffer(app->device, buffer, nullptr);
+    app->allocator.free(memory);
+}
+
+bool StagingRing::tryAllocate(VkDeviceSize allocationSize, VkDeviceSize alignment, StagingAllocation &allocation) {
+    // nothing in flight, start over at the beginning so the whole buffer is available in one piece
+    if (head == tail) {
+        head = tail = (head + size - 1) / size * size;
+    }
+
+    VkDeviceSize start = head;
+    VkDeviceSize offset = start % size;
+    VkDeviceSize alignedOffset = (offset + alignment - 1) / alignment * alignment;
+
+    // never split an allocation across the end, skip the rest of the buffer instead
+    if (alignedOffset + allocationSize > size) {
+        start += size - offset;
+        alignedOffset = 0;
+    } else {
+        start += alignedOffset - offset;
+    }
+
+    VkDeviceSize end = start + allocationSize;
+    if (end - tail > size) {
+        return false;
+    }
+
+    head = end;
+    allocation.buffer = buffer;
+    allocation.offset = alignedOffset;
+    allocation.data = static_cast<char *>(memory.mapped) + alignedOffset;
+    return true;
+}
+
+void StagingRing::markSubmitted(uint64_t token) {
+    if (!submissions.empty() && submissions.back().second == head) return;
+    submissions.emplace_back(token, head);
+}
+
+void StagingRing::reclaim(uint64_t completedToken) {
+    while (!submissions.empty() && submissions.front().first <= completedToken) {
+        tail = submissions.front().second;
+        submissions.pop_front();
+    }
+}
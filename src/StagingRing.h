@@ -0,0 +1,54 @@
+#ifndef RENDERER_STAGINGRING_H
+#define RENDERER_STAGINGRING_H
+
+#include <vulkan/vulkan.h>
+#include <deque>
+#include <utility>
+
+#include "MemoryAllocator.h"
+
+class Application;
+
+struct StagingAllocation {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    void *data = nullptr;
+};
+
+// A single persistently mapped host visible buffer handed out front to back. Space is given back in
+// submission order once the upload that read it has completed, so allocating is a bump of the head.
+class StagingRing {
+public:
+    void init(Application *application, VkDeviceSize ringSize);
+
+    void cleanup();
+
+    // false when the ring is too full until older uploads complete
+    bool tryAllocate(VkDeviceSize size, VkDeviceSize alignment, StagingAllocation &allocation);
+
+    // everything allocated since the previous call is read by the upload identified by token
+    void markSubmitted(uint64_t token);
+
+    // frees the space of every upload up to and including completedToken
+    void reclaim(uint64_t completedToken);
+
+    bool hasSubmissions() const { return !submissions.empty(); }
+
+    VkDeviceSize getSize() const { return size; }
+
+    VkDeviceSize getUsedBytes() const { return head - tail; }
+
+private:
+    Application *app;
+    VkBuffer buffer = VK_NULL_HANDLE;
+    MemoryAllocation memory;
+    VkDeviceSize size = 0;
+
+    // absolute byte positions that only ever grow, position in the buffer is value % size
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    // (upload token, head when it was submitted)
+    std::deque<std::pair<uint64_t, VkDeviceSize>> submissions;
+};
+
+#endif //RENDERER_STAGINGRING_H
@@ -0,0 +1,102 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+void ThreadPool::init(uint32_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    stopping = false;
+    workers.reserve(threadCount);
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+void ThreadPool::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> job) {
+    std::packaged_task<void()> task(std::move(job));
+    std::future<void> future = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(task));
+    }
+    jobAvailable.notify_one();
+    return future;
+}
+
+void ThreadPool::parallelFor(uint32_t count, const std::function<void(uint32_t)> &body) {
+    // Shared with the helper jobs, which may only start running once every index is done (or after this returned,
+    // when all workers were busy) and then must find nothing left to do rather than a dangling body.
+    struct State {
+        std::atomic<uint32_t> next{0};
+        uint32_t count = 0;
+        const std::function<void(uint32_t)> *body = nullptr;
+        std::mutex mutex;
+        std::condition_variable allDone;
+        uint32_t done = 0;
+        std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    state->count = count;
+    state->body = &body;
+
+    auto run = [](State &s) {
+        uint32_t index;
+        while ((index = s.next.fetch_add(1)) < s.count) {
+            std::exception_ptr error;
+            try {
+                (*s.body)(index);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (error && !s.error) s.error = error;
+            if (++s.done == s.count) s.allDone.notify_all();
+        }
+    };
+
+    uint32_t helpers = std::min(getThreadCount(), count > 0 ? count - 1 : 0);
+    for (uint32_t i = 0; i < helpers; ++i) {
+        submit([state, run] { run(*state); });
+    }
+    run(*state);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->allDone.wait(lock, [&] { return state->done == state->count; });
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+
+            task = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef RENDERER_THREADPOOL_H
+#define RENDERER_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+
+// A fixed set of worker threads running submitted jobs in FIFO order. Exceptions thrown by a job end up in its
+// future and are rethrown by get() on the thread that waits for it.
+class ThreadPool {
+public:
+    // threadCount 0: one worker per hardware thread
+    void init(uint32_t threadCount = 0);
+
+    // finishes every job already submitted before joining the workers
+    void cleanup();
+
+    // joins the workers if an exception skipped cleanup, a joinable std::thread would terminate
+    ~ThreadPool() { cleanup(); }
+
+    std::future<void> submit(std::function<void()> job);
+
+    // Runs body(0) .. body(count - 1) on the calling thread and up to getThreadCount() workers, returning when all
+    // of them are done. The calling thread takes part instead of blocking, so this is safe to call from a job on
+    // this pool. The first exception thrown by body is rethrown here.
+    void parallelFor(uint32_t count, const std::function<void(uint32_t)> &body);
+
+    uint32_t getThreadCount() const { return static_cast<uint32_t>(workers.size()); }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::packaged_task<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    bool stopping = false;
+
+    void workerLoop();
+};
+
+#endif //RENDERER_THREADPOOL_H
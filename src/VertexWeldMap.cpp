@@ -0,0 +1,140 @@
+#include "VertexWeldMap.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+static_assert(sizeof(Vertex) == sizeof(VertexWeldMap::Key), "a key holds every float of a Vertex");
+
+static const uint64_t LOW_BITS = 0x0101010101010101ull;
+static const uint64_t HIGH_BITS = 0x8080808080808080ull;
+
+// bytes of group equal to tag have their high bit set (a byte after a real match may be a false positive, keys
+// are compared anyway)
+static uint64_t matchByte(uint64_t group, uint8_t tag) {
+    uint64_t x = group ^ (LOW_BITS * tag);
+    return (x - LOW_BITS) & ~x & HIGH_BITS;
+}
+
+static uint8_t tagOf(uint64_t hash) {
+    // the low bits, the top ones pick ObjLoader's shard and the middle ones the group
+    return static_cast<uint8_t>(hash & 0x7f);
+}
+
+void VertexWeldMap::reserve(size_t reserveCount) {
+    // at most 7/8 full
+    size_t slots = reserveCount + reserveCount / 7 + 1;
+    size_t groupCount = std::bit_ceil((slots + GROUP_SIZE - 1) / GROUP_SIZE);
+    if (groupCount > controlGroups.size()) {
+        rehash(groupCount);
+    }
+}
+
+VertexWeldMap::Key VertexWeldMap::makeKey(const Vertex &vertex) const {
+    float floats[8];
+    memcpy(floats, &vertex, sizeof(floats));
+
+    Key key;
+    for (int i = 0; i < 8; ++i) {
+        if (quantization > 0) {
+            // clamped rather than undefined when a coordinate is more than 2^31 steps out
+            double step = std::clamp(std::floor(static_cast<double>(floats[i]) / quantization),
+                                     static_cast<double>(INT32_MIN), static_cast<double>(INT32_MAX));
+            key[i] = static_cast<uint32_t>(static_cast<int32_t>(step));
+        } else {
+            // +0 and -0 compare equal as floats but not as bits
+            float value = floats[i] == 0.0f ? 0.0f : floats[i];
+            memcpy(&key[i], &value, sizeof(value));
+        }
+    }
+    return key;
+}
+
+uint64_t VertexWeldMap::hash(const Key &key) {
+    uint64_t words[4];
+    memcpy(words, key.data(), sizeof(words));
+
+    // multiply-xorshift per word, then the murmur3 finalizer so every output bit depends on every input bit
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (uint64_t word: words) {
+        h ^= word * 0xbf58476d1ce4e5b9ull;
+        h = std::rotl(h, 31) * 0x94d049bb133111ebull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t VertexWeldMap::findEmptySlot(uint64_t hash) const {
+    // triangular probing visits every group once the group count is a power of two
+    size_t group = (hash >> 7) & groupMask;
+    for (size_t step = 1;; ++step) {
+        uint64_t empty = controlGroups[group] & HIGH_BITS;
+        if (empty) {
+            return group * GROUP_SIZE + std::countr_zero(empty) / 8;
+        }
+        group = (group + step) & groupMask;
+    }
+}
+
+void VertexWeldMap::rehash(size_t groupCount) {
+    std::vector<uint64_t> oldControlGroups = std::move(controlGroups);
+    std::vector<Key> oldKeys = std::move(keys);
+    std::vector<uint32_t> oldValues = std::move(values);
+
+    controlGroups.assign(groupCount, LOW_BITS * EMPTY);
+    keys.resize(groupCount * GROUP_SIZE);
+    values.resize(groupCount * GROUP_SIZE);
+    groupMask = groupCount - 1;
+
+    for (size_t slot = 0; slot < oldKeys.size(); ++slot) {
+        auto control = static_cast<uint8_t>(oldControlGroups[slot / GROUP_SIZE] >> (slot % GROUP_SIZE * 8));
+        if (control & EMPTY) continue;
+
+        uint64_t h = hash(oldKeys[slot]);
+        size_t newSlot = findEmptySlot(h);
+        controlGroups[newSlot / GROUP_SIZE] &= ~(0xffull << (newSlot % GROUP_SIZE * 8));
+        controlGroups[newSlot / GROUP_SIZE] |= static_cast<uint64_t>(tagOf(h)) << (newSlot % GROUP_SIZE * 8);
+        keys[newSlot] = oldKeys[slot];
+        values[newSlot] = oldValues[slot];
+    }
+}
+
+std::pair<uint32_t, bool> VertexWeldMap::insert(const Vertex &vertex, uint32_t value) {
+    if ((count + 1) * 8 > controlGroups.size() * GROUP_SIZE * 7) {
+        rehash(controlGroups.empty() ? 1 : controlGroups.size() * 2);
+    }
+
+    Key key = makeKey(vertex);
+    uint64_t h = hash(key);
+    uint8_t tag = tagOf(h);
+
+    size_t group = (h >> 7) & groupMask;
+    for (size_t step = 1;; ++step) {
+        uint64_t controls = controlGroups[group];
+        for (uint64_t match = matchByte(controls, tag); match; match &= match - 1) {
+            size_t slot = group * GROUP_SIZE + std::countr_zero(match) / 8;
+            if (keys[slot] == key) {
+                return {values[slot], false};
+            }
+        }
+
+        // an empty slot ends the probe sequence: the key would have been placed here or earlier
+        uint64_t empty = controls & HIGH_BITS;
+        if (empty) {
+            size_t byte = std::countr_zero(empty) / 8;
+            size_t slot = group * GROUP_SIZE + byte;
+            controlGroups[group] &= ~(0xffull << (byte * 8));
+            controlGroups[group] |= static_cast<uint64_t>(tag) << (byte * 8);
+            keys[slot] = key;
+            values[slot] = value;
+            count++;
+            return {value, true};
+        }
+        group = (group + step) & groupMask;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef RENDERER_VERTEXWELDMAP_H
+#define RENDERER_VERTEXWELDMAP_H
+
+#include <vector>
+#include <array>
+#include <utility>
+#include <cstdint>
+
+#include "MeshRenderer.h"
+
+// Maps vertices to the index of the first equal one, for welding meshes. Open addressing over flat arrays
+// instead of one node per vertex: a control byte per slot (7 bits of the hash, or empty) is scanned 8 slots at a
+// time in a single 64-bit word, and the 32 byte key is only compared when the hash bits already match.
+// Insert only, there is nothing to weld apart again.
+class VertexWeldMap {
+public:
+    using Key = std::array<uint32_t, 8>;
+
+    // 0: keys are the exact float bits (with -0 folded into 0, matching Vertex::operator==).
+    // Otherwise position, color and uv are snapped to multiples of quantization, so vertices closer than that
+    // (and on the same side of a grid line) weld. Set before the first insert.
+    float quantization = 0;
+
+    void reserve(size_t count);
+
+    // (value of the equal vertex inserted before, false), or (value, true) after inserting it
+    std::pair<uint32_t, bool> insert(const Vertex &vertex, uint32_t value);
+
+    size_t size() const { return count; }
+
+    Key makeKey(const Vertex &vertex) const;
+
+    // all 64 bits depend on every key bit, unlike std::hash<Vertex>
+    static uint64_t hash(const Key &key);
+
+private:
+    static const uint8_t EMPTY = 0x80;
+    static const size_t GROUP_SIZE = 8;
+
+    std::vector<uint64_t> controlGroups;
+    std::vector<Key> keys;
+    std::vector<uint32_t> values;
+    size_t count = 0;
+    size_t groupMask = 0;
+
+    void rehash(size_t groupCount);
+
+    size_t findEmptySlot(uint64_t hash) const;
+};
+
+#endif //RENDERER_VERTEXWELDMAP_H
@@ -1,11 +1,106 @@
 #include <iostream>
+#include <string>
+#include <cstring>
+#include <cctype>
 
 #include "Application.h"
+#include "LoaderBenchmark.h"
 
-int main() {
+int main(int argc, char **argv) {
     Application application{};
 
     try {
+        // --headless [frames] [--output <file.ppm>]
+        // --bench <frames> [--warmup <frames>] [--report <file.json>]
+        // --renderer <Mesh|Particle> [--hint <Mesh|Particle>] [--release-after <seconds, negative for never>]
+        // --no-mesh-optimization, --compact-vertices [--vertex-colors], --split-vertex-streams, --depth-prepass,
+        // --split-submeshes, --meshlet-culling, --instances <count> [--gpu-culling] [--occlusion-culling]
+        // --lods [--lod-error <pixels>]
+        // --obj-bench <file.obj|grid:n> [--threads <max>], --weld-bench <file.obj|grid:n>,
+        // --lod-bench <file.obj|grid:n>, --optimize-bench <file.obj|grid:n>, run instead of the renderer
+        std::string objBenchPath;
+        std::string weldBenchPath;
+        std::string lodBenchPath;
+        std::string optimizeBenchPath;
+        LoaderBenchmark loaderBenchmark;
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--headless") == 0) {
+                application.headless = true;
+                // optional, --bench decides the frame count when benchmarking headless
+                if (i + 1 < argc && isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                    application.headlessFrameCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+                }
+            } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+                application.headlessOutputPath = argv[++i];
+            } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+                application.benchFrameCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+            } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+                application.benchWarmupFrames = static_cast<uint32_t>(std::stoul(argv[++i]));
+            } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+                application.benchReportPath = argv[++i];
+            } else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+                application.setRenderer(argv[++i]);
+            } else if (strcmp(argv[i], "--hint") == 0 && i + 1 < argc) {
+                application.hintRenderer(argv[++i]);
+            } else if (strcmp(argv[i], "--release-after") == 0 && i + 1 < argc) {
+                application.rendererReleaseDelay = std::stof(argv[++i]);
+            } else if (strcmp(argv[i], "--no-mesh-optimization") == 0) {
+                application.optimizeMeshes = false;
+            } else if (strcmp(argv[i], "--compact-vertices") == 0) {
+                application.compactVertices = true;
+            } else if (strcmp(argv[i], "--vertex-colors") == 0) {
+                application.compactVertexColors = true;
+            } else if (strcmp(argv[i], "--split-vertex-streams") == 0) {
+                application.splitVertexStreams = true;
+            } else if (strcmp(argv[i], "--split-submeshes") == 0) {
+                application.splitSubmeshes = true;
+            } else if (strcmp(argv[i], "--depth-prepass") == 0) {
+                application.depthPrepass = true;
+            } else if (strcmp(argv[i], "--meshlet-culling") == 0) {
+                application.meshletCulling = true;
+            } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+                application.sceneInstanceCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+            } else if (strcmp(argv[i], "--gpu-culling") == 0) {
+                application.gpuCulling = true;
+            } else if (strcmp(argv[i], "--occlusion-culling") == 0) {
+                application.occlusionCulling = true;
+            } else if (strcmp(argv[i], "--lods") == 0) {
+                application.meshLods = true;
+            } else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc) {
+                application.lodPixelError = std::stof(argv[++i]);
+                if (!(application.lodPixelError > 0)) {
+                    throw std::runtime_error("--lod-error needs a positive number of pixels");
+                }
+            } else if (strcmp(argv[i], "--obj-bench") == 0 && i + 1 < argc) {
+                objBenchPath = argv[++i];
+            } else if (strcmp(argv[i], "--weld-bench") == 0 && i + 1 < argc) {
+                weldBenchPath = argv[++i];
+            } else if (strcmp(argv[i], "--lod-bench") == 0 && i + 1 < argc) {
+                lodBenchPath = argv[++i];
+            } else if (strcmp(argv[i], "--optimize-bench") == 0 && i + 1 < argc) {
+                optimizeBenchPath = argv[++i];
+            } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                loaderBenchmark.maxThreads = static_cast<uint32_t>(std::stoul(argv[++i]));
+            } else {
+                throw std::runtime_error("unknown argument: " + std::string(argv[i]));
+            }
+        }
+
+        if (!objBenchPath.empty()) {
+            loaderBenchmark.runObjScaling(objBenchPath, std::cout);
+            return EXIT_SUCCESS;
+        }
+        if (!weldBenchPath.empty()) {
+            loaderBenchmark.runWeldMaps(weldBenchPath, std::cout);
+            return EXIT_SUCCESS;
+        }
+        if (!lodBenchPath.empty()) {
+            return loaderBenchmark.runLodCheck(lodBenchPath, std::cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (!optimizeBenchPath.empty()) {
+            return loaderBenchmark.runOptimizerCheck(optimizeBenchPath, std::cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
         application.run();
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
@@ -13,4 +108,4 @@ int main() {
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
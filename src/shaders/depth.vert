@@ -0,0 +1,24 @@
+#version 450
+
+layout (binding = 0) uniform UniformBufferObject {
+    mat4 model;
+    mat4 view;
+    mat4 projection;
+    vec4 positionScale;
+    vec4 positionOffset;
+} ubo;
+
+layout (std430, binding = 2) readonly buffer Instances {
+    mat4 instanceModels[];
+};
+
+layout (location = 0) in vec3 position;
+
+// the same as shader.vert, the depth prepass compares for equality
+invariant gl_Position;
+
+void main() {
+    vec3 objectPosition = position * ubo.positionScale.xyz + ubo.positionOffset.xyz;
+    gl_Position = ubo.projection * ubo.view * ubo.model * instanceModels[gl_InstanceIndex] *
+                  vec4(objectPosition, 1.0);
+}
\ No newline at end of file
@@ -4,8 +4,14 @@ layout (binding = 0) uniform UniformBufferObject {
     mat4 model;
     mat4 view;
     mat4 projection;
+    vec4 positionScale;
+    vec4 positionOffset;
 } ubo;
 
+layout (std430, binding = 2) readonly buffer Instances {
+    mat4 instanceModels[];
+};
+
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 color;
 layout (location = 2) in vec2 uv;
@@ -13,8 +19,14 @@ layout (location = 2) in vec2 uv;
 layout (location = 0) out vec3 fragColor;
 layout (location = 1) out vec2 fragCoord;
 
+// the same as depth.vert, the depth prepass compares for equality
+invariant gl_Position;
+
 void main() {
-    gl_Position = ubo.projection * ubo.view * ubo.model * vec4(position, 1.0);
+    // compact vertices store the position normalized to the mesh bounds
+    vec3 objectPosition = position * ubo.positionScale.xyz + ubo.positionOffset.xyz;
+    gl_Position = ubo.projection * ubo.view * ubo.model * instanceModels[gl_InstanceIndex] *
+                  vec4(objectPosition, 1.0);
     fragColor = color;
     fragCoord = uv;
 }
\ No newline at end of file